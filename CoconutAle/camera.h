@@ -0,0 +1,282 @@
+#ifndef CA_CAMERA_H
+#define CA_CAMERA_H
+
+#include "math.h"
+#include "simd.h"
+
+#include <cmath>
+#include <limits>
+#include <vector>
+
+namespace ca {
+
+// Matches nanort::vsafe_inverse: tiny components turn into a signed infinity
+// instead of a huge finite value.
+inline float safe_inverse(float v) {
+    if (std::fabs(v) < std::numeric_limits<float>::epsilon()) {
+        return std::copysign(std::numeric_limits<float>::infinity(), v);
+    }
+    return 1.0f / v;
+}
+
+#if defined(CA_HAS_SSE2)
+inline __m128 safe_inverse_ps(__m128 v) {
+    const __m128 abs_mask = _mm_castsi128_ps(_mm_set1_epi32(0x7fffffff));
+    const __m128 sign_mask = _mm_castsi128_ps(_mm_set1_epi32((int)0x80000000));
+    const __m128 eps = _mm_set1_ps(std::numeric_limits<float>::epsilon());
+    const __m128 inf = _mm_set1_ps(std::numeric_limits<float>::infinity());
+
+    const __m128 tiny = _mm_cmplt_ps(_mm_and_ps(v, abs_mask), eps);
+    const __m128 signed_inf = _mm_or_ps(inf, _mm_and_ps(v, sign_mask));
+    const __m128 inv = _mm_div_ps(_mm_set1_ps(1.0f), v);
+    return _mm_or_ps(_mm_and_ps(tiny, signed_inf), _mm_andnot_ps(tiny, inv));
+}
+#endif
+
+#if defined(CA_HAS_AVX_KERNELS)
+CA_TARGET_AVX2 inline __m256 safe_inverse_ps256(__m256 v) {
+    const __m256 abs_mask = _mm256_castsi256_ps(_mm256_set1_epi32(0x7fffffff));
+    const __m256 sign_mask = _mm256_castsi256_ps(_mm256_set1_epi32((int)0x80000000));
+    const __m256 eps = _mm256_set1_ps(std::numeric_limits<float>::epsilon());
+    const __m256 inf = _mm256_set1_ps(std::numeric_limits<float>::infinity());
+
+    const __m256 tiny = _mm256_cmp_ps(_mm256_and_ps(v, abs_mask), eps, _CMP_LT_OQ);
+    const __m256 signed_inf = _mm256_or_ps(inf, _mm256_and_ps(v, sign_mask));
+    const __m256 inv = _mm256_div_ps(_mm256_set1_ps(1.0f), v);
+    return _mm256_blendv_ps(inv, signed_inf, tiny);
+}
+
+// AVX-512F has no float and/or (that is DQ), so the bits go through the
+// integer ones.
+CA_TARGET_AVX512 inline __m512 safe_inverse_ps512(__m512 v) {
+    const __m512i bits = _mm512_castps_si512(v);
+    const __m512 abs = _mm512_castsi512_ps(
+        _mm512_and_epi32(bits, _mm512_set1_epi32(0x7fffffff)));
+    const __m512 signed_inf = _mm512_castsi512_ps(_mm512_or_epi32(
+        _mm512_and_epi32(bits, _mm512_set1_epi32((int)0x80000000)),
+        _mm512_set1_epi32(0x7f800000)));
+    const __m512 eps = _mm512_set1_ps(std::numeric_limits<float>::epsilon());
+
+    const __mmask16 tiny = _mm512_cmp_ps_mask(abs, eps, _CMP_LT_OQ);
+    const __m512 inv = _mm512_div_ps(_mm512_set1_ps(1.0f), v);
+    return _mm512_mask_blend_ps(tiny, inv, signed_inf);
+}
+#endif
+
+// One ray per pixel, row major, split into one array per component so a row
+// can be written (and later read) four or more lanes at a time.
+struct RayBufferSoA {
+    int width;
+    int height;
+    std::vector<float> org_x, org_y, org_z;
+    std::vector<float> dir_x, dir_y, dir_z;
+    std::vector<float> inv_x, inv_y, inv_z;
+
+    RayBufferSoA() : width(0), height(0) {}
+
+    void resize(int w, int h) {
+        if (w == width && h == height) {
+            return;
+        }
+        width = w;
+        height = h;
+        const size_t n = (size_t)w * (size_t)h;
+        org_x.resize(n); org_y.resize(n); org_z.resize(n);
+        dir_x.resize(n); dir_y.resize(n); dir_z.resize(n);
+        inv_x.resize(n); inv_y.resize(n); inv_z.resize(n);
+    }
+};
+
+// Pinhole camera with the same projection the renderer always used:
+//     dir(x, y) = look * (x / width - 0.5, y / height - 0.5, 1)
+// That is linear in x and y, so the rotated frustum corner and the two pixel
+// steps are computed once per frame and each pixel costs two multiply-adds
+// per component instead of a matrix multiply.
+struct CameraRayGenerator {
+    Vec3f eye;
+    Vec3f corner;   // direction through pixel (0, 0)
+    Vec3f step_x;   // direction change per pixel along x
+    Vec3f step_y;   // direction change per pixel along y
+
+    void setup(const Mat3f& look, const Vec3f& eye_pos, int width, int height) {
+        eye = eye_pos;
+        corner = mat_vec_mult(look, Vec3f{-0.5f, -0.5f, 1.0f});
+        step_x = mat_vec_mult(look, Vec3f{1.0f / (float)width, 0.0f, 0.0f});
+        step_y = mat_vec_mult(look, Vec3f{0.0f, 1.0f / (float)height, 0.0f});
+    }
+
+    // direction through a (possibly fractional) pixel position
+    Vec3f direction(float x, float y) const {
+        const Vec3f row = corner + step_y * y;
+        return {row.x + step_x.x * x, row.y + step_x.y * x, row.z + step_x.z * x};
+    }
+
+    // One row of the buffer, starting at its first pixel.
+    struct Row {
+        float * org_x, * org_y, * org_z;
+        float * dir_x, * dir_y, * dir_z;
+        float * inv_x, * inv_y, * inv_z;
+        Vec3f dir;      // direction through the row's first pixel
+        int width;
+    };
+
+    Row row(RayBufferSoA * rays, int y) const {
+        const size_t base = (size_t)y * (size_t)rays->width;
+        Row r;
+        r.org_x = &rays->org_x[base];
+        r.org_y = &rays->org_y[base];
+        r.org_z = &rays->org_z[base];
+        r.dir_x = &rays->dir_x[base];
+        r.dir_y = &rays->dir_y[base];
+        r.dir_z = &rays->dir_z[base];
+        r.inv_x = &rays->inv_x[base];
+        r.inv_y = &rays->inv_y[base];
+        r.inv_z = &rays->inv_z[base];
+        r.dir = corner + step_y * (float)y;
+        r.width = rays->width;
+        return r;
+    }
+
+    // The row_* kernels fill whole vectors from the start of the row and
+    // return how many pixels they did; generate_row() does the rest.
+#if defined(CA_HAS_SSE2)
+    int row_sse2(const Row& r) const {
+        const __m128 lane = _mm_set_ps(3.0f, 2.0f, 1.0f, 0.0f);
+        const __m128 ex = _mm_set1_ps(eye.x);
+        const __m128 ey = _mm_set1_ps(eye.y);
+        const __m128 ez = _mm_set1_ps(eye.z);
+        const __m128 rx = _mm_set1_ps(r.dir.x);
+        const __m128 ry = _mm_set1_ps(r.dir.y);
+        const __m128 rz = _mm_set1_ps(r.dir.z);
+        const __m128 sx = _mm_set1_ps(step_x.x);
+        const __m128 sy = _mm_set1_ps(step_x.y);
+        const __m128 sz = _mm_set1_ps(step_x.z);
+        int x = 0;
+        for (; x + 4 <= r.width; x += 4) {
+            const __m128 fx = _mm_add_ps(_mm_set1_ps((float)x), lane);
+            const __m128 dx = _mm_add_ps(rx, _mm_mul_ps(sx, fx));
+            const __m128 dy = _mm_add_ps(ry, _mm_mul_ps(sy, fx));
+            const __m128 dz = _mm_add_ps(rz, _mm_mul_ps(sz, fx));
+            _mm_storeu_ps(r.org_x + x, ex);
+            _mm_storeu_ps(r.org_y + x, ey);
+            _mm_storeu_ps(r.org_z + x, ez);
+            _mm_storeu_ps(r.dir_x + x, dx);
+            _mm_storeu_ps(r.dir_y + x, dy);
+            _mm_storeu_ps(r.dir_z + x, dz);
+            _mm_storeu_ps(r.inv_x + x, safe_inverse_ps(dx));
+            _mm_storeu_ps(r.inv_y + x, safe_inverse_ps(dy));
+            _mm_storeu_ps(r.inv_z + x, safe_inverse_ps(dz));
+        }
+        return x;
+    }
+#endif
+
+#if defined(CA_HAS_AVX_KERNELS)
+    CA_TARGET_AVX2 int row_avx2(const Row& r) const {
+        const __m256 lane = _mm256_set_ps(7.0f, 6.0f, 5.0f, 4.0f, 3.0f, 2.0f, 1.0f, 0.0f);
+        const __m256 ex = _mm256_set1_ps(eye.x);
+        const __m256 ey = _mm256_set1_ps(eye.y);
+        const __m256 ez = _mm256_set1_ps(eye.z);
+        const __m256 rx = _mm256_set1_ps(r.dir.x);
+        const __m256 ry = _mm256_set1_ps(r.dir.y);
+        const __m256 rz = _mm256_set1_ps(r.dir.z);
+        const __m256 sx = _mm256_set1_ps(step_x.x);
+        const __m256 sy = _mm256_set1_ps(step_x.y);
+        const __m256 sz = _mm256_set1_ps(step_x.z);
+        int x = 0;
+        for (; x + 8 <= r.width; x += 8) {
+            const __m256 fx = _mm256_add_ps(_mm256_set1_ps((float)x), lane);
+            const __m256 dx = _mm256_add_ps(rx, _mm256_mul_ps(sx, fx));
+            const __m256 dy = _mm256_add_ps(ry, _mm256_mul_ps(sy, fx));
+            const __m256 dz = _mm256_add_ps(rz, _mm256_mul_ps(sz, fx));
+            _mm256_storeu_ps(r.org_x + x, ex);
+            _mm256_storeu_ps(r.org_y + x, ey);
+            _mm256_storeu_ps(r.org_z + x, ez);
+            _mm256_storeu_ps(r.dir_x + x, dx);
+            _mm256_storeu_ps(r.dir_y + x, dy);
+            _mm256_storeu_ps(r.dir_z + x, dz);
+            _mm256_storeu_ps(r.inv_x + x, safe_inverse_ps256(dx));
+            _mm256_storeu_ps(r.inv_y + x, safe_inverse_ps256(dy));
+            _mm256_storeu_ps(r.inv_z + x, safe_inverse_ps256(dz));
+        }
+        return x;
+    }
+
+    CA_TARGET_AVX512 int row_avx512(const Row& r) const {
+        const __m512 lane = _mm512_set_ps(
+            15.0f, 14.0f, 13.0f, 12.0f, 11.0f, 10.0f, 9.0f, 8.0f,
+            7.0f, 6.0f, 5.0f, 4.0f, 3.0f, 2.0f, 1.0f, 0.0f);
+        const __m512 ex = _mm512_set1_ps(eye.x);
+        const __m512 ey = _mm512_set1_ps(eye.y);
+        const __m512 ez = _mm512_set1_ps(eye.z);
+        const __m512 rx = _mm512_set1_ps(r.dir.x);
+        const __m512 ry = _mm512_set1_ps(r.dir.y);
+        const __m512 rz = _mm512_set1_ps(r.dir.z);
+        const __m512 sx = _mm512_set1_ps(step_x.x);
+        const __m512 sy = _mm512_set1_ps(step_x.y);
+        const __m512 sz = _mm512_set1_ps(step_x.z);
+        int x = 0;
+        for (; x + 16 <= r.width; x += 16) {
+            const __m512 fx = _mm512_add_ps(_mm512_set1_ps((float)x), lane);
+            const __m512 dx = _mm512_add_ps(rx, _mm512_mul_ps(sx, fx));
+            const __m512 dy = _mm512_add_ps(ry, _mm512_mul_ps(sy, fx));
+            const __m512 dz = _mm512_add_ps(rz, _mm512_mul_ps(sz, fx));
+            _mm512_storeu_ps(r.org_x + x, ex);
+            _mm512_storeu_ps(r.org_y + x, ey);
+            _mm512_storeu_ps(r.org_z + x, ez);
+            _mm512_storeu_ps(r.dir_x + x, dx);
+            _mm512_storeu_ps(r.dir_y + x, dy);
+            _mm512_storeu_ps(r.dir_z + x, dz);
+            _mm512_storeu_ps(r.inv_x + x, safe_inverse_ps512(dx));
+            _mm512_storeu_ps(r.inv_y + x, safe_inverse_ps512(dy));
+            _mm512_storeu_ps(r.inv_z + x, safe_inverse_ps512(dz));
+        }
+        return x;
+    }
+#endif
+
+    void generate_row(RayBufferSoA * rays, int y, CpuLevel level) const {
+        const Row r = row(rays, y);
+        int x = 0;
+        switch (level) {
+#if defined(CA_HAS_AVX_KERNELS)
+        case CPU_AVX512:
+            x = row_avx512(r);
+            break;
+        case CPU_AVX2:
+            x = row_avx2(r);
+            break;
+#endif
+#if defined(CA_HAS_SSE2)
+        case CPU_SSE2:
+            x = row_sse2(r);
+            break;
+#endif
+        default:
+            break;
+        }
+        for (; x < r.width; x++) {
+            const float fx = (float)x;
+            r.org_x[x] = eye.x;
+            r.org_y[x] = eye.y;
+            r.org_z[x] = eye.z;
+            r.dir_x[x] = r.dir.x + step_x.x * fx;
+            r.dir_y[x] = r.dir.y + step_x.y * fx;
+            r.dir_z[x] = r.dir.z + step_x.z * fx;
+            r.inv_x[x] = safe_inverse(r.dir_x[x]);
+            r.inv_y[x] = safe_inverse(r.dir_y[x]);
+            r.inv_z[x] = safe_inverse(r.dir_z[x]);
+        }
+    }
+
+    void generate(RayBufferSoA * rays) const {
+        const CpuLevel level = cpu_level();
+        for (int y = 0; y < rays->height; y++) {
+            generate_row(rays, y, level);
+        }
+    }
+};
+
+}
+
+#endif
@@ -0,0 +1,95 @@
+#ifndef CA_HISTOGRAM_H
+#define CA_HISTOGRAM_H
+
+#include <stdint.h>
+
+namespace ca {
+
+// Power of two bucketed histogram for durations in microseconds.
+// bucket 0 holds [0, 1) us, bucket i holds [2^(i-1), 2^i) us, the last bucket
+// holds everything past that. Fixed size, no allocation, cheap enough to
+// update every frame.
+struct LogHistogram {
+    static const int kNumBuckets = 28;  // last bucket starts at ~67 seconds
+
+    uint64_t buckets[kNumBuckets];
+    uint64_t count;
+    double sum_us;
+    double min_us;
+    double max_us;
+
+    LogHistogram() { clear(); }
+
+    void clear() {
+        for (int i = 0; i < kNumBuckets; i++) {
+            buckets[i] = 0;
+        }
+        count = 0;
+        sum_us = 0.0;
+        min_us = 0.0;
+        max_us = 0.0;
+    }
+
+    static int bucket_of(double us) {
+        int b = 0;
+        double upper = 1.0;
+        while (us >= upper && b < kNumBuckets - 1) {
+            upper *= 2.0;
+            b++;
+        }
+        return b;
+    }
+
+    // lower bound of bucket b in microseconds
+    static double bucket_low(int b) {
+        return b == 0 ? 0.0 : (double)(1ull << (b - 1));
+    }
+
+    // upper bound of bucket b in microseconds
+    static double bucket_high(int b) {
+        return (double)(1ull << b);
+    }
+
+    void add(double us) {
+        if (us < 0.0) {
+            us = 0.0;
+        }
+        buckets[bucket_of(us)]++;
+        if (count == 0 || us < min_us) min_us = us;
+        if (count == 0 || us > max_us) max_us = us;
+        count++;
+        sum_us += us;
+    }
+
+    double mean() const {
+        return count ? sum_us / (double)count : 0.0;
+    }
+
+    // Estimate the p-th percentile (p in [0, 1]) by interpolating inside the
+    // bucket that holds it. Clamped to the observed min/max.
+    double percentile(double p) const {
+        if (count == 0) {
+            return 0.0;
+        }
+        const double target = p * (double)count;
+        double seen = 0.0;
+        for (int b = 0; b < kNumBuckets; b++) {
+            if (buckets[b] == 0) {
+                continue;
+            }
+            if (seen + (double)buckets[b] >= target) {
+                const double frac = (target - seen) / (double)buckets[b];
+                double v = bucket_low(b) + frac * (bucket_high(b) - bucket_low(b));
+                if (v < min_us) v = min_us;
+                if (v > max_us) v = max_us;
+                return v;
+            }
+            seen += (double)buckets[b];
+        }
+        return max_us;
+    }
+};
+
+}
+
+#endif
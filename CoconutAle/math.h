@@ -1,3 +1,6 @@
+#ifndef CA_MATH_H
+#define CA_MATH_H
+
 #include <cassert>
 #include <cmath>
 // header only math library?
@@ -642,3 +645,5 @@ Mat4f LookAtMatrix(const Vec3f eye, const Vec3f at, const Vec3f oldup) {
 }
 
 }
+
+#endif
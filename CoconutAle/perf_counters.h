@@ -0,0 +1,143 @@
+#ifndef CA_PERF_COUNTERS_H
+#define CA_PERF_COUNTERS_H
+
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__linux__)
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+namespace ca {
+
+enum PerfCounter {
+    PERF_CYCLES = 0,
+    PERF_INSTRUCTIONS,
+    PERF_L1D_MISSES,
+    PERF_LLC_MISSES,
+    PERF_BRANCH_MISSES,
+    PERF_COUNTER_COUNT
+};
+
+struct PerfSample {
+    uint64_t value[PERF_COUNTER_COUNT];
+};
+
+// Hardware counters of the calling thread, user space only, through Linux
+// perf_event_open. All counters are one group so they count over exactly
+// the same stretch; a counter the CPU (or VM, or perf_event_paranoid)
+// doesn't allow is left out and reads as 0. Elsewhere open() just fails.
+class PerfCounters {
+  public:
+    PerfCounters() : num_open_(0) {
+        for (int i = 0; i < PERF_COUNTER_COUNT; i++) {
+            fd_[i] = -1;
+            slot_[i] = -1;
+        }
+    }
+    ~PerfCounters() { close(); }
+
+    // false if not even the cycle counter could be opened
+    bool open() {
+#if defined(__linux__)
+        static const uint32_t types[PERF_COUNTER_COUNT] = {
+            PERF_TYPE_HARDWARE, PERF_TYPE_HARDWARE, PERF_TYPE_HW_CACHE,
+            PERF_TYPE_HARDWARE, PERF_TYPE_HARDWARE
+        };
+        static const uint64_t configs[PERF_COUNTER_COUNT] = {
+            PERF_COUNT_HW_CPU_CYCLES,
+            PERF_COUNT_HW_INSTRUCTIONS,
+            PERF_COUNT_HW_CACHE_L1D | (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                (PERF_COUNT_HW_CACHE_RESULT_MISS << 16),
+            PERF_COUNT_HW_CACHE_MISSES,
+            PERF_COUNT_HW_BRANCH_MISSES
+        };
+        close();
+        for (int i = 0; i < PERF_COUNTER_COUNT; i++) {
+            perf_event_attr attr;
+            memset(&attr, 0, sizeof(attr));
+            attr.size = sizeof(attr);
+            attr.type = types[i];
+            attr.config = configs[i];
+            attr.exclude_kernel = 1;
+            attr.exclude_hv = 1;
+            attr.read_format = PERF_FORMAT_GROUP |
+                PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+            // the leader starts the group disabled, the rest follow it
+            attr.disabled = i == 0 ? 1 : 0;
+            const int group = i == 0 ? -1 : fd_[PERF_CYCLES];
+            fd_[i] = (int)syscall(__NR_perf_event_open, &attr, 0, -1, group, 0);
+            if (fd_[i] < 0) {
+                if (i == 0) {
+                    return false;
+                }
+                continue;
+            }
+            slot_[i] = num_open_++;
+        }
+        ioctl(fd_[PERF_CYCLES], PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+        ioctl(fd_[PERF_CYCLES], PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+        return true;
+#else
+        return false;
+#endif
+    }
+
+    bool is_open() const { return num_open_ > 0; }
+    bool has(PerfCounter c) const { return slot_[c] >= 0; }
+
+    // Counts since open(), scaled up if the kernel had to share the
+    // hardware with other groups for a while. Zeros if not open.
+    void read(PerfSample * sample) const {
+        memset(sample, 0, sizeof(*sample));
+#if defined(__linux__)
+        if (!is_open()) {
+            return;
+        }
+        // nr, time enabled, time running, then one value per counter
+        uint64_t data[3 + PERF_COUNTER_COUNT];
+        const ssize_t want = (ssize_t)((3 + num_open_) * sizeof(uint64_t));
+        if (::read(fd_[PERF_CYCLES], data, sizeof(data)) < want) {
+            return;
+        }
+        const double scale = data[2] > 0 && data[2] < data[1]
+            ? (double)data[1] / (double)data[2] : 1.0;
+        for (int i = 0; i < PERF_COUNTER_COUNT; i++) {
+            if (slot_[i] >= 0) {
+                sample->value[i] = (uint64_t)((double)data[3 + slot_[i]] * scale);
+            }
+        }
+#endif
+    }
+
+    void close() {
+#if defined(__linux__)
+        // members first, the leader last
+        for (int i = PERF_COUNTER_COUNT - 1; i >= 0; i--) {
+            if (fd_[i] >= 0) {
+                ::close(fd_[i]);
+            }
+        }
+#endif
+        for (int i = 0; i < PERF_COUNTER_COUNT; i++) {
+            fd_[i] = -1;
+            slot_[i] = -1;
+        }
+        num_open_ = 0;
+    }
+
+  private:
+    PerfCounters(const PerfCounters &);
+    PerfCounters &operator=(const PerfCounters &);
+
+    int fd_[PERF_COUNTER_COUNT];
+    int slot_[PERF_COUNTER_COUNT];  // position in a group read, -1 if not open
+    int num_open_;
+};
+
+}
+
+#endif
@@ -0,0 +1,210 @@
+#ifndef CA_PROFILER_H
+#define CA_PROFILER_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <vector>
+
+namespace ca {
+
+// Scoped zone profiler. Every thread records the zones it closes into its
+// own ring buffer, so recording takes no lock; a thread that records more
+// than kProfileRingEvents zones keeps only the latest ones. While disabled
+// a zone costs one relaxed load and a branch. Zones are written out as a
+// Chrome trace (chrome://tracing, ui.perfetto.dev).
+
+const size_t kProfileRingEvents = 1 << 16;
+
+struct ProfileEvent {
+    const char * name;      // must outlive the profiler, normally a literal
+    uint64_t begin_ns;
+    uint64_t end_ns;
+};
+
+struct ProfileThread {
+    unsigned id;
+    const char * name;
+    std::vector<ProfileEvent> events;   // grows up to kProfileRingEvents
+    uint64_t written;                   // total, events[written % size] is next
+};
+
+struct ProfilerState {
+    std::atomic<bool> enabled;
+    std::chrono::steady_clock::time_point origin;
+    std::mutex mutex;                   // guards threads
+    std::vector<ProfileThread *> threads;
+
+    ProfilerState() : enabled(false), origin(std::chrono::steady_clock::now()) {}
+    ~ProfilerState() {
+        for (size_t i = 0; i < threads.size(); i++) {
+            delete threads[i];
+        }
+    }
+};
+
+inline ProfilerState& profiler_state()
+{
+    static ProfilerState state;
+    return state;
+}
+
+inline bool profiler_enabled()
+{
+    return profiler_state().enabled.load(std::memory_order_relaxed);
+}
+
+inline uint64_t profiler_now_ns()
+{
+    return (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now() - profiler_state().origin).count();
+}
+
+// Per thread state. The buffer is registered by the first zone the thread
+// records; the name is kept here until then, so naming a thread while the
+// profiler is off allocates nothing.
+struct ProfileThreadSlot
+{
+    ProfileThread * thread;
+    const char * name;
+};
+
+inline ProfileThreadSlot& profiler_thread_slot()
+{
+    static thread_local ProfileThreadSlot slot = {NULL, NULL};
+    return slot;
+}
+
+// The calling thread's buffer, registered on first use. Buffers outlive
+// their threads (the BVH build's workers are gone by the time the trace is
+// written), so they are only freed with the profiler.
+inline ProfileThread& profiler_thread()
+{
+    ProfileThreadSlot& slot = profiler_thread_slot();
+    if (slot.thread == NULL) {
+        ProfilerState& state = profiler_state();
+        std::lock_guard<std::mutex> lock(state.mutex);
+        slot.thread = new ProfileThread();
+        slot.thread->id = (unsigned)state.threads.size() + 1;
+        slot.thread->name = slot.name;
+        slot.thread->written = 0;
+        state.threads.push_back(slot.thread);
+    }
+    return *slot.thread;
+}
+
+// Name shown for the calling thread's row in the trace.
+inline void profiler_set_thread_name(const char * name)
+{
+    ProfileThreadSlot& slot = profiler_thread_slot();
+    slot.name = name;
+    if (slot.thread != NULL) {
+        std::lock_guard<std::mutex> lock(profiler_state().mutex);
+        slot.thread->name = name;
+    }
+}
+
+inline void profiler_record(const char * name, uint64_t begin_ns, uint64_t end_ns)
+{
+    ProfileThread& thread = profiler_thread();
+    const ProfileEvent e = {name, begin_ns, end_ns};
+    if (thread.events.size() < kProfileRingEvents) {
+        thread.events.push_back(e);
+    } else {
+        thread.events[thread.written % kProfileRingEvents] = e;
+    }
+    thread.written++;
+}
+
+// Zones only count from here on; the trace's time 0 is this call.
+inline void profiler_start()
+{
+    ProfilerState& state = profiler_state();
+    state.origin = std::chrono::steady_clock::now();
+    state.enabled.store(true, std::memory_order_relaxed);
+}
+
+inline void profiler_stop()
+{
+    profiler_state().enabled.store(false, std::memory_order_relaxed);
+}
+
+class ProfileZone {
+  public:
+    explicit ProfileZone(const char * name)
+        : name_(profiler_enabled() ? name : NULL), begin_ns_(0) {
+        if (name_ != NULL) {
+            begin_ns_ = profiler_now_ns();
+        }
+    }
+    ~ProfileZone() {
+        if (name_ != NULL) {
+            profiler_record(name_, begin_ns_, profiler_now_ns());
+        }
+    }
+
+    // Don't record this zone after all. Zones it enclosed stay.
+    void discard() { name_ = NULL; }
+
+  private:
+    ProfileZone(const ProfileZone &);
+    ProfileZone &operator=(const ProfileZone &);
+
+    const char * name_;     // NULL if the profiler was off when it opened
+    uint64_t begin_ns_;
+};
+
+#define CA_PROFILE_CONCAT2(a, b) a##b
+#define CA_PROFILE_CONCAT(a, b) CA_PROFILE_CONCAT2(a, b)
+#define CA_PROFILE_ZONE(name) \
+    ca::ProfileZone CA_PROFILE_CONCAT(ca_profile_zone_, __LINE__)(name)
+
+// Writes every recorded zone as complete ("X") events, microseconds since
+// profiler_start(). Only call it while no other thread is recording.
+// Returns the number of events written, or -1 if the file can't be opened.
+inline long profiler_write_chrome_trace(const char * path)
+{
+    FILE * f = fopen(path, "w");
+    if (f == NULL) {
+        return -1;
+    }
+    ProfilerState& state = profiler_state();
+    std::lock_guard<std::mutex> lock(state.mutex);
+
+    long count = 0;
+    fprintf(f, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+    fprintf(f, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,\"tid\":0,"
+               "\"args\":{\"name\":\"raytracer\"}}");
+    for (size_t t = 0; t < state.threads.size(); t++) {
+        const ProfileThread& thread = *state.threads[t];
+        if (thread.name != NULL) {
+            fprintf(f, ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,"
+                       "\"tid\":%u,\"args\":{\"name\":\"%s\"}}",
+                    thread.id, thread.name);
+        }
+        // oldest first
+        const size_t size = thread.events.size();
+        const size_t first = size < kProfileRingEvents
+            ? 0 : (size_t)(thread.written % kProfileRingEvents);
+        for (size_t i = 0; i < size; i++) {
+            const ProfileEvent& e = thread.events[(first + i) % size];
+            fprintf(f, ",\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%u,"
+                       "\"ts\":%.3f,\"dur\":%.3f}",
+                    e.name, thread.id, e.begin_ns / 1000.0,
+                    (e.end_ns - e.begin_ns) / 1000.0);
+            count++;
+        }
+    }
+    fprintf(f, "\n]}\n");
+    if (fclose(f) != 0) {
+        return -1;
+    }
+    return count;
+}
+
+}
+
+#endif
@@ -0,0 +1,138 @@
+#ifndef CA_SIMD_H
+#define CA_SIMD_H
+
+// SSE2 is baseline on every x64 target we build for (gcc/clang define
+// __SSE2__, MSVC x64 implies it). Everything that uses intrinsics keeps a
+// scalar path behind CA_HAS_SSE2 for other targets.
+#if defined(__SSE2__) || defined(_M_X64) || \
+    (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define CA_HAS_SSE2 1
+#include <emmintrin.h>
+#endif
+
+// AVX2 and AVX-512 versions of the hot kernels are compiled into the same
+// binary as the SSE2 ones and picked at runtime by cpu_level(), so the build
+// needs no -mavx flags and still runs on CPUs without them. gcc/clang only
+// allow those intrinsics in functions marked with the target; MSVC allows
+// them anywhere.
+//
+// The wide kernels do the same operations in the same order as the SSE2
+// ones and the targets leave out FMA (AVX-512F has it built in, so gcc is
+// told not to contract), which keeps frames identical on every level.
+#if defined(CA_HAS_SSE2) && (defined(__GNUC__) || defined(__clang__)) && \
+    (defined(__x86_64__) || defined(__i386__))
+#define CA_HAS_AVX_KERNELS 1
+#include <cpuid.h>
+#include <immintrin.h>
+#define CA_TARGET_AVX2 __attribute__((target("avx2")))
+#if defined(__clang__)
+#define CA_TARGET_AVX512 __attribute__((target("avx512f")))
+#else
+#define CA_TARGET_AVX512 \
+    __attribute__((target("avx512f"), optimize("fp-contract=off")))
+#endif
+#elif defined(_MSC_VER) && defined(_M_X64)
+#define CA_HAS_AVX_KERNELS 1
+#include <intrin.h>
+#include <immintrin.h>
+#define CA_TARGET_AVX2
+#define CA_TARGET_AVX512
+#endif
+
+namespace ca {
+
+// Widest instruction set the kernels use, in order.
+enum CpuLevel {
+    CPU_SCALAR = 0,
+    CPU_SSE2,
+    CPU_AVX2,
+    CPU_AVX512,
+    CPU_LEVEL_COUNT
+};
+
+inline const char * cpu_level_name(CpuLevel level)
+{
+    static const char * const names[CPU_LEVEL_COUNT] = {
+        "scalar", "sse2", "avx2", "avx512"
+    };
+    return names[level];
+}
+
+// CPUID for what the CPU has, XGETBV for whether the OS saves the wider
+// registers on a context switch (AVX needs both).
+inline CpuLevel detect_cpu_level()
+{
+#if defined(CA_HAS_AVX_KERNELS)
+    unsigned regs1[4] = {0, 0, 0, 0};  // eax, ebx, ecx, edx
+    unsigned regs7[4] = {0, 0, 0, 0};
+    unsigned long long xcr0 = 0;
+#if defined(_MSC_VER)
+    int r[4];
+    __cpuid(r, 0);
+    const unsigned max_leaf = (unsigned)r[0];
+    __cpuid(r, 1);
+    for (int i = 0; i < 4; i++) regs1[i] = (unsigned)r[i];
+    if (max_leaf >= 7) {
+        __cpuidex(r, 7, 0);
+        for (int i = 0; i < 4; i++) regs7[i] = (unsigned)r[i];
+    }
+    const bool osxsave = (regs1[2] & (1u << 27)) != 0;
+    if (osxsave) {
+        xcr0 = _xgetbv(0);
+    }
+#else
+    const unsigned max_leaf = __get_cpuid_max(0, 0);
+    __get_cpuid(1, &regs1[0], &regs1[1], &regs1[2], &regs1[3]);
+    if (max_leaf >= 7) {
+        __cpuid_count(7, 0, regs7[0], regs7[1], regs7[2], regs7[3]);
+    }
+    const bool osxsave = (regs1[2] & (1u << 27)) != 0;
+    if (osxsave) {
+        unsigned lo, hi;
+        __asm__ __volatile__("xgetbv" : "=a"(lo), "=d"(hi) : "c"(0));
+        xcr0 = ((unsigned long long)hi << 32) | lo;
+    }
+#endif
+    const bool os_avx = osxsave && (xcr0 & 0x6) == 0x6;           // xmm, ymm
+    const bool os_avx512 = os_avx && (xcr0 & 0xe0) == 0xe0;       // k, zmm
+    const bool avx2 = os_avx && (regs1[2] & (1u << 28)) != 0 &&
+        (regs7[1] & (1u << 5)) != 0;
+    const bool avx512f = os_avx512 && (regs7[1] & (1u << 16)) != 0;
+    if (avx2 && avx512f) {
+        return CPU_AVX512;
+    }
+    if (avx2) {
+        return CPU_AVX2;
+    }
+    return CPU_SSE2;
+#elif defined(CA_HAS_SSE2)
+    return CPU_SSE2;
+#else
+    return CPU_SCALAR;
+#endif
+}
+
+inline CpuLevel& cpu_level_storage()
+{
+    static CpuLevel level = detect_cpu_level();
+    return level;
+}
+
+// The level kernels dispatch on. Detected once, on first use.
+inline CpuLevel cpu_level()
+{
+    return cpu_level_storage();
+}
+
+// Caps the level below what the CPU has, to compare the kernels. It never
+// goes above what was detected.
+inline void limit_cpu_level(CpuLevel max)
+{
+    if (max < cpu_level_storage()) {
+        cpu_level_storage() = max;
+    }
+}
+
+}
+
+#endif
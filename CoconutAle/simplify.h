@@ -0,0 +1,282 @@
+#ifndef CA_SIMPLIFY_H
+#define CA_SIMPLIFY_H
+
+#include "math.h"
+
+#include <algorithm>
+#include <cmath>
+#include <functional>
+#include <map>
+#include <queue>
+#include <utility>
+#include <vector>
+
+namespace ca {
+
+// Sum of squared distances to a set of planes (Garland and Heckbert, "Surface
+// Simplification Using Quadric Error Metrics"). Symmetric 4x4 matrix, upper
+// triangle stored row by row. Doubles because the sums cancel badly in float.
+struct Quadric {
+    double a[10];
+
+    Quadric() { for (int i = 0; i < 10; i++) a[i] = 0.0; }
+
+    // plane n.p + d = 0 with unit n, counted w times
+    void add_plane(Vec3f n, float d, double w) {
+        const double p[4] = {n.x, n.y, n.z, d};
+        int k = 0;
+        for (int r = 0; r < 4; r++) {
+            for (int c = r; c < 4; c++) {
+                a[k++] += w * p[r] * p[c];
+            }
+        }
+    }
+
+    void operator+=(const Quadric& q) {
+        for (int i = 0; i < 10; i++) a[i] += q.a[i];
+    }
+
+    double evaluate(Vec3f v) const {
+        const double x = v.x, y = v.y, z = v.z;
+        return a[0]*x*x + 2*a[1]*x*y + 2*a[2]*x*z + 2*a[3]*x
+             + a[4]*y*y + 2*a[5]*y*z + 2*a[6]*y
+             + a[7]*z*z + 2*a[8]*z
+             + a[9];
+    }
+
+    // Point of least error, false if the quadric has no unique minimum (flat
+    // or straight regions).
+    bool minimum(Vec3f * v) const {
+        const double m00 = a[0], m01 = a[1], m02 = a[2];
+        const double m11 = a[4], m12 = a[5], m22 = a[7];
+        const double b0 = -a[3], b1 = -a[6], b2 = -a[8];
+        const double c00 = m11 * m22 - m12 * m12;
+        const double c01 = m02 * m12 - m01 * m22;
+        const double c02 = m01 * m12 - m02 * m11;
+        const double det = m00 * c00 + m01 * c01 + m02 * c02;
+        const double scale = m00 + m11 + m22;
+        if (std::fabs(det) <= 1e-9 * scale * scale * scale) {
+            return false;
+        }
+        const double c11 = m00 * m22 - m02 * m02;
+        const double c12 = m01 * m02 - m00 * m12;
+        const double c22 = m00 * m11 - m01 * m01;
+        v->x = (float)((c00 * b0 + c01 * b1 + c02 * b2) / det);
+        v->y = (float)((c01 * b0 + c11 * b1 + c12 * b2) / det);
+        v->z = (float)((c02 * b0 + c12 * b1 + c22 * b2) / det);
+        return true;
+    }
+};
+
+// Edges that only one face uses get a plane through the edge, perpendicular
+// to the face, weighted this much more than a face plane so open borders
+// keep their shape.
+const double kSimplifyBorderWeight = 100.0;
+
+// Collapses the edge with the least quadric error until at most target_faces
+// faces remain, or no edge can collapse without flipping a face over.
+// Returns the square root of the largest error of a collapse it made, an
+// estimate of how far the result strays from the input.
+inline float simplify_mesh(
+    const std::vector<Vec3f>& verts,
+    const std::vector<Vec3u>& faces,
+    size_t target_faces,
+    std::vector<Vec3f> * out_verts,
+    std::vector<Vec3u> * out_faces)
+{
+    std::vector<Vec3f> pos = verts;
+    std::vector<Vec3u> tris = faces;
+    std::vector<bool> face_alive(tris.size(), true);
+    std::vector<bool> vert_alive(pos.size(), true);
+    std::vector<unsigned> stamp(pos.size(), 0);
+    std::vector<Quadric> quadrics(pos.size());
+    std::vector<std::vector<unsigned> > vert_faces(pos.size());
+    size_t live_faces = tris.size();
+
+    std::map<std::pair<unsigned, unsigned>, unsigned> edge_use;
+    for (size_t f = 0; f < tris.size(); f++) {
+        const unsigned * t = &tris[f].x;
+        for (int k = 0; k < 3; k++) {
+            vert_faces[t[k]].push_back((unsigned)f);
+            const unsigned a = t[k], b = t[(k + 1) % 3];
+            edge_use[std::make_pair(std::min(a, b), std::max(a, b))]++;
+        }
+        Vec3f n = cross(pos[t[1]] - pos[t[0]], pos[t[2]] - pos[t[0]]);
+        if (length(n) == 0.0f) {
+            continue;
+        }
+        normalize_modify(n);
+        for (int k = 0; k < 3; k++) {
+            quadrics[t[k]].add_plane(n, -dot(n, pos[t[0]]), 1.0);
+        }
+    }
+    // borders, now that every edge is counted
+    for (size_t f = 0; f < tris.size(); f++) {
+        const unsigned * t = &tris[f].x;
+        Vec3f n = cross(pos[t[1]] - pos[t[0]], pos[t[2]] - pos[t[0]]);
+        if (length(n) == 0.0f) {
+            continue;
+        }
+        normalize_modify(n);
+        for (int k = 0; k < 3; k++) {
+            const unsigned a = t[k], b = t[(k + 1) % 3];
+            if (edge_use[std::make_pair(std::min(a, b), std::max(a, b))] != 1) {
+                continue;
+            }
+            Vec3f m = cross(pos[b] - pos[a], n);
+            if (length(m) == 0.0f) {
+                continue;
+            }
+            normalize_modify(m);
+            const float d = -dot(m, pos[a]);
+            quadrics[a].add_plane(m, d, kSimplifyBorderWeight);
+            quadrics[b].add_plane(m, d, kSimplifyBorderWeight);
+        }
+    }
+
+    struct Candidate {
+        double cost;
+        unsigned a, b;
+        unsigned stamp_a, stamp_b;
+        Vec3f target;
+        bool operator>(const Candidate& o) const { return cost > o.cost; }
+    };
+    std::priority_queue<Candidate, std::vector<Candidate>,
+                        std::greater<Candidate> > heap;
+
+    auto push_edge = [&](unsigned a, unsigned b) {
+        Quadric q = quadrics[a];
+        q += quadrics[b];
+        Candidate c;
+        c.a = a;
+        c.b = b;
+        c.stamp_a = stamp[a];
+        c.stamp_b = stamp[b];
+        if (!q.minimum(&c.target)) {
+            // best of the two ends and their midpoint
+            const Vec3f options[3] = {pos[a], pos[b], (pos[a] + pos[b]) * 0.5f};
+            c.target = options[0];
+            for (int i = 1; i < 3; i++) {
+                if (q.evaluate(options[i]) < q.evaluate(c.target)) {
+                    c.target = options[i];
+                }
+            }
+        }
+        c.cost = std::max(0.0, q.evaluate(c.target));
+        heap.push(c);
+    };
+
+    for (size_t f = 0; f < tris.size(); f++) {
+        const unsigned * t = &tris[f].x;
+        for (int k = 0; k < 3; k++) {
+            if (t[k] < t[(k + 1) % 3]) {
+                push_edge(t[k], t[(k + 1) % 3]);
+            }
+        }
+    }
+
+    // Would moving vertex v to `target` turn one of its faces (other than
+    // the ones the collapse removes, which also use `other`) over or
+    // squash it flat?
+    auto flips = [&](unsigned v, unsigned other, Vec3f target) {
+        for (size_t i = 0; i < vert_faces[v].size(); i++) {
+            const unsigned f = vert_faces[v][i];
+            if (!face_alive[f]) {
+                continue;
+            }
+            const unsigned * t = &tris[f].x;
+            if (t[0] == other || t[1] == other || t[2] == other) {
+                continue;
+            }
+            Vec3f p[3] = {pos[t[0]], pos[t[1]], pos[t[2]]};
+            const Vec3f before = cross(p[1] - p[0], p[2] - p[0]);
+            for (int k = 0; k < 3; k++) {
+                if (t[k] == v) p[k] = target;
+            }
+            const Vec3f after = cross(p[1] - p[0], p[2] - p[0]);
+            const float len = length(before) * length(after);
+            if (len == 0.0f || dot(before, after) < 0.2f * len) {
+                return true;
+            }
+        }
+        return false;
+    };
+
+    double max_cost = 0.0;
+    while (live_faces > target_faces && !heap.empty()) {
+        const Candidate c = heap.top();
+        heap.pop();
+        if (!vert_alive[c.a] || !vert_alive[c.b] ||
+            stamp[c.a] != c.stamp_a || stamp[c.b] != c.stamp_b) {
+            continue;
+        }
+        if (flips(c.a, c.b, c.target) || flips(c.b, c.a, c.target)) {
+            continue;
+        }
+
+        // b goes into a
+        const unsigned a = c.a, b = c.b;
+        pos[a] = c.target;
+        quadrics[a] += quadrics[b];
+        vert_alive[b] = false;
+        for (size_t i = 0; i < vert_faces[b].size(); i++) {
+            const unsigned f = vert_faces[b][i];
+            if (!face_alive[f]) {
+                continue;
+            }
+            unsigned * t = &tris[f].x;
+            if (t[0] == a || t[1] == a || t[2] == a) {
+                face_alive[f] = false;
+                live_faces--;
+                continue;
+            }
+            for (int k = 0; k < 3; k++) {
+                if (t[k] == b) t[k] = a;
+            }
+            vert_faces[a].push_back(f);
+        }
+        std::vector<unsigned>().swap(vert_faces[b]);
+
+        std::vector<unsigned> &around = vert_faces[a];
+        around.erase(std::remove_if(around.begin(), around.end(),
+            [&](unsigned f) { return !face_alive[f]; }), around.end());
+        stamp[a]++;
+        max_cost = std::max(max_cost, c.cost);
+
+        for (size_t i = 0; i < around.size(); i++) {
+            const unsigned * t = &tris[around[i]].x;
+            for (int k = 0; k < 3; k++) {
+                if (t[k] != a) {
+                    push_edge(a, t[k]);
+                }
+            }
+        }
+    }
+
+    // compact: only vertices some face still uses, in their old order
+    std::vector<bool> used(pos.size(), false);
+    for (size_t f = 0; f < tris.size(); f++) {
+        if (face_alive[f]) {
+            used[tris[f].x] = used[tris[f].y] = used[tris[f].z] = true;
+        }
+    }
+    std::vector<unsigned> remap(pos.size(), ~0u);
+    out_verts->clear();
+    out_faces->clear();
+    for (size_t v = 0; v < pos.size(); v++) {
+        if (used[v]) {
+            remap[v] = (unsigned)out_verts->size();
+            out_verts->push_back(pos[v]);
+        }
+    }
+    for (size_t f = 0; f < tris.size(); f++) {
+        if (face_alive[f]) {
+            out_faces->push_back(Vec3u{remap[tris[f].x], remap[tris[f].y], remap[tris[f].z]});
+        }
+    }
+    return (float)std::sqrt(max_cost);
+}
+
+}
+
+#endif
@@ -0,0 +1,144 @@
+#ifndef CA_UPSCALE_H
+#define CA_UPSCALE_H
+
+#include "simd.h"
+
+#include <stdint.h>
+#include <string.h>
+
+namespace ca {
+
+// Nearest neighbour upscale of 32-bit pixels by a whole factor, for putting
+// the low res frame on the window. Can swap the bytes at bits 0-7 and 16-23
+// on the way, which turns RGBA byte order into BGRA and back.
+
+inline uint32_t swap_red_blue(uint32_t p)
+{
+    return (p & 0xff00ff00u) | ((p >> 16) & 0xffu) | ((p & 0xffu) << 16);
+}
+
+// The upscale_row_* kernels write `scale` copies of each source pixel into
+// one destination row for as many whole vectors of source pixels as fit in
+// `w` and return how many they did; upscale_row() does the rest.
+#if defined(CA_HAS_SSE2)
+inline __m128i swap_red_blue_epi32(__m128i p)
+{
+    const __m128i keep = _mm_and_si128(p, _mm_set1_epi32((int)0xff00ff00));
+    const __m128i low = _mm_and_si128(_mm_srli_epi32(p, 16), _mm_set1_epi32(0xff));
+    const __m128i high = _mm_slli_epi32(_mm_and_si128(p, _mm_set1_epi32(0xff)), 16);
+    return _mm_or_si128(keep, _mm_or_si128(low, high));
+}
+
+inline int upscale_row2_sse2(const uint32_t * src, int w, uint32_t * dst, bool swap)
+{
+    int x = 0;
+    for (; x + 4 <= w; x += 4) {
+        __m128i p = _mm_loadu_si128((const __m128i *)(src + x));
+        if (swap) {
+            p = swap_red_blue_epi32(p);
+        }
+        _mm_storeu_si128((__m128i *)(dst + 2 * x), _mm_unpacklo_epi32(p, p));
+        _mm_storeu_si128((__m128i *)(dst + 2 * x + 4), _mm_unpackhi_epi32(p, p));
+    }
+    return x;
+}
+#endif
+
+#if defined(CA_HAS_AVX_KERNELS)
+CA_TARGET_AVX2 inline int upscale_row2_avx2(const uint32_t * src, int w, uint32_t * dst, bool swap)
+{
+    const __m256i first = _mm256_setr_epi32(0, 0, 1, 1, 2, 2, 3, 3);
+    const __m256i second = _mm256_setr_epi32(4, 4, 5, 5, 6, 6, 7, 7);
+    const __m256i keep_mask = _mm256_set1_epi32((int)0xff00ff00);
+    const __m256i byte_mask = _mm256_set1_epi32(0xff);
+    int x = 0;
+    for (; x + 8 <= w; x += 8) {
+        __m256i p = _mm256_loadu_si256((const __m256i *)(src + x));
+        if (swap) {
+            p = _mm256_or_si256(_mm256_and_si256(p, keep_mask), _mm256_or_si256(
+                _mm256_and_si256(_mm256_srli_epi32(p, 16), byte_mask),
+                _mm256_slli_epi32(_mm256_and_si256(p, byte_mask), 16)));
+        }
+        _mm256_storeu_si256((__m256i *)(dst + 2 * x), _mm256_permutevar8x32_epi32(p, first));
+        _mm256_storeu_si256((__m256i *)(dst + 2 * x + 8), _mm256_permutevar8x32_epi32(p, second));
+    }
+    return x;
+}
+
+CA_TARGET_AVX512 inline int upscale_row2_avx512(const uint32_t * src, int w, uint32_t * dst, bool swap)
+{
+    const __m512i first = _mm512_set_epi32(
+        7, 7, 6, 6, 5, 5, 4, 4, 3, 3, 2, 2, 1, 1, 0, 0);
+    const __m512i second = _mm512_set_epi32(
+        15, 15, 14, 14, 13, 13, 12, 12, 11, 11, 10, 10, 9, 9, 8, 8);
+    const __m512i keep_mask = _mm512_set1_epi32((int)0xff00ff00);
+    const __m512i byte_mask = _mm512_set1_epi32(0xff);
+    // gcc 12 implements the unmasked shift/permute forms on top of an
+    // undefined source and warns about it under -Wall. The zero-masked forms
+    // with every lane selected are the same instructions.
+    const __mmask16 all = 0xFFFF;
+    int x = 0;
+    for (; x + 16 <= w; x += 16) {
+        __m512i p = _mm512_loadu_si512((const void *)(src + x));
+        if (swap) {
+            p = _mm512_or_epi32(_mm512_and_epi32(p, keep_mask), _mm512_or_epi32(
+                _mm512_and_epi32(_mm512_maskz_srli_epi32(all, p, 16), byte_mask),
+                _mm512_maskz_slli_epi32(all, _mm512_and_epi32(p, byte_mask), 16)));
+        }
+        _mm512_storeu_si512((void *)(dst + 2 * x), _mm512_maskz_permutexvar_epi32(all, first, p));
+        _mm512_storeu_si512((void *)(dst + 2 * x + 16), _mm512_maskz_permutexvar_epi32(all, second, p));
+    }
+    return x;
+}
+#endif
+
+inline void upscale_row(const uint32_t * src, int w, uint32_t * dst, int scale,
+                        bool swap, CpuLevel level)
+{
+    int x = 0;
+    if (scale == 2) {
+        switch (level) {
+#if defined(CA_HAS_AVX_KERNELS)
+        case CPU_AVX512:
+            x = upscale_row2_avx512(src, w, dst, swap);
+            break;
+        case CPU_AVX2:
+            x = upscale_row2_avx2(src, w, dst, swap);
+            break;
+#endif
+#if defined(CA_HAS_SSE2)
+        case CPU_SSE2:
+            x = upscale_row2_sse2(src, w, dst, swap);
+            break;
+#endif
+        default:
+            break;
+        }
+    }
+    for (; x < w; x++) {
+        const uint32_t p = swap ? swap_red_blue(src[x]) : src[x];
+        for (int k = 0; k < scale; k++) {
+            dst[x * scale + k] = p;
+        }
+    }
+}
+
+// src is w x h pixels, dst (w * scale) x (h * scale); pitches in bytes.
+// Each source row is expanded once and copied to the other scale - 1 rows.
+inline void upscale_pixels(const void * src, int src_pitch, int w, int h,
+                           void * dst, int dst_pitch, int scale, bool swap)
+{
+    const CpuLevel level = cpu_level();
+    for (int y = 0; y < h; y++) {
+        const uint32_t * src_row = (const uint32_t *)((const char *)src + (size_t)y * src_pitch);
+        char * dst_row = (char *)dst + (size_t)y * scale * dst_pitch;
+        upscale_row(src_row, w, (uint32_t *)dst_row, scale, swap, level);
+        for (int k = 1; k < scale; k++) {
+            memcpy(dst_row + (size_t)k * dst_pitch, dst_row, (size_t)w * scale * 4);
+        }
+    }
+}
+
+}
+
+#endif
@@ -0,0 +1,219 @@
+#ifndef LIGHTS_H
+#define LIGHTS_H
+
+#include "nanort.h"
+#include "CoconutAle/math.h"
+
+#include <vector>
+
+// Small spherical light. Full intensity up to `range`, falling off with 1/d
+// past it, and only lighting surfaces that face it.
+struct SphereLight
+{
+    ca::Vec3f pos;
+    float radius;       // physical size, only used for the light bounds
+    float range;
+    float intensity;
+};
+
+inline float sphere_light_contribution(
+    const SphereLight &light,
+    const ca::Vec3f &v_hit,
+    const ca::Vec3f &v_normal)
+{
+    const ca::Vec3f v_toLight = v_hit - light.pos;
+    const float f_dot = ca::dot(v_toLight, v_normal);
+    if (f_dot >= 0.0f) {
+        return 0.0f;
+    }
+    float mult = light.range / ca::length(v_toLight);
+    if (mult >= 1.0f) {
+        mult = 1.0f;
+    }
+    return mult * light.intensity;
+}
+
+// nanort primitive adapter: bounds of each light
+class SphereLightBounds
+{
+  public:
+    explicit SphereLightBounds(const SphereLight * lights) : lights_(lights) {}
+
+    void BoundingBox(nanort::real3<float> * bmin, nanort::real3<float> * bmax,
+                     unsigned int prim_index) const {
+        const SphereLight &l = lights_[prim_index];
+        (*bmin)[0] = l.pos.x - l.radius;
+        (*bmin)[1] = l.pos.y - l.radius;
+        (*bmin)[2] = l.pos.z - l.radius;
+        (*bmax)[0] = l.pos.x + l.radius;
+        (*bmax)[1] = l.pos.y + l.radius;
+        (*bmax)[2] = l.pos.z + l.radius;
+    }
+
+  private:
+    const SphereLight * lights_;
+};
+
+// nanort split predicate: light center against the cut plane
+class SphereLightPred
+{
+  public:
+    explicit SphereLightPred(const SphereLight * lights)
+        : axis_(0), pos_(0.0f), lights_(lights) {}
+
+    void Set(int axis, float pos) const {
+        axis_ = axis;
+        pos_ = pos;
+    }
+
+    bool operator()(unsigned int i) const {
+        const float * p = &lights_[i].pos.x;
+        return p[axis_] < pos_;
+    }
+
+  private:
+    mutable int axis_;
+    mutable float pos_;
+    const SphereLight * lights_;
+};
+
+// BVH over light bounds with per node light power, used to pick one light
+// per shading point with probability roughly proportional to how much it
+// contributes there. Picking walks one root to leaf path, so shading cost
+// grows with log(#lights).
+class LightTree
+{
+  public:
+    void build(const std::vector<SphereLight> &lights) {
+        lights_ = lights;
+        node_intensity_.clear();
+        node_reach_.clear();
+        if (lights_.empty()) {
+            accel_ = nanort::BVHAccel<float>();
+            return;
+        }
+
+        nanort::BVHBuildOptions<float> options;
+        options.min_leaf_primitives = 1;
+        SphereLightBounds bounds(lights_.data());
+        SphereLightPred pred(lights_.data());
+        accel_.Build((unsigned)lights_.size(), bounds, pred, options);
+
+        const std::vector<nanort::BVHNode<float> > &nodes = accel_.GetNodes();
+        node_intensity_.resize(nodes.size());
+        node_reach_.resize(nodes.size());
+        accumulate_power(0);
+    }
+
+    bool empty() const { return lights_.empty(); }
+    size_t size() const { return lights_.size(); }
+
+    // One sample estimate of the light from every light in the tree at v_hit.
+    // u is a uniform random number in [0, 1).
+    float estimate(const ca::Vec3f &v_hit, const ca::Vec3f &v_normal, float u) const {
+        if (lights_.empty()) {
+            return 0.0f;
+        }
+        const std::vector<nanort::BVHNode<float> > &nodes = accel_.GetNodes();
+        const std::vector<unsigned int> &indices = accel_.GetIndices();
+
+        float pdf = 1.0f;
+        unsigned int index = 0;
+        if (importance(index, v_hit, v_normal) <= 0.0f) {
+            return 0.0f;
+        }
+        while (nodes[index].flag == 0) {
+            const unsigned int c0 = nodes[index].data[0];
+            const unsigned int c1 = nodes[index].data[1];
+            const float w0 = importance(c0, v_hit, v_normal);
+            const float w1 = importance(c1, v_hit, v_normal);
+            const float w = w0 + w1;
+            if (w <= 0.0f) {
+                return 0.0f;
+            }
+            const float p0 = w0 / w;
+            if (u < p0) {
+                u = u / p0;
+                pdf *= p0;
+                index = c0;
+            } else {
+                u = (u - p0) / (1.0f - p0);
+                pdf *= 1.0f - p0;
+                index = c1;
+            }
+            if (u >= 1.0f) {
+                u = 0.99999994f;
+            }
+        }
+
+        // Leaves are small, so sum their lights exactly rather than picking
+        // one of them.
+        const unsigned int count = nodes[index].data[0];
+        const unsigned int offset = nodes[index].data[1];
+        float total = 0.0f;
+        for (unsigned int i = 0; i < count; i++) {
+            total += sphere_light_contribution(
+                lights_[indices[offset + i]], v_hit, v_normal);
+        }
+        return total / pdf;
+    }
+
+  private:
+    void accumulate_power(unsigned int index) {
+        const nanort::BVHNode<float> &node = accel_.GetNodes()[index];
+        float intensity = 0.0f;
+        float reach = 0.0f;
+        if (node.flag == 0) {
+            accumulate_power(node.data[0]);
+            accumulate_power(node.data[1]);
+            intensity = node_intensity_[node.data[0]] + node_intensity_[node.data[1]];
+            reach = node_reach_[node.data[0]] + node_reach_[node.data[1]];
+        } else {
+            const std::vector<unsigned int> &indices = accel_.GetIndices();
+            for (unsigned int i = 0; i < node.data[0]; i++) {
+                const SphereLight &l = lights_[indices[node.data[1] + i]];
+                intensity += l.intensity;
+                reach += l.intensity * l.range;
+            }
+        }
+        node_intensity_[index] = intensity;
+        node_reach_[index] = reach;
+    }
+
+    // Upper bound style weight of a node at a shading point: zero if every
+    // light in it is behind the surface, otherwise the summed falloff as if
+    // all lights sat at the node center (clamped for points inside the box).
+    float importance(unsigned int index, const ca::Vec3f &v_hit,
+                     const ca::Vec3f &v_normal) const {
+        const nanort::BVHNode<float> &node = accel_.GetNodes()[index];
+        const float p[3] = {v_hit.x, v_hit.y, v_hit.z};
+        const float n[3] = {v_normal.x, v_normal.y, v_normal.z};
+
+        float front = 0.0f;
+        float dist2 = 0.0f;
+        float half_diag2 = 0.0f;
+        for (int k = 0; k < 3; k++) {
+            const float corner = n[k] >= 0.0f ? node.bmax[k] : node.bmin[k];
+            front += n[k] * (corner - p[k]);
+            const float center = 0.5f * (node.bmin[k] + node.bmax[k]);
+            const float half = 0.5f * (node.bmax[k] - node.bmin[k]);
+            dist2 += (center - p[k]) * (center - p[k]);
+            half_diag2 += half * half;
+        }
+        if (front <= 0.0f) {
+            return 0.0f;
+        }
+        const float dist = sqrtf(dist2 > half_diag2 ? dist2 : half_diag2);
+        const float falloff = dist > 0.0f
+            ? node_reach_[index] / dist
+            : node_intensity_[index];
+        return falloff < node_intensity_[index] ? falloff : node_intensity_[index];
+    }
+
+    std::vector<SphereLight> lights_;
+    nanort::BVHAccel<float> accel_;
+    std::vector<float> node_intensity_;   // sum of intensity below the node
+    std::vector<float> node_reach_;       // sum of intensity * range
+};
+
+#endif
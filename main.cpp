@@ -1,7 +1,17 @@
+#define NANORT_USE_CPP11_FEATURE
+#include "CoconutAle/profiler.h"
+#define NANORT_PROFILE_ZONE(name) CA_PROFILE_ZONE(name)
 #include "nanort.h"
+#include "lights.h"
 #include "CoconutAle/math.h"
+#include "CoconutAle/histogram.h"
+#include "CoconutAle/perf_counters.h"
+#include "CoconutAle/camera.h"
+#include "CoconutAle/simplify.h"
+#include "CoconutAle/upscale.h"
 #include "SDL.h"
 
+#include <errno.h>
 #include <stdarg.h>
 #include <stdlib.h>
 #include <stdio.h>
@@ -9,37 +19,182 @@
 
 // windows specific stuff
 #if defined(_MSC_VER)
+#define NOMINMAX
 #include <windows.h>
 #include <shellapi.h>
+#include <direct.h>
+
+#define make_directory(path) _mkdir(path)
 
 #define and &&
 #define or ||
 #define not !
 
+// Long lines (scene parse errors, the -perf table) are cut at the buffer
+// size rather than overrunning it. _snprintf does not terminate on overflow.
 #define debug_print(...) \
 {\
-    static char print_buffer [100];\
-    sprintf(print_buffer, __VA_ARGS__);\
+    char print_buffer [2048];\
+    _snprintf(print_buffer, sizeof(print_buffer) - 1, __VA_ARGS__);\
+    print_buffer[sizeof(print_buffer) - 1] = '\0';\
     OutputDebugString(print_buffer);\
 }
 
 #else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define make_directory(path) mkdir(path, 0755)
 
-#define debug_print(...) printf(...)
+#define debug_print(...) printf(__VA_ARGS__)
+
+#endif
 
+#if defined(USE_LIBPNG)
+#include <png.h>
 #endif
 
+#include <atomic>
+#include <chrono>
 #include <iostream>
 #include <fstream>
+#include <map>
+#include <sstream>
+#include <thread>
 
 struct RenderObject {
     std::vector<ca::Vec3f> verts;
     std::vector<ca::Vec3f> normals;
     std::vector<ca::Vec3u> faces;
+    // original index of each face once faces are in BVH leaf order, empty
+    // while they are still in the order they were added
+    std::vector<unsigned> face_ids;
+    // verts as 16-bit grid coordinates, 3 per vertex, when the BVH was
+    // built with quantize_vertices
+    std::vector<unsigned short> packed_verts;
+};
+
+// stable id of face `fid`, the index it had when it was added
+inline unsigned original_face_id(const RenderObject &ro, unsigned fid) {
+    return ro.face_ids.empty() ? fid : ro.face_ids[fid];
+}
+
+// Per face normals from the winding, for meshes that come without them.
+void compute_face_normals(RenderObject &ro)
+{
+    ro.normals.resize(ro.faces.size());
+    for (size_t i = 0; i < ro.faces.size(); i++) {
+        const ca::Vec3f &p1 = ro.verts[ro.faces[i].x];
+        const ca::Vec3f &p2 = ro.verts[ro.faces[i].y];
+        const ca::Vec3f &p3 = ro.verts[ro.faces[i].z];
+        ca::Vec3f normal = ca::cross(p2 - p1, p3 - p1);
+        if (ca::length(normal) > 0.0f) {
+            ca::normalize_modify(normal);
+        }
+        ro.normals[i] = normal;
+    }
+}
+
+// Loads the bunny's format: a "<#verts> <#faces>" line, then "v x y z" and
+// "f a b c" lines with 1-based indices. false if the file is missing or
+// broken.
+bool load_mesh(const char * path, RenderObject &ro)
+{
+    std::ifstream file(path);
+    unsigned num_verts, num_faces;
+    if (!(file >> num_verts >> num_faces)) {
+        return false;
+    }
+    ro = RenderObject();
+    ro.verts.resize(num_verts);
+    ro.faces.resize(num_faces);
+    for (unsigned i = 0; i < num_verts; i++) {
+        char v;
+        ca::Vec3f &pos = ro.verts[i];
+        if (!(file >> v >> pos.x >> pos.y >> pos.z) or v != 'v') {
+            return false;
+        }
+    }
+    for (unsigned i = 0; i < num_faces; i++) {
+        char f;
+        unsigned f1, f2, f3;
+        if (!(file >> f >> f1 >> f2 >> f3) or f != 'f' or
+            f1 - 1 >= num_verts or f2 - 1 >= num_verts or f3 - 1 >= num_verts) {
+            return false;
+        }
+        ro.faces[i] = {f1 - 1, f2 - 1, f3 - 1};
+    }
+    compute_face_normals(ro);
+    return true;
+}
+
+// Levels of detail of a mesh, finest (the mesh itself) first. Each level is
+// simplified from the one before to a quarter of its faces, until one would
+// have fewer than kLodMinFaces.
+struct MeshLod
+{
+    RenderObject mesh;
+    float error;    // how far it may stray from the finest level, mesh units
 };
 
-RenderObject bunny;
-RenderObject squares;
+typedef std::vector<MeshLod> LodChain;
+
+const size_t kLodMinFaces = 64;
+const size_t kLodReduction = 4;
+
+LodChain make_lod_chain(const RenderObject &ro)
+{
+    CA_PROFILE_ZONE("make_lod_chain");
+    LodChain chain(1);
+    chain[0].mesh = ro;
+    chain[0].mesh.face_ids.clear();
+    chain[0].error = 0.0f;
+    while (chain.back().mesh.faces.size() / kLodReduction >= kLodMinFaces) {
+        const MeshLod &finer = chain.back();
+        MeshLod coarser;
+        const float error = ca::simplify_mesh(
+            finer.mesh.verts, finer.mesh.faces,
+            finer.mesh.faces.size() / kLodReduction,
+            &coarser.mesh.verts, &coarser.mesh.faces);
+        if (coarser.mesh.faces.size() == finer.mesh.faces.size()) {
+            break;
+        }
+        // errors of successive simplifications add up at worst
+        coarser.error = finer.error + error;
+        compute_face_normals(coarser.mesh);
+        chain.push_back(coarser);
+    }
+    return chain;
+}
+
+// Only the benchmarks, the regression check and the built in level use this;
+// the game takes its meshes from the level. Empty until load_bunny().
+LodChain bunny;
+
+// Loads bunny.obj and simplifies it into `bunny` on the first call.
+void load_bunny()
+{
+    static bool tried = false;
+    if (tried) {
+        return;
+    }
+    tried = true;
+    RenderObject bunny_mesh;
+    if (!load_mesh("bunny.obj", bunny_mesh)) {
+        debug_print("could not load bunny.obj\n");
+        return;
+    }
+    bunny = make_lod_chain(bunny_mesh);
+    for (size_t l = 0; l < bunny.size(); l++) {
+        debug_print("bunny lod %zu: %zu triangles, error %g\n",
+            l, bunny[l].mesh.faces.size(), bunny[l].error);
+    }
+}
+
+std::vector<SphereLight> scene_lights;
+LightTree scene_light_tree;
 
 ca::Vec3f eye = {0.0f, 0.0f, -2.3f};
 ca::Vec3f forward;
@@ -48,6 +203,7 @@ ca::Vec3f right;
 ca::Mat3f look_matrix;
 
 float walk_speed = 0.1f;
+float mouse_sensitivity = 0.005f;
 
 void update_look_matrix(float xAngleDelta, float yAngleDelta) {
     // calculate rotation
@@ -65,301 +221,1954 @@ void update_look_matrix(float xAngleDelta, float yAngleDelta) {
     right.y = 0;
 }
 
-struct NanortRenderData
+// the camera the game starts with
+void reset_camera()
 {
-    nanort::TriangleMesh<float> * mesh;
-    nanort::TriangleSAHPred<float> * pred;
-    nanort::TriangleIntersector<> * intersector;
-    nanort::BVHAccel<float> * accel;
-};
+    eye = {0.0f, 0.0f, -2.3f};
+    forward = {0.0f, 0.0f, 1.0f};
+    right   = {1.0f, 0.0f, 0.0f};
+    look_matrix = ca::Mat3f::Identity();
+    update_look_matrix(0.f, 0.f);
+}
 
-NanortRenderData
-build_scene(const RenderObject &ro,
-            const nanort::BVHBuildOptions<float> &options)
+// Camera changes gathered from every event in a frame, applied once before
+// the frame renders so a burst of key repeats or mouse motion costs one
+// update_look_matrix instead of one per event.
+struct CameraInput
 {
-    NanortRenderData out;
-    out.mesh = new nanort::TriangleMesh<float>(
-            reinterpret_cast<const float *>(ro.verts.data()),
-            reinterpret_cast<const unsigned *>(ro.faces.data()),
-            sizeof(float) * 3/* stride */);
-    out.pred = new nanort::TriangleSAHPred<float>(
-            reinterpret_cast<const float *>(ro.verts.data()),
-            reinterpret_cast<const unsigned *>(ro.faces.data()),
-            sizeof(float) * 3/* stride */);
-
-    out.intersector = new nanort::TriangleIntersector<>(
-            reinterpret_cast<const float *>(ro.verts.data()),
-            reinterpret_cast<const unsigned *>(ro.faces.data()),
-            sizeof(float) * 3/* stride */);
-    out.accel = new nanort::BVHAccel<float>;
-    out.accel->Build(ro.faces.size(), *out.mesh, *out.pred, options);
-    nanort::BVHBuildStatistics stats = out.accel->GetStatistics();
-    debug_print("  BVH statistics:\n");
-    debug_print("%zu\n", ro.faces.size());
-    debug_print("    # of leaf   nodes: %d\n", stats.num_leaf_nodes);
-    debug_print("    # of branch nodes: %d\n", stats.num_branch_nodes);
-    debug_print("  Max tree depth   : %d\n", stats.max_tree_depth);
-    return out;
-}
+    ca::Vec3f move;
+    float look_x;
+    float look_y;
+    unsigned num_events;
+};
 
-void render_scene(
-    int height,
-    int width,
-    const NanortRenderData &render_data,
-    // const nanort::BVHAccel<float> & accel,
-    // const nanort::TriangleIntersector<> & intersector,
-    SDL_Surface * target)
+CameraInput
+camera_input_init()
 {
-    SDL_LockSurface(target);
-    unsigned char * target_pixels = (unsigned char *)target->pixels;
-    // Shoot rays.
-    #ifdef _OPENMP
-    #pragma omp parallel for
-    #endif
-    const float tFar = 1.0e+30f;
-    for (int y = 0; y < height; y++) {
-        for (int x = 0; x < width; x++) {
-            nanort::BVHTraceOptions trace_options;
-            // Simple camera. change eye pos and direction fit to .obj model. 
-            ca::Vec3f ray_dir = {
-                (x / (float)width) - 0.5f,
-                (y / (float)height) - 0.5f,
-                1.0f};
-            ca::Vec3f rotated_vector = ca::mat_vec_mult(look_matrix, ray_dir);
-            nanort::Ray<float> ray;
-            ray.min_t = 0.0f;
-            ray.max_t = tFar;
-            ray.org[0] = eye.x;
-            ray.org[1] = eye.y;
-            ray.org[2] = eye.z;
-            ray.dir[0] = rotated_vector.x;
-            ray.dir[1] = rotated_vector.y;
-            ray.dir[2] = rotated_vector.z;
-            nanort::TriangleIntersection<> isect;
-            bool hit = render_data.accel->Traverse(
-                ray, *render_data.intersector, &isect, trace_options);
-            unsigned char * pixels = &(target_pixels[x * 4 + y * (width * 4)]);
-            if (hit) {
-                // TODO Write your shader here.
-                // TODO rename fid to something else
-                unsigned int fid = isect.prim_id;
-                const ca::Vec3f& v_normal = squares.normals[fid];
-
-                float red_color = 0.0f;
-
-                // global directional light
-                {
-                    static const ca::Vec3f negZ = {0.0f, 0.0f, -1.0f};
-                    const float f_dot = ca::dot(v_normal, negZ);
-                    if (f_dot >= 0.0f) {
-                        red_color += f_dot * 100 + 5.0f;
-                    }
-                }
+    CameraInput input;
+    input.move = {0.0f, 0.0f, 0.0f};
+    input.look_x = 0.0f;
+    input.look_y = 0.0f;
+    input.num_events = 0;
+    return input;
+}
 
-                // global sphere light
-                {
-                    static const ca::Vec3f v_sphereLight = {0.0f,0.0f,0.0f};
-                    const ca::Vec3u &v_face = squares.faces[fid];
-                    const ca::Vec3f &v_p1 = squares.verts[v_face.x];
-                    const ca::Vec3f &v_p2 = squares.verts[v_face.y];
-                    const ca::Vec3f &v_p3 = squares.verts[v_face.z];
-                    const ca::Vec3f v_u = v_p2 - v_p1;
-                    const ca::Vec3f v_v = v_p3 - v_p1;
-                    const ca::Vec3f v_hit = v_u * isect.u + v_v * isect.v + v_p1;
-                    const ca::Vec3f v_toLight = v_hit - v_sphereLight;
-                    const float f_dot = ca::dot(v_toLight, v_normal);
-                    if (f_dot < 0.0f) {
-                        float mult = 5.0f / ca::length(v_toLight);
-                        if (mult >= 1.0f) {
-                            mult = 1.0f;
-                        }
-                        red_color += mult * 100;
-                    }
-                }
-                // pixels[0] = (normal.x * 0.5f + 0.5f) * 240;
-                // pixels[1] = (normal.y * 0.5f + 0.5f) * 240;
-                // pixels[2] = (normal.z * 0.5f + 0.5f) * 240;
-                pixels[0] = red_color;
-                pixels[1] = 0;
-                pixels[2] = 0;
-            } else {
-                pixels[0] = 0;
-                pixels[1] = 0;
-                pixels[2] = 0;
-            }
-            pixels[3] = 255;
-        }
+void apply_camera_input(const CameraInput &input) {
+    eye += input.move;
+    if (input.look_x != 0.0f or input.look_y != 0.0f) {
+        update_look_matrix(input.look_x, input.look_y);
     }
-    SDL_UnlockSurface(target);
 }
 
-int window_scale = 2;
-int width = 64, height = 64;
+// Input-to-present latency. Each event is stamped when it comes off the SDL
+// queue (plus however long it sat in the queue), tagged with the frame that
+// applies it, and closed out once that frame has been presented.
+enum InputKind
+{
+    INPUT_KIND_KEY = 0,
+    INPUT_KIND_MOUSE,
+    INPUT_KIND_COUNT
+};
 
-// SDL helper stuff
-struct SDLWindowSurfacePair
+struct PendingInput
 {
-    SDL_Window * mainWindow;
-    SDL_Surface * screenSurface;
+    Uint64 poll_counter;    // SDL_GetPerformanceCounter() at poll time
+    Uint32 queued_ms;       // time spent in the SDL queue before the poll
+    unsigned long long frame;
+    InputKind kind;
 };
 
-SDLWindowSurfacePair
-SDL_init_window()
+struct InputLatencyTracker
 {
-    SDL_Window * mainWindow;
-    SDL_Surface * screenSurface;
-    // Initialize SDL window
-    {
+    std::vector<PendingInput> pending;
+    ca::LogHistogram histograms[INPUT_KIND_COUNT];
+    unsigned long long frames_presented;
+    unsigned long long events_consumed;
+};
 
-        //Initialization flag
-        bool success = true;
+InputLatencyTracker input_latency;
 
-        //Initialize SDL
-        if( SDL_Init( SDL_INIT_VIDEO ) < 0 )
-        {
-            printf( "SDL could not initialize! SDL Error: %s\n",
-                SDL_GetError());
-            success = false;
+void input_latency_stamp(const SDL_Event &e, InputKind kind,
+                         unsigned long long frame) {
+    PendingInput in;
+    in.poll_counter = SDL_GetPerformanceCounter();
+    const Uint32 now_ms = SDL_GetTicks();
+    in.queued_ms = now_ms >= e.common.timestamp ? now_ms - e.common.timestamp : 0;
+    in.frame = frame;
+    in.kind = kind;
+    input_latency.pending.push_back(in);
+}
+
+void input_latency_present(unsigned long long frame) {
+    const Uint64 now = SDL_GetPerformanceCounter();
+    const double us_per_tick = 1.0e6 / (double)SDL_GetPerformanceFrequency();
+    size_t kept = 0;
+    for (size_t i = 0; i < input_latency.pending.size(); i++) {
+        const PendingInput &in = input_latency.pending[i];
+        if (in.frame > frame) {
+            input_latency.pending[kept++] = in;
+            continue;
         }
-        else
-        {
-            //Create window
-            mainWindow = SDL_CreateWindow(
-                "SDL Tutorial",
-                SDL_WINDOWPOS_UNDEFINED,
-                SDL_WINDOWPOS_UNDEFINED,
-                window_scale * width,
-                window_scale * height,
-                SDL_WINDOW_SHOWN);
-            if( mainWindow == NULL )
-            {
-                printf("Window could not be created! SDL Error: %s\n",
-                    SDL_GetError());
-                success = false;
-            }
-            else
-            {
-                //Get window surface
-                screenSurface = SDL_GetWindowSurface( mainWindow );
+        const double us = (double)(now - in.poll_counter) * us_per_tick
+            + in.queued_ms * 1000.0;
+        input_latency.histograms[in.kind].add(us);
+        input_latency.events_consumed++;
+    }
+    input_latency.pending.resize(kept);
+    input_latency.frames_presented++;
+}
+
+void input_latency_report() {
+    static const char * kind_names[INPUT_KIND_COUNT] = {"key", "mouse"};
+    debug_print("Input-to-present latency (%llu frames, %llu events)\n",
+        input_latency.frames_presented, input_latency.events_consumed);
+    for (int k = 0; k < INPUT_KIND_COUNT; k++) {
+        const ca::LogHistogram &h = input_latency.histograms[k];
+        if (h.count == 0) {
+            continue;
+        }
+        debug_print("  %s: n=%llu mean=%.2fms p50=%.2fms p99=%.2fms max=%.2fms\n",
+            kind_names[k], (unsigned long long)h.count, h.mean() / 1000.0,
+            h.percentile(0.5) / 1000.0, h.percentile(0.99) / 1000.0,
+            h.max_us / 1000.0);
+        for (int b = 0; b < ca::LogHistogram::kNumBuckets; b++) {
+            if (h.buckets[b] == 0) {
+                continue;
             }
+            debug_print("    [%9.3f, %9.3f) ms : %llu\n",
+                ca::LogHistogram::bucket_low(b) / 1000.0,
+                ca::LogHistogram::bucket_high(b) / 1000.0,
+                (unsigned long long)h.buckets[b]);
         }
-
     }
-    return {mainWindow, screenSurface};
 }
 
-SDL_Surface *
-SDL_rendered_surface_init()
+// Input recording, -record <file>, and replay, -replay <file>. The log has
+// every input the main loop acted on, tagged with the loop iteration it was
+// polled in, plus the iterations where a background scene build started or
+// was swapped in. Replay hands the inputs back on the same iterations and
+// waits for builds where the recording had them land, so it renders the
+// same frames in the same order, only as fast as it can. Idle iterations
+// are skipped.
+//
+// File: "LRIN", a version byte, then per record the varint iteration delta
+// to the previous record, a kind byte and the payload: a varint key sym, or
+// zigzag varints for the mouse x and y motion.
+enum InputRecordKind
 {
-    //Main loop flag
-    bool quit = false;
-    // create the render target
-    int rmask;
-    int gmask;
-    int bmask;
-    int amask;
+    INPUT_RECORD_KEY = 0,
+    INPUT_RECORD_MOUSE,
+    INPUT_RECORD_QUIT,
+    INPUT_RECORD_OTHER,         // any other event, the loop only redraws
+    INPUT_RECORD_BUILD_START,
+    INPUT_RECORD_SCENE_SWAP,
+    INPUT_RECORD_KIND_COUNT
+};
 
-#if SDL_BYTEORDER == SDL_BIG_ENDIAN
-    rmask = 0xff000000;
-    gmask = 0x00ff0000;
-    bmask = 0x0000ff00;
-    amask = 0x000000ff;
-#else
-    rmask = 0x000000ff;
-    gmask = 0x0000ff00;
-    bmask = 0x00ff0000;
-    amask = 0xff000000;
-#endif
+const char kInputLogMagic[4] = {'L', 'R', 'I', 'N'};
+const int kInputLogVersion = 1;
 
+struct InputRecord
+{
+    unsigned long long tick;    // main loop iteration
+    InputRecordKind kind;
+    Sint32 x;                   // key sym, or mouse motion
+    Sint32 y;
+};
 
-    return SDL_CreateRGBSurface(0, /* flags */
-            width, height,
-            32, /* bitdepth */
-            rmask, gmask, bmask, amask);
+struct InputLog
+{
+    FILE * file;                        // while recording
+    unsigned long long last_tick;
+    bool replaying;
+    std::vector<InputRecord> records;   // while replaying
+    size_t next;
+};
+
+InputLog input_log;
+
+void input_log_put_varint(unsigned long long v)
+{
+    while (v >= 0x80) {
+        fputc((int)(v & 0x7f) | 0x80, input_log.file);
+        v >>= 7;
+    }
+    fputc((int)v, input_log.file);
 }
 
-void drawInvertedCube(
-    RenderObject &cube,
-    const ca::Vec3f& pos,
-    const ca::Mat3f& rot_mat,
-    const float scale = 10.0f)
+bool input_log_record_start(const char * path)
 {
-    const float extent = scale * 0.5f;
-    const ca::Vec3f cube_verts [8] = {
-        {-extent + pos.x, -extent + pos.y, -extent + pos.z},
-        {-extent + pos.x, -extent + pos.y,  extent + pos.z},
-        {-extent + pos.x,  extent + pos.y, -extent + pos.z},
-        {-extent + pos.x,  extent + pos.y,  extent + pos.z},
-        { extent + pos.x, -extent + pos.y, -extent + pos.z},
-        { extent + pos.x, -extent + pos.y,  extent + pos.z},
-        { extent + pos.x,  extent + pos.y, -extent + pos.z},
-        { extent + pos.x,  extent + pos.y,  extent + pos.z}
-    };
-    ca::Vec3f cube_normals [12];
-    const unsigned length_v = (unsigned)(cube.verts.size());
-    const ca::Vec3u cube_faces [12] = {
-        {length_v + 1, length_v + 7, length_v + 5},
-        {length_v + 7, length_v + 1, length_v + 3},
-        {length_v + 5, length_v + 6, length_v + 4},
-        {length_v + 6, length_v + 5, length_v + 7},
-        {length_v + 3, length_v + 6, length_v + 7},
-        {length_v + 6, length_v + 3, length_v + 2},
-        {length_v + 4, length_v + 1, length_v + 5},
-        {length_v + 1, length_v + 4, length_v + 0},
-        {length_v + 0, length_v + 3, length_v + 1},
-        {length_v + 3, length_v + 0, length_v + 2},
-        {length_v + 6, length_v + 0, length_v + 4},
-        {length_v + 0, length_v + 6, length_v + 2}
-    };
+    input_log.file = fopen(path, "wb");
+    if (!input_log.file) {
+        return false;
+    }
+    fwrite(kInputLogMagic, 1, sizeof(kInputLogMagic), input_log.file);
+    fputc(kInputLogVersion, input_log.file);
+    input_log.last_tick = 0;
+    return true;
+}
 
-    for (size_t i = 0; i < 12; i++) {
-        const ca::Vec3f& p1 = cube_verts[cube_faces[i].x - length_v];
-        const ca::Vec3f& p2 = cube_verts[cube_faces[i].y - length_v];
-        const ca::Vec3f& p3 = cube_verts[cube_faces[i].z - length_v];
-        ca::Vec3f u = p2 - p1;
-        ca::Vec3f v = p3 - p1;
+void input_log_write(unsigned long long tick, InputRecordKind kind, Sint32 x = 0, Sint32 y = 0)
+{
+    if (!input_log.file) {
+        return;
+    }
+    input_log_put_varint(tick - input_log.last_tick);
+    input_log.last_tick = tick;
+    fputc(kind, input_log.file);
+    if (kind == INPUT_RECORD_KEY) {
+        input_log_put_varint((Uint32)x);
+    } else if (kind == INPUT_RECORD_MOUSE) {
+        input_log_put_varint(((Uint32)x << 1) ^ (Uint32)(x >> 31));
+        input_log_put_varint(((Uint32)y << 1) ^ (Uint32)(y >> 31));
+    }
+}
 
-        ca::Vec3f normal = {
-            u.y * v.z - u.z * v.y,
-            u.z * v.x - u.x * v.z,
-            u.x * v.y - u.y * v.x
-        };
-        normal = rot_mat * normal;
-        ca::normalize_modify(normal);
-        cube_normals[i] = normal;
+// Records an SDL event the main loop is about to handle. R is left out:
+// what it does depends on whether a build is still running, so the main
+// loop records it as INPUT_RECORD_BUILD_START only when it starts one.
+void input_log_write_event(unsigned long long tick, const SDL_Event &e)
+{
+    if (e.type == SDL_KEYDOWN) {
+        if (e.key.keysym.sym != SDLK_r) {
+            input_log_write(tick, INPUT_RECORD_KEY, e.key.keysym.sym);
+        }
+    } else if (e.type == SDL_MOUSEMOTION) {
+        input_log_write(tick, INPUT_RECORD_MOUSE, e.motion.xrel, e.motion.yrel);
+    } else if (e.type == SDL_QUIT) {
+        input_log_write(tick, INPUT_RECORD_QUIT);
+    } else {
+        input_log_write(tick, INPUT_RECORD_OTHER);
     }
-    size_t cube_verts_i = cube.verts.size();
-    cube.verts.insert(cube.verts.end(), cube_verts, cube_verts + 8 );
-    cube.faces.insert(cube.faces.end(), cube_faces, cube_faces + 12);
-    cube.normals.insert(cube.normals.end(), cube_normals, cube_normals + 12);
+}
 
-    // rotate the vertices
-    while (cube_verts_i < cube.verts.size()) {
-        cube.verts[cube_verts_i] = (rot_mat * cube.verts[cube_verts_i]);
-        cube_verts_i++;
+void input_log_record_stop()
+{
+    if (input_log.file) {
+        fclose(input_log.file);
+        input_log.file = NULL;
     }
 }
 
-void drawCube(
-    RenderObject &cube,
-    const ca::Vec3f& pos,
-    const ca::Mat3f& rot_mat,
-    const float scale = 1.0f)
+// Reads a whole log for replay. false if the file is missing or damaged.
+bool input_log_load(const char * path)
 {
-    const float extent = scale * 0.5f;
-    const ca::Vec3f cube_verts [8] = {
-        {-extent + pos.x, -extent + pos.y, -extent + pos.z},
-        {-extent + pos.x, -extent + pos.y,  extent + pos.z},
-        {-extent + pos.x,  extent + pos.y, -extent + pos.z},
-        {-extent + pos.x,  extent + pos.y,  extent + pos.z},
-        { extent + pos.x, -extent + pos.y, -extent + pos.z},
-        { extent + pos.x, -extent + pos.y,  extent + pos.z},
-        { extent + pos.x,  extent + pos.y, -extent + pos.z},
-        { extent + pos.x,  extent + pos.y,  extent + pos.z}
-    };
-    ca::Vec3f cube_normals [12];
-    const unsigned length_v = (unsigned)(cube.verts.size());
-    const ca::Vec3u cube_faces [12] = {
+    std::ifstream file(path, std::ios::binary);
+    const std::vector<unsigned char> bytes(
+        (std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+    if (bytes.size() < sizeof(kInputLogMagic) + 1 or
+        memcmp(bytes.data(), kInputLogMagic, sizeof(kInputLogMagic)) != 0 or
+        bytes[sizeof(kInputLogMagic)] != kInputLogVersion) {
+        return false;
+    }
+
+    size_t pos = sizeof(kInputLogMagic) + 1;
+    bool ok = true;
+    auto get_varint = [&]() {
+        unsigned long long v = 0;
+        for (int shift = 0; shift < 64; shift += 7) {
+            if (pos >= bytes.size()) {
+                break;
+            }
+            const unsigned char b = bytes[pos++];
+            v |= (unsigned long long)(b & 0x7f) << shift;
+            if (!(b & 0x80)) {
+                return v;
+            }
+        }
+        ok = false;
+        return v;
+    };
+    auto get_zigzag = [&]() {
+        const Uint32 v = (Uint32)get_varint();
+        return (Sint32)(v >> 1) ^ -(Sint32)(v & 1);
+    };
+
+    input_log.records.clear();
+    unsigned long long tick = 0;
+    while (ok and pos < bytes.size()) {
+        InputRecord r;
+        tick += get_varint();
+        r.tick = tick;
+        if (pos >= bytes.size() or bytes[pos] >= INPUT_RECORD_KIND_COUNT) {
+            ok = false;
+            break;
+        }
+        r.kind = (InputRecordKind)bytes[pos++];
+        r.x = 0;
+        r.y = 0;
+        if (r.kind == INPUT_RECORD_KEY) {
+            r.x = (Sint32)get_varint();
+        } else if (r.kind == INPUT_RECORD_MOUSE) {
+            r.x = get_zigzag();
+            r.y = get_zigzag();
+        }
+        input_log.records.push_back(r);
+    }
+    input_log.next = 0;
+    input_log.replaying = ok;
+    return ok;
+}
+
+bool input_log_done()
+{
+    return input_log.next >= input_log.records.size();
+}
+
+// first iteration with something to replay
+unsigned long long input_log_next_tick()
+{
+    return input_log.records[input_log.next].tick;
+}
+
+// Takes the next record if it belongs to `tick` and is of one of the kinds
+// from `first` to `last`.
+bool input_log_take(unsigned long long tick, InputRecordKind first, InputRecordKind last,
+                    InputRecord * r)
+{
+    if (input_log_done()) {
+        return false;
+    }
+    const InputRecord &next = input_log.records[input_log.next];
+    if (next.tick != tick or next.kind < first or next.kind > last) {
+        return false;
+    }
+    *r = next;
+    input_log.next++;
+    return true;
+}
+
+// The SDL event a replayed input record stands for. false once `tick` has
+// no more of them.
+bool input_log_take_event(unsigned long long tick, SDL_Event * e)
+{
+    InputRecord r;
+    if (!input_log_take(tick, INPUT_RECORD_KEY, INPUT_RECORD_BUILD_START, &r)) {
+        return false;
+    }
+    memset(e, 0, sizeof(*e));
+    e->common.timestamp = SDL_GetTicks();
+    if (r.kind == INPUT_RECORD_KEY) {
+        e->type = SDL_KEYDOWN;
+        e->key.keysym.sym = r.x;
+    } else if (r.kind == INPUT_RECORD_BUILD_START) {
+        e->type = SDL_KEYDOWN;
+        e->key.keysym.sym = SDLK_r;
+    } else if (r.kind == INPUT_RECORD_MOUSE) {
+        e->type = SDL_MOUSEMOTION;
+        e->motion.xrel = r.x;
+        e->motion.yrel = r.y;
+    } else if (r.kind == INPUT_RECORD_QUIT) {
+        e->type = SDL_QUIT;
+    } else {
+        e->type = SDL_USEREVENT;
+    }
+    return true;
+}
+
+struct ReplayFrame
+{
+    double ms;                  // render_scene() time
+    unsigned long long tick;
+};
+
+const size_t kReplayWorstFrames = 5;
+
+// Frame time summary of a replay, with the iterations of the slowest frames
+// so a spike can be replayed up to and looked at.
+void input_log_replay_report(std::vector<ReplayFrame> frames)
+{
+    if (frames.empty()) {
+        return;
+    }
+    std::sort(frames.begin(), frames.end(),
+        [](const ReplayFrame &a, const ReplayFrame &b) { return a.ms > b.ms; });
+    double total_ms = 0.0;
+    for (size_t i = 0; i < frames.size(); i++) {
+        total_ms += frames[i].ms;
+    }
+    debug_print("Replay: %zu frames in %.1fms, median %.3fms, p99 %.3fms, max %.3fms\n",
+        frames.size(), total_ms, frames[frames.size() / 2].ms,
+        frames[frames.size() / 100].ms, frames[0].ms);
+    for (size_t i = 0; i < frames.size() and i < kReplayWorstFrames; i++) {
+        debug_print("  iteration %llu: %.3fms\n", frames[i].tick, frames[i].ms);
+    }
+}
+
+// Permute faces and normals into BVH leaf order after each build, so a leaf
+// reads one contiguous run of faces and the BVH can drop its index array.
+bool leaf_order_faces = true;
+
+// print each BVH's statistics as it is built
+bool print_build_stats = true;
+
+// Shrink every array of an object to its size before its BVH is built, and
+// the BVH's own arrays after (see BVHBuildOptions::compact). Costs a copy
+// of each at build time, saves the slack vectors keep for growing.
+bool compact_memory = false;
+
+// ro's arrays down to their size, by copy (shrink_to_fit may do nothing)
+void compact_render_object(RenderObject &ro)
+{
+    std::vector<ca::Vec3f>(ro.verts).swap(ro.verts);
+    std::vector<ca::Vec3f>(ro.normals).swap(ro.normals);
+    std::vector<ca::Vec3u>(ro.faces).swap(ro.faces);
+    std::vector<unsigned>(ro.face_ids).swap(ro.face_ids);
+    std::vector<unsigned short>(ro.packed_verts).swap(ro.packed_verts);
+}
+
+// values[i] = old values[order[i]], in place so pointers into the storage
+// (the intersector's) stay valid
+template <typename V>
+void permute_in_place(std::vector<V> &values, const std::vector<unsigned> &order)
+{
+    std::vector<V> permuted(order.size());
+    for (size_t i = 0; i < order.size(); i++) {
+        permuted[i] = values[order[i]];
+    }
+    std::copy(permuted.begin(), permuted.end(), values.begin());
+}
+
+void reorder_faces_to_leaf_order(RenderObject &ro, nanort::BVHAccel<float> &accel)
+{
+    const std::vector<unsigned> &order = accel.GetIndices();
+    if (order.size() != ro.faces.size()) {
+        return;
+    }
+    if (ro.face_ids.empty()) {
+        ro.face_ids = order;
+    } else {
+        permute_in_place(ro.face_ids, order);
+    }
+    permute_in_place(ro.faces, order);
+    permute_in_place(ro.normals, order);
+    accel.ReleaseIndices();
+}
+
+// Traverse against 16-bit vertices on a grid over each object (see
+// nanort::QuantizedVertices) instead of its float verts. Halves the vertex
+// bytes rays pull in, at the price of converting them back per test, so it
+// pays off for big static meshes that don't fit in cache. Shading still
+// reads the float verts. Off by default; -bench compares the two.
+bool quantize_vertices = false;
+
+typedef nanort::QuantizedVertices<float> PackedVertices;
+typedef nanort::TriangleMesh<float, PackedVertices> PackedTriangleMesh;
+typedef nanort::TriangleSAHPred<float, PackedVertices> PackedTriangleSAHPred;
+typedef nanort::TriangleIntersector<
+    float, nanort::TriangleIntersection<float>, PackedVertices> PackedTriangleIntersector;
+
+struct NanortRenderData
+{
+    nanort::TriangleMesh<float> * mesh;
+    nanort::TriangleSAHPred<float> * pred;
+    nanort::TriangleIntersector<> * intersector;
+    // used instead of the three above when the vertices are quantized
+    PackedTriangleMesh * packed_mesh;
+    PackedTriangleSAHPred * packed_pred;
+    PackedTriangleIntersector * packed_intersector;
+    nanort::BVHAccel<float> * accel;
+    const RenderObject * object;
+};
+
+// (re)quantizes ro.verts into ro.packed_verts
+PackedVertices pack_vertices(RenderObject &ro)
+{
+    return PackedVertices::Quantize(
+        reinterpret_cast<const float *>(ro.verts.data()), ro.verts.size(),
+        sizeof(float) * 3/* stride */, &ro.packed_verts);
+}
+
+NanortRenderData
+build_scene(RenderObject &ro,
+            const nanort::BVHBuildOptions<float> &options)
+{
+    CA_PROFILE_ZONE("build_scene");
+    NanortRenderData out;
+    out.object = &ro;
+    out.mesh = NULL;
+    out.pred = NULL;
+    out.intersector = NULL;
+    out.packed_mesh = NULL;
+    out.packed_pred = NULL;
+    out.packed_intersector = NULL;
+    out.accel = new nanort::BVHAccel<float>;
+    const unsigned * faces = reinterpret_cast<const unsigned *>(ro.faces.data());
+    if (quantize_vertices) {
+        const PackedVertices packed = pack_vertices(ro);
+        out.packed_mesh = new PackedTriangleMesh(packed, faces);
+        out.packed_pred = new PackedTriangleSAHPred(packed, faces);
+        out.packed_intersector = new PackedTriangleIntersector(packed, faces);
+        out.accel->Build(ro.faces.size(), *out.packed_mesh, *out.packed_pred, options);
+    } else {
+        ro.packed_verts.clear();
+        out.mesh = new nanort::TriangleMesh<float>(
+                reinterpret_cast<const float *>(ro.verts.data()), faces,
+                sizeof(float) * 3/* stride */);
+        out.pred = new nanort::TriangleSAHPred<float>(
+                reinterpret_cast<const float *>(ro.verts.data()), faces,
+                sizeof(float) * 3/* stride */);
+        out.intersector = new nanort::TriangleIntersector<>(
+                reinterpret_cast<const float *>(ro.verts.data()), faces,
+                sizeof(float) * 3/* stride */);
+        out.accel->Build(ro.faces.size(), *out.mesh, *out.pred, options);
+    }
+    if (leaf_order_faces) {
+        reorder_faces_to_leaf_order(ro, *out.accel);
+    }
+    if (!print_build_stats) {
+        return out;
+    }
+    nanort::BVHBuildStatistics stats = out.accel->GetStatistics();
+    debug_print("  BVH statistics:\n");
+    debug_print("%zu\n", ro.faces.size());
+    debug_print("    # of leaf   nodes: %d\n", stats.num_leaf_nodes);
+    debug_print("    # of branch nodes: %d\n", stats.num_branch_nodes);
+    debug_print("  Max tree depth   : %d\n", stats.max_tree_depth);
+    debug_print("  Build time       : %.3f ms\n", stats.build_secs * 1000.0f);
+    debug_print("  Memory           : %zu bytes, %zu unused, peak %zu in build\n",
+        stats.node_bytes + stats.index_bytes + stats.parent_bytes,
+        stats.unused_bytes, stats.peak_build_bytes);
+    return out;
+}
+
+void free_render_data(NanortRenderData &rd)
+{
+    delete rd.accel;
+    delete rd.intersector;
+    delete rd.pred;
+    delete rd.mesh;
+    delete rd.packed_intersector;
+    delete rd.packed_pred;
+    delete rd.packed_mesh;
+}
+
+// Editable scene. Every object keeps its geometry and BVH in object space
+// plus a transform, and a small top level BVH over the objects' world
+// bounds ties them together; rays are moved into an object's space to trace
+// it. Edits only mark objects dirty; scene_update() then builds the BVHs of
+// new objects and refits the top level over moved ones, so adding costs
+// the object's build and moving costs a top level refit, whatever the
+// object's size. Objects added with a LodChain get geometry and a BVH per
+// level, and each frame traces the level select_lods() picked for it.
+
+struct ObjectHandle
+{
+    unsigned slot;
+    unsigned generation;    // tells a reused slot from the object it had
+};
+
+// world = rotation * object + position. The rotation has to be
+// orthonormal (bake scale into the geometry): rays go into object space
+// through its transpose.
+struct ObjectTransform
+{
+    ca::Mat3f rotation;
+    ca::Vec3f position;
+};
+
+ObjectTransform identity_transform()
+{
+    ObjectTransform transform;
+    transform.rotation = ca::Mat3f::Identity();
+    transform.position = {0.0f, 0.0f, 0.0f};
+    return transform;
+}
+
+struct ObjectLod
+{
+    RenderObject mesh;          // object space, faces in leaf order once built
+    NanortRenderData bvh;       // over `mesh`, accel NULL until built
+    float error;                // see MeshLod
+};
+
+struct SceneObject
+{
+    std::vector<ObjectLod> lods;    // finest first, one for plain objects
+    unsigned lod;                   // the level frames trace
+    ObjectTransform transform;
+    // set by place_scene_object() from the transform and the built BVHs
+    ca::Mat3f to_object;            // transpose of transform.rotation
+    bool rotated;                   // rotation is not the identity
+    float world_lo[3];              // bounds of every level, placed
+    float world_hi[3];
+    nanort::BVHBuildOptions<float> options;
+    unsigned generation;
+    bool alive;
+    bool needs_build;           // added since the last update
+    bool needs_place;           // moved since the last update
+};
+
+// The top level BVH sees each object as one primitive: its world bounds.
+class SceneObjectBounds;
+class SceneObjectPred;
+
+// Owns its geometry (the build reorders faces), so the renderer can keep
+// tracing one scene while another is built on a worker thread.
+struct Scene
+{
+    std::vector<SceneObject> objects;       // indexed by ObjectHandle::slot
+    std::vector<unsigned> free_slots;
+    std::vector<unsigned> dead_slots;       // removed, freed by the next update
+    nanort::BVHBuildOptions<float> options; // for objects added without their own
+
+    nanort::BVHAccel<float> top;
+    std::vector<unsigned> top_slots;        // top level primitive -> slot
+    bool top_needs_build;
+    bool top_needs_refit;
+    unsigned top_refits;                    // since the top level was built
+    float top_built_cost;                   // top_level_cost() after that build
+
+    Scene() : top_needs_build(false), top_needs_refit(false), top_refits(0),
+              top_built_cost(0.0f) {}
+};
+
+// the level frames trace
+inline const ObjectLod &current_lod(const SceneObject &obj)
+{
+    return obj.lods[obj.lod];
+}
+
+// World bounds of every level, so switching levels never needs the top
+// level BVH updated.
+void scene_object_bounds(const SceneObject &obj, float lo[3], float hi[3])
+{
+    for (int k = 0; k < 3; k++) {
+        lo[k] = obj.world_lo[k];
+        hi[k] = obj.world_hi[k];
+    }
+}
+
+class SceneObjectBounds
+{
+  public:
+    explicit SceneObjectBounds(const Scene * scene) : scene_(scene) {}
+
+    void BoundingBox(nanort::real3<float> * bmin, nanort::real3<float> * bmax,
+                     unsigned int prim_index) const {
+        const SceneObject &obj = scene_->objects[scene_->top_slots[prim_index]];
+        float lo[3], hi[3];
+        scene_object_bounds(obj, lo, hi);
+        for (int k = 0; k < 3; k++) {
+            (*bmin)[k] = lo[k];
+            (*bmax)[k] = hi[k];
+        }
+    }
+
+  private:
+    const Scene * scene_;
+};
+
+class SceneObjectPred
+{
+  public:
+    explicit SceneObjectPred(const Scene * scene)
+        : axis_(0), pos_(0.0f), scene_(scene) {}
+
+    void Set(int axis, float pos) const {
+        axis_ = axis;
+        pos_ = pos;
+    }
+
+    bool operator()(unsigned int i) const {
+        const SceneObject &obj = scene_->objects[scene_->top_slots[i]];
+        float lo[3], hi[3];
+        scene_object_bounds(obj, lo, hi);
+        return lo[axis_] + hi[axis_] < 2.0f * pos_;
+    }
+
+  private:
+    mutable int axis_;
+    mutable float pos_;
+    const Scene * scene_;
+};
+
+// frees the BVHs and geometry of every level
+void free_scene_object(SceneObject &obj)
+{
+    for (size_t l = 0; l < obj.lods.size(); l++) {
+        if (obj.lods[l].bvh.accel) {
+            free_render_data(obj.lods[l].bvh);
+        }
+    }
+    obj.lods.clear();
+}
+
+void destroy_scene(Scene * scene)
+{
+    if (!scene) {
+        return;
+    }
+    for (size_t i = 0; i < scene->objects.size(); i++) {
+        free_scene_object(scene->objects[i]);
+    }
+    delete scene;
+}
+
+SceneObject * scene_object(Scene &scene, ObjectHandle handle)
+{
+    if (handle.slot >= scene.objects.size()) {
+        return NULL;
+    }
+    SceneObject &obj = scene.objects[handle.slot];
+    if (!obj.alive or obj.generation != handle.generation) {
+        return NULL;
+    }
+    return &obj;
+}
+
+// Derives what tracing needs from obj.transform: the rotation into object
+// space and the world bounds (the object space bounds of every level with
+// their corners put in place). O(levels), whatever the object's size; the
+// BVHs have to be built.
+void place_scene_object(SceneObject &obj)
+{
+    const ca::Mat3f &rotation = obj.transform.rotation;
+    const ca::Vec3f &position = obj.transform.position;
+    const ca::Mat3f identity = ca::Mat3f::Identity();
+    obj.to_object = ca::transpose(rotation);
+    obj.rotated = memcmp(&rotation, &identity, sizeof(rotation)) != 0;
+
+    float lo[3], hi[3];
+    obj.lods[0].bvh.accel->BoundingBox(lo, hi);
+    for (size_t l = 1; l < obj.lods.size(); l++) {
+        float lod_lo[3], lod_hi[3];
+        obj.lods[l].bvh.accel->BoundingBox(lod_lo, lod_hi);
+        for (int k = 0; k < 3; k++) {
+            lo[k] = std::min(lo[k], lod_lo[k]);
+            hi[k] = std::max(hi[k], lod_hi[k]);
+        }
+    }
+    for (int k = 0; k < 3; k++) {
+        obj.world_lo[k] = lo[k];
+        obj.world_hi[k] = hi[k];
+    }
+    if (lo[0] > hi[0]) {
+        return;         // no faces, the empty box stays empty
+    }
+    for (int k = 0; k < 3; k++) {
+        obj.world_lo[k] = std::numeric_limits<float>::max();
+        obj.world_hi[k] = -std::numeric_limits<float>::max();
+    }
+    for (int c = 0; c < 8; c++) {
+        const ca::Vec3f corner = {(c & 1) ? hi[0] : lo[0], (c & 2) ? hi[1] : lo[1],
+                                  (c & 4) ? hi[2] : lo[2]};
+        const ca::Vec3f world = rotation * corner + position;
+        const float * p = &world.x;
+        for (int k = 0; k < 3; k++) {
+            obj.world_lo[k] = std::min(obj.world_lo[k], p[k]);
+            obj.world_hi[k] = std::max(obj.world_hi[k], p[k]);
+        }
+    }
+}
+
+// `ray` in the object space of `obj`. t, and so the hit, carry over.
+inline void object_space_ray(const SceneObject &obj, const nanort::Ray<float> &ray,
+                             nanort::Ray<float> * out)
+{
+    *out = ray;
+    const ca::Vec3f &position = obj.transform.position;
+    const ca::Vec3f org = {ray.org[0] - position.x, ray.org[1] - position.y,
+                           ray.org[2] - position.z};
+    if (!obj.rotated) {
+        out->org[0] = org.x;
+        out->org[1] = org.y;
+        out->org[2] = org.z;
+        return;
+    }
+    const ca::Vec3f o = obj.to_object * org;
+    const ca::Vec3f d = obj.to_object * ca::Vec3f{ray.dir[0], ray.dir[1], ray.dir[2]};
+    out->org[0] = o.x;
+    out->org[1] = o.y;
+    out->org[2] = o.z;
+    out->dir[0] = d.x;
+    out->dir[1] = d.y;
+    out->dir[2] = d.z;
+    for (int k = 0; k < 3; k++) {
+        out->inv_dir[k] = ca::safe_inverse(out->dir[k]);
+        // sign of the inverse so -0.0 pairs with -inf
+        out->dir_sign[k] = out->inv_dir[k] < 0.0f ? 1 : 0;
+    }
+}
+
+// `options` NULL builds the object's BVHs with scene.options.
+ObjectHandle scene_add_lod_object(
+    Scene &scene,
+    const LodChain &chain,
+    const ObjectTransform &transform,
+    const nanort::BVHBuildOptions<float> * options = NULL)
+{
+    unsigned slot;
+    if (!scene.free_slots.empty()) {
+        slot = scene.free_slots.back();
+        scene.free_slots.pop_back();
+    } else {
+        slot = (unsigned)scene.objects.size();
+        scene.objects.push_back(SceneObject());
+        scene.objects[slot].generation = 0;
+    }
+
+    SceneObject &obj = scene.objects[slot];
+    obj.lods.resize(chain.size());
+    for (size_t l = 0; l < chain.size(); l++) {
+        ObjectLod &lod = obj.lods[l];
+        lod.mesh = chain[l].mesh;
+        lod.mesh.face_ids.clear();
+        lod.bvh.accel = NULL;
+        lod.error = chain[l].error;
+    }
+    obj.lod = 0;
+    obj.transform = transform;
+    obj.options = options ? *options : scene.options;
+    obj.generation++;
+    obj.alive = true;
+    obj.needs_build = true;
+    obj.needs_place = false;
+    return ObjectHandle{slot, obj.generation};
+}
+
+ObjectHandle scene_add_object(
+    Scene &scene,
+    const RenderObject &geometry,
+    const ObjectTransform &transform)
+{
+    LodChain chain(1);
+    chain[0].mesh = geometry;
+    chain[0].error = 0.0f;
+    return scene_add_lod_object(scene, chain, transform);
+}
+
+bool scene_remove_object(Scene &scene, ObjectHandle handle)
+{
+    SceneObject * obj = scene_object(scene, handle);
+    if (!obj) {
+        return false;
+    }
+    // The top level BVH still points at the slot, so it is only freed (and
+    // reused) once the update rebuilt the top level.
+    obj->alive = false;
+    scene.dead_slots.push_back(handle.slot);
+    scene.top_needs_build = true;
+    return true;
+}
+
+bool scene_set_transform(
+    Scene &scene,
+    ObjectHandle handle,
+    const ObjectTransform &transform)
+{
+    SceneObject * obj = scene_object(scene, handle);
+    if (!obj) {
+        return false;
+    }
+    obj->transform = transform;
+    obj->needs_place = true;
+    return true;
+}
+
+// After this many refits, or once top_level_cost() grew by this factor
+// since the build, scene_update() rebuilds the top level.
+const unsigned kTopMaxRefits = 64;
+const float kTopMaxCostGrowth = 1.5f;
+
+// Surface area heuristic of a top level BVH: the summed surface area of its
+// nodes over the root's, i.e. the expected node visits of a ray that hits
+// the root, leaving out the primitive tests.
+float top_level_cost(const nanort::BVHAccel<float> &top)
+{
+    const std::vector<nanort::BVHNode<float> > &nodes = top.GetNodes();
+    if (nodes.empty()) {
+        return 0.0f;
+    }
+    float total = 0.0f;
+    float root = 0.0f;
+    for (size_t i = 0; i < nodes.size(); i++) {
+        const float dx = nodes[i].bmax[0] - nodes[i].bmin[0];
+        const float dy = nodes[i].bmax[1] - nodes[i].bmin[1];
+        const float dz = nodes[i].bmax[2] - nodes[i].bmin[2];
+        const float area = dx * dy + dy * dz + dz * dx;
+        total += area;
+        if (i == 0) {
+            root = area;
+        }
+    }
+    return root > 0.0f ? total / root : 0.0f;
+}
+
+// Applies the edits since the last call. Call between frames: nothing may
+// be tracing the scene meanwhile. true if anything changed. BVH builds use at
+// most `max_threads` threads, 0 for all of them.
+bool scene_update(Scene &scene, unsigned max_threads = 0)
+{
+    bool changed = false;
+
+    for (size_t i = 0; i < scene.dead_slots.size(); i++) {
+        free_scene_object(scene.objects[scene.dead_slots[i]]);
+        scene.free_slots.push_back(scene.dead_slots[i]);
+        changed = true;
+    }
+    scene.dead_slots.clear();
+
+    for (size_t i = 0; i < scene.objects.size(); i++) {
+        SceneObject &obj = scene.objects[i];
+        if (!obj.alive) {
+            continue;
+        }
+        if (obj.needs_build) {
+            nanort::BVHBuildOptions<float> options = obj.options;
+            options.compact = options.compact or compact_memory;
+            options.max_threads = max_threads;
+            for (size_t l = 0; l < obj.lods.size(); l++) {
+                if (compact_memory) {
+                    compact_render_object(obj.lods[l].mesh);
+                }
+                obj.lods[l].bvh = build_scene(obj.lods[l].mesh, options);
+            }
+            place_scene_object(obj);
+            obj.needs_build = false;
+            obj.needs_place = false;
+            scene.top_needs_build = true;
+        } else if (obj.needs_place) {
+            // the object space BVHs stay as they are
+            place_scene_object(obj);
+            obj.needs_place = false;
+            scene.top_needs_refit = true;
+        }
+    }
+
+    if (scene.top_needs_refit and not scene.top_needs_build) {
+        scene.top.Refit(SceneObjectBounds(&scene));
+        scene.top_refits++;
+        changed = true;
+        // A refit keeps the tree built for where the objects were, so it gets
+        // worse as they wander off; rebuild once it clearly did.
+        if (scene.top_refits >= kTopMaxRefits or
+            top_level_cost(scene.top) > scene.top_built_cost * kTopMaxCostGrowth) {
+            scene.top_needs_build = true;
+        }
+    }
+    if (scene.top_needs_build) {
+        CA_PROFILE_ZONE("top level build");
+        scene.top_slots.clear();
+        for (size_t i = 0; i < scene.objects.size(); i++) {
+            const SceneObject &obj = scene.objects[i];
+            if (obj.alive and obj.lods[0].bvh.accel->IsValid()) {
+                scene.top_slots.push_back((unsigned)i);
+            }
+        }
+        nanort::BVHBuildOptions<float> options;
+        options.min_leaf_primitives = 1;
+        options.compact = compact_memory;
+        options.max_threads = max_threads;
+        SceneObjectBounds bounds(&scene);
+        SceneObjectPred pred(&scene);
+        if (scene.top_slots.empty()) {
+            scene.top = nanort::BVHAccel<float>();
+        } else {
+            scene.top.Build((unsigned)scene.top_slots.size(), bounds, pred, options);
+        }
+        scene.top_refits = 0;
+        scene.top_built_cost = top_level_cost(scene.top);
+        changed = true;
+    }
+    scene.top_needs_build = false;
+    scene.top_needs_refit = false;
+
+    return changed;
+}
+
+// Builds a Scene on a worker thread. The result waits in `finished` until
+// swap_built_scene() picks it up between two frames.
+struct AsyncSceneBuild
+{
+    std::thread worker;
+    std::atomic<Scene *> finished;
+    std::atomic<bool> running;
+};
+
+AsyncSceneBuild scene_build;
+
+// Runs scene_update() on `scene` (objects added, nothing built yet) in the
+// background and takes ownership of it. The build leaves one hardware thread
+// to the render loop. false if a build is still running,
+// try again on a later frame; `scene` is left to the caller then.
+bool start_scene_build(Scene * scene)
+{
+    if (scene_build.running.load()) {
+        return false;
+    }
+    if (scene_build.worker.joinable()) {
+        scene_build.worker.join();
+    }
+
+    scene_build.running = true;
+    scene_build.worker = std::thread([scene]() {
+        ca::profiler_set_thread_name("scene build");
+        {
+            CA_PROFILE_ZONE("scene_update");
+            const unsigned hardware_threads = std::thread::hardware_concurrency();
+            scene_update(*scene, hardware_threads > 1 ? hardware_threads - 1 : 1);
+        }
+        // a scene nobody picked up yet is out of date now
+        destroy_scene(scene_build.finished.exchange(scene));
+        scene_build.running = false;
+    });
+    return true;
+}
+
+// Call between frames. Makes a finished build the current scene and frees
+// the old one, which no frame is using anymore. true if the scene changed.
+bool swap_built_scene(Scene ** current)
+{
+    Scene * scene = scene_build.finished.exchange(NULL);
+    if (!scene) {
+        return false;
+    }
+    destroy_scene(*current);
+    *current = scene;
+    return true;
+}
+
+// Waits for a running build, leaving its result for swap_built_scene().
+void wait_scene_build()
+{
+    if (scene_build.worker.joinable()) {
+        scene_build.worker.join();
+    }
+}
+
+// swap_built_scene() for replays, where the recording says a build has
+// landed: waits for it if it has not yet.
+bool wait_and_swap_built_scene(Scene ** current)
+{
+    if (!scene_build.finished.load()) {
+        wait_scene_build();
+    }
+    return swap_built_scene(current);
+}
+
+// Waits for a running build and drops its result, e.g. before exiting.
+void finish_scene_build()
+{
+    wait_scene_build();
+    destroy_scene(scene_build.finished.exchange(NULL));
+}
+
+// primary rays for the current frame, reused between frames
+ca::RayBufferSoA primary_rays;
+
+// square screen tiles that share one BVH entry point
+const int kTileSize = 8;
+
+const unsigned kNoHit = ~0u;
+
+// Output of the traversal pass, one entry per pixel. Kept to what shading
+// needs to find the surface again so traversal stays in its own working set.
+struct HitBuffer
+{
+    std::vector<float> t;
+    std::vector<float> u;
+    std::vector<float> v;
+    std::vector<unsigned> prim_id;
+    std::vector<unsigned> object_id;    // kNoHit if the ray missed everything
+
+    void resize(size_t n) {
+        t.resize(n);
+        u.resize(n);
+        v.resize(n);
+        prim_id.resize(n);
+        object_id.resize(n);
+    }
+};
+
+HitBuffer hit_buffer;
+
+// pixel indices sorted by the object they hit, misses last
+std::vector<unsigned> shade_order;
+std::vector<unsigned> shade_object_begin;
+
+// Closest hit of a ray against the whole scene.
+struct SceneIntersection
+{
+    float t;
+    float u;
+    float v;
+    unsigned prim_id;       // face of the object
+    unsigned object_id;     // slot of the object
+};
+
+// The beam of one screen tile, and each object's entry nodes for it. Those
+// are only looked for once a ray of the tile reaches the object: in a big
+// scene most objects are nowhere near a given tile.
+struct TileBeam
+{
+    float org[3];
+    float corners[4][3];
+    std::vector<nanort::BVHEntryNodes> entry_nodes;     // per slot
+    std::vector<unsigned char> found;                   // per slot
+
+    void reset(size_t num_slots) {
+        entry_nodes.resize(num_slots);
+        found.assign(num_slots, 0);
+    }
+
+    // The object's BVH is in object space, so the beam goes there too.
+    const nanort::BVHEntryNodes &entry(const Scene &scene, unsigned slot) {
+        if (!found[slot]) {
+            const SceneObject &obj = scene.objects[slot];
+            const ca::Vec3f &position = obj.transform.position;
+            ca::Vec3f object_org = {org[0] - position.x, org[1] - position.y,
+                                    org[2] - position.z};
+            float object_corners[4][3];
+            memcpy(object_corners, corners, sizeof(corners));
+            if (obj.rotated) {
+                object_org = obj.to_object * object_org;
+                for (int c = 0; c < 4; c++) {
+                    const ca::Vec3f d = obj.to_object *
+                        ca::Vec3f{corners[c][0], corners[c][1], corners[c][2]};
+                    object_corners[c][0] = d.x;
+                    object_corners[c][1] = d.y;
+                    object_corners[c][2] = d.z;
+                }
+            }
+            const float object_org_f[3] = {object_org.x, object_org.y, object_org.z};
+            current_lod(obj).bvh.accel->FindBeamEntryNodes(
+                object_org_f, object_corners, &entry_nodes[slot]);
+            found[slot] = 1;
+        }
+        return entry_nodes[slot];
+    }
+};
+
+// nanort intersector for the top level BVH. Its primitives are the scene
+// objects, and intersecting one traces the object's own BVH from the
+// entry nodes of the current tile.
+class SceneIntersector
+{
+  public:
+    SceneIntersector(const Scene &scene, TileBeam * beam)
+        : scene_(scene), beam_(beam) {}
+
+    bool Intersect(float * t_inout, unsigned int prim_index) const {
+        const unsigned slot = scene_.top_slots[prim_index];
+        const nanort::BVHEntryNodes &entry = beam_->entry(scene_, slot);
+        if (entry.count == 0) {
+            return false;
+        }
+        const SceneObject &obj = scene_.objects[slot];
+        const ObjectLod &lod = current_lod(obj);
+
+        // t is the same in object space: the transform keeps lengths
+        nanort::Ray<float> ray;
+        object_space_ray(obj, ray_, &ray);
+        ray.max_t = *t_inout;
+        nanort::BVHTraceOptions trace_options;
+        trace_options.use_ray_inv_dir = true;
+        trace_options.entry_nodes = &entry;
+        nanort::TriangleIntersection<> isect;
+        const bool hit = lod.bvh.packed_intersector
+            ? lod.bvh.accel->TraverseOrdered(
+                ray, *lod.bvh.packed_intersector, &isect, trace_options)
+            : lod.bvh.accel->TraverseOrdered(
+                ray, *lod.bvh.intersector, &isect, trace_options);
+        if (!hit) {
+            return false;
+        }
+        *t_inout = isect.t;
+        u_ = isect.u;
+        v_ = isect.v;
+        face_ = isect.prim_id;
+        return true;
+    }
+
+    float GetT() const { return t_; }
+
+    void Update(float t, unsigned int prim_idx) const {
+        t_ = t;
+        prim_id_ = prim_idx;
+    }
+
+    void PrepareTraversal(const nanort::Ray<float> &ray,
+                          const nanort::BVHTraceOptions &) const {
+        ray_ = ray;
+    }
+
+    void PostTraversal(const nanort::Ray<float> &, bool hit,
+                       SceneIntersection * isect) const {
+        if (hit && isect) {
+            isect->t = t_;
+            isect->u = u_;
+            isect->v = v_;
+            isect->prim_id = face_;
+            isect->object_id = scene_.top_slots[prim_id_];
+        }
+    }
+
+  private:
+    const Scene &scene_;
+    TileBeam * beam_;
+
+    mutable nanort::Ray<float> ray_;
+    mutable float t_;
+    mutable float u_;
+    mutable float v_;
+    mutable unsigned face_;
+    mutable unsigned prim_id_;
+};
+
+void trace_primary_rays(
+    int width,
+    int height,
+    const ca::CameraRayGenerator &camera,
+    const Scene &scene)
+{
+    hit_buffer.resize((size_t)width * height);
+
+    const int tiles_x = (width + kTileSize - 1) / kTileSize;
+    const int tiles_y = (height + kTileSize - 1) / kTileSize;
+
+    const float tFar = 1.0e+30f;
+    // Shoot rays.
+    #ifdef _OPENMP
+    #pragma omp parallel for
+    #endif
+    for (int tile = 0; tile < tiles_x * tiles_y; tile++) {
+        CA_PROFILE_ZONE("trace tile");
+        const int x_begin = (tile % tiles_x) * kTileSize;
+        const int y_begin = (tile / tiles_x) * kTileSize;
+        const int x_end = std::min(x_begin + kTileSize, width);
+        const int y_end = std::min(y_begin + kTileSize, height);
+
+        for (int y = y_begin; y < y_end; y++) {
+            for (int x = x_begin; x < x_end; x++) {
+                const size_t ray_i = (size_t)y * width + x;
+                hit_buffer.t[ray_i] = tFar;
+                hit_buffer.object_id[ray_i] = kNoHit;
+            }
+        }
+        if (!scene.top.IsValid()) {
+            continue;
+        }
+
+        // Every ray of the tile lies inside the beam spanned by its corner
+        // pixels, so the tile can skip the BVH levels the beam never splits.
+        const ca::Vec3f corners[4] = {
+            camera.direction((float)x_begin, (float)y_begin),
+            camera.direction((float)(x_end - 1), (float)y_begin),
+            camera.direction((float)(x_end - 1), (float)(y_end - 1)),
+            camera.direction((float)x_begin, (float)(y_end - 1))
+        };
+        TileBeam beam;
+        beam.org[0] = camera.eye.x;
+        beam.org[1] = camera.eye.y;
+        beam.org[2] = camera.eye.z;
+        for (int c = 0; c < 4; c++) {
+            beam.corners[c][0] = corners[c].x;
+            beam.corners[c][1] = corners[c].y;
+            beam.corners[c][2] = corners[c].z;
+        }
+        beam.reset(scene.objects.size());
+
+        const SceneIntersector intersector(scene, &beam);
+        nanort::BVHTraceOptions trace_options;
+        trace_options.use_ray_inv_dir = true;
+
+        for (int y = y_begin; y < y_end; y++) {
+            for (int x = x_begin; x < x_end; x++) {
+                const size_t ray_i = (size_t)y * width + x;
+                nanort::Ray<float> ray;
+                ray.min_t = 0.0f;
+                ray.max_t = tFar;
+                ray.org[0] = primary_rays.org_x[ray_i];
+                ray.org[1] = primary_rays.org_y[ray_i];
+                ray.org[2] = primary_rays.org_z[ray_i];
+                ray.dir[0] = primary_rays.dir_x[ray_i];
+                ray.dir[1] = primary_rays.dir_y[ray_i];
+                ray.dir[2] = primary_rays.dir_z[ray_i];
+                ray.inv_dir[0] = primary_rays.inv_x[ray_i];
+                ray.inv_dir[1] = primary_rays.inv_y[ray_i];
+                ray.inv_dir[2] = primary_rays.inv_z[ray_i];
+                // sign of the inverse so -0.0 pairs with -inf
+                ray.dir_sign[0] = ray.inv_dir[0] < 0.0f ? 1 : 0;
+                ray.dir_sign[1] = ray.inv_dir[1] < 0.0f ? 1 : 0;
+                ray.dir_sign[2] = ray.inv_dir[2] < 0.0f ? 1 : 0;
+                SceneIntersection isect;
+                if (scene.top.TraverseOrdered(ray, intersector, &isect, trace_options)) {
+                    hit_buffer.t[ray_i] = isect.t;
+                    hit_buffer.u[ray_i] = isect.u;
+                    hit_buffer.v[ray_i] = isect.v;
+                    hit_buffer.prim_id[ray_i] = isect.prim_id;
+                    hit_buffer.object_id[ray_i] = isect.object_id;
+                }
+            }
+        }
+    }
+}
+
+// Counting sort of pixels by object so shading touches one object's
+// normals/faces/verts at a time.
+void group_hits_by_object(size_t num_pixels, size_t num_objects)
+{
+    shade_object_begin.assign(num_objects + 2, 0);
+    for (size_t i = 0; i < num_pixels; i++) {
+        const unsigned o = hit_buffer.object_id[i];
+        shade_object_begin[(o == kNoHit ? num_objects : o) + 1]++;
+    }
+    for (size_t o = 1; o < shade_object_begin.size(); o++) {
+        shade_object_begin[o] += shade_object_begin[o - 1];
+    }
+    shade_order.resize(num_pixels);
+    std::vector<unsigned> cursor(shade_object_begin.begin(),
+                                 shade_object_begin.end() - 1);
+    for (size_t i = 0; i < num_pixels; i++) {
+        const unsigned o = hit_buffer.object_id[i];
+        shade_order[cursor[o == kNoHit ? num_objects : o]++] = (unsigned)i;
+    }
+}
+
+// one AVX-512 vector, two AVX2 or four SSE2 ones
+const int kShadeBatch = 16;
+
+// Surface attributes for one batch of hits, gathered so the lighting math
+// runs over plain arrays.
+struct ShadeBatch
+{
+    float nx[kShadeBatch], ny[kShadeBatch], nz[kShadeBatch];
+    float px[kShadeBatch], py[kShadeBatch], pz[kShadeBatch];
+    float red[kShadeBatch];
+};
+
+// Hits of `obj`, put in world space.
+void gather_shade_batch(
+    const SceneObject &obj,
+    const unsigned * pixel_ids,
+    int n,
+    ShadeBatch * batch)
+{
+    const RenderObject &ro = current_lod(obj).mesh;
+    const ca::Mat3f &rotation = obj.transform.rotation;
+    const ca::Vec3f &position = obj.transform.position;
+    for (int k = 0; k < n; k++) {
+        const unsigned ray_i = pixel_ids[k];
+        const unsigned fid = hit_buffer.prim_id[ray_i];
+        ca::Vec3f v_normal = ro.normals[fid];
+        const ca::Vec3u &v_face = ro.faces[fid];
+        const ca::Vec3f &v_p1 = ro.verts[v_face.x];
+        const ca::Vec3f &v_p2 = ro.verts[v_face.y];
+        const ca::Vec3f &v_p3 = ro.verts[v_face.z];
+        const ca::Vec3f v_u = v_p2 - v_p1;
+        const ca::Vec3f v_v = v_p3 - v_p1;
+        ca::Vec3f v_hit = v_u * hit_buffer.u[ray_i]
+            + v_v * hit_buffer.v[ray_i] + v_p1;
+        if (obj.rotated) {
+            v_normal = rotation * v_normal;
+            v_hit = rotation * v_hit;
+        }
+        v_hit = v_hit + position;
+        batch->nx[k] = v_normal.x;
+        batch->ny[k] = v_normal.y;
+        batch->nz[k] = v_normal.z;
+        batch->px[k] = v_hit.x;
+        batch->py[k] = v_hit.y;
+        batch->pz[k] = v_hit.z;
+    }
+    // pad a short batch with its first entry
+    for (int k = n; k < kShadeBatch; k++) {
+        batch->nx[k] = batch->nx[0];
+        batch->ny[k] = batch->ny[0];
+        batch->nz[k] = batch->nz[0];
+        batch->px[k] = batch->px[0];
+        batch->py[k] = batch->py[0];
+        batch->pz[k] = batch->pz[0];
+    }
+}
+
+// Stable per pixel random number in [0, 1) for light sampling.
+inline float pixel_random(unsigned pixel, unsigned sample)
+{
+    unsigned h = pixel * 0x9E3779B1u ^ (sample + 0x7F4A7C15u);
+    h ^= h >> 16;
+    h *= 0x85EBCA6Bu;
+    h ^= h >> 13;
+    h *= 0xC2B2AE35u;
+    h ^= h >> 16;
+    return (h >> 8) * (1.0f / 16777216.0f);
+}
+
+// global directional light
+const ca::Vec3f kSunDir = {0.0f, 0.0f, -1.0f};
+
+// The sun's share of every lane of the batch, written to batch->red. One
+// version per ca::CpuLevel, all rounding the same way.
+void sun_shade_batch_scalar(ShadeBatch * batch)
+{
+    for (int k = 0; k < kShadeBatch; k++) {
+        const ca::Vec3f v_normal = {batch->nx[k], batch->ny[k], batch->nz[k]};
+        float red_color = 0.0f;
+        {
+            const float f_dot = ca::dot(v_normal, kSunDir);
+            if (f_dot >= 0.0f) {
+                red_color += f_dot * 100 + 5.0f;
+            }
+        }
+        batch->red[k] = red_color;
+    }
+}
+
+#if defined(CA_HAS_SSE2)
+void sun_shade_batch_sse2(ShadeBatch * batch)
+{
+    const __m128 zero = _mm_setzero_ps();
+    const __m128 hundred = _mm_set1_ps(100.0f);
+    for (int k = 0; k < kShadeBatch; k += 4) {
+        const __m128 nx = _mm_loadu_ps(batch->nx + k);
+        const __m128 ny = _mm_loadu_ps(batch->ny + k);
+        const __m128 nz = _mm_loadu_ps(batch->nz + k);
+        const __m128 f_dot = _mm_add_ps(_mm_add_ps(
+            _mm_mul_ps(nx, _mm_set1_ps(kSunDir.x)),
+            _mm_mul_ps(ny, _mm_set1_ps(kSunDir.y))),
+            _mm_mul_ps(nz, _mm_set1_ps(kSunDir.z)));
+        const __m128 lit = _mm_cmpge_ps(f_dot, zero);
+        const __m128 c = _mm_add_ps(_mm_mul_ps(f_dot, hundred), _mm_set1_ps(5.0f));
+        _mm_storeu_ps(batch->red + k, _mm_add_ps(zero, _mm_and_ps(lit, c)));
+    }
+}
+#endif
+
+#if defined(CA_HAS_AVX_KERNELS)
+CA_TARGET_AVX2 void sun_shade_batch_avx2(ShadeBatch * batch)
+{
+    const __m256 zero = _mm256_setzero_ps();
+    const __m256 hundred = _mm256_set1_ps(100.0f);
+    for (int k = 0; k < kShadeBatch; k += 8) {
+        const __m256 nx = _mm256_loadu_ps(batch->nx + k);
+        const __m256 ny = _mm256_loadu_ps(batch->ny + k);
+        const __m256 nz = _mm256_loadu_ps(batch->nz + k);
+        const __m256 f_dot = _mm256_add_ps(_mm256_add_ps(
+            _mm256_mul_ps(nx, _mm256_set1_ps(kSunDir.x)),
+            _mm256_mul_ps(ny, _mm256_set1_ps(kSunDir.y))),
+            _mm256_mul_ps(nz, _mm256_set1_ps(kSunDir.z)));
+        const __m256 lit = _mm256_cmp_ps(f_dot, zero, _CMP_GE_OQ);
+        const __m256 c = _mm256_add_ps(_mm256_mul_ps(f_dot, hundred), _mm256_set1_ps(5.0f));
+        _mm256_storeu_ps(batch->red + k, _mm256_add_ps(zero, _mm256_and_ps(lit, c)));
+    }
+}
+
+CA_TARGET_AVX512 void sun_shade_batch_avx512(ShadeBatch * batch)
+{
+    const __m512 zero = _mm512_setzero_ps();
+    const __m512 nx = _mm512_loadu_ps(batch->nx);
+    const __m512 ny = _mm512_loadu_ps(batch->ny);
+    const __m512 nz = _mm512_loadu_ps(batch->nz);
+    const __m512 f_dot = _mm512_add_ps(_mm512_add_ps(
+        _mm512_mul_ps(nx, _mm512_set1_ps(kSunDir.x)),
+        _mm512_mul_ps(ny, _mm512_set1_ps(kSunDir.y))),
+        _mm512_mul_ps(nz, _mm512_set1_ps(kSunDir.z)));
+    const __mmask16 lit = _mm512_cmp_ps_mask(f_dot, zero, _CMP_GE_OQ);
+    const __m512 c = _mm512_add_ps(
+        _mm512_mul_ps(f_dot, _mm512_set1_ps(100.0f)), _mm512_set1_ps(5.0f));
+    _mm512_storeu_ps(batch->red, _mm512_add_ps(zero, _mm512_maskz_mov_ps(lit, c)));
+}
+#endif
+
+void light_shade_batch(const unsigned * pixel_ids, int n, ShadeBatch * batch)
+{
+    switch (ca::cpu_level()) {
+#if defined(CA_HAS_AVX_KERNELS)
+    case ca::CPU_AVX512:
+        sun_shade_batch_avx512(batch);
+        break;
+    case ca::CPU_AVX2:
+        sun_shade_batch_avx2(batch);
+        break;
+#endif
+#if defined(CA_HAS_SSE2)
+    case ca::CPU_SSE2:
+        sun_shade_batch_sse2(batch);
+        break;
+#endif
+    default:
+        sun_shade_batch_scalar(batch);
+        break;
+    }
+
+    // point/sphere lights, one importance sampled pick per pixel
+    for (int k = 0; k < n; k++) {
+        const ca::Vec3f v_normal = {batch->nx[k], batch->ny[k], batch->nz[k]};
+        const ca::Vec3f v_hit = {batch->px[k], batch->py[k], batch->pz[k]};
+        batch->red[k] += scene_light_tree.estimate(
+            v_hit, v_normal, pixel_random(pixel_ids[k], 0));
+    }
+}
+
+void shade_hits(
+    int width,
+    int height,
+    const Scene &scene,
+    unsigned char * target_pixels)
+{
+    CA_PROFILE_ZONE("shade_hits");
+    const size_t num_pixels = (size_t)width * height;
+    const size_t num_objects = scene.objects.size();
+    group_hits_by_object(num_pixels, num_objects);
+
+    for (size_t o = 0; o < num_objects; o++) {
+        const unsigned begin = shade_object_begin[o];
+        const unsigned end = shade_object_begin[o + 1];
+        if (begin == end) {
+            continue;
+        }
+        for (unsigned i = begin; i < end; i += kShadeBatch) {
+            const int n = (int)std::min<unsigned>(kShadeBatch, end - i);
+            ShadeBatch batch;
+            gather_shade_batch(scene.objects[o], &shade_order[i], n, &batch);
+            light_shade_batch(&shade_order[i], n, &batch);
+            for (int k = 0; k < n; k++) {
+                unsigned char * pixels = &target_pixels[shade_order[i + k] * 4];
+                // pixels[0] = (normal.x * 0.5f + 0.5f) * 240;
+                // pixels[1] = (normal.y * 0.5f + 0.5f) * 240;
+                // pixels[2] = (normal.z * 0.5f + 0.5f) * 240;
+                // several lights can push red past 255; clamp before narrowing
+                pixels[0] = (unsigned char)std::min(batch.red[k], 255.0f);
+                pixels[1] = 0;
+                pixels[2] = 0;
+                pixels[3] = 255;
+            }
+        }
+    }
+
+    // misses
+    for (unsigned i = shade_object_begin[num_objects];
+         i < shade_object_begin[num_objects + 1]; i++) {
+        unsigned char * pixels = &target_pixels[shade_order[i] * 4];
+        pixels[0] = 0;
+        pixels[1] = 0;
+        pixels[2] = 0;
+        pixels[3] = 255;
+    }
+}
+
+// Level of detail. Each frame an object traces its coarsest level whose
+// error, seen from the nearest point of its bounds, stays under
+// kLodMaxErrorPixels. Going coarser also needs the next level to be under
+// kLodHysteresis times that, so an object sitting at a switching distance
+// keeps its level instead of flipping between two.
+bool use_lods = true;
+const float kLodMaxErrorPixels = 0.5f;
+const float kLodHysteresis = 0.5f;
+
+// Picks the traced level of every object for a camera at `eye` whose image
+// is `width` pixels across a view one unit wide at distance one (see
+// CameraRayGenerator).
+void select_lods(Scene &scene, const ca::Vec3f &eye_pos, int width)
+{
+    const float eye_p[3] = {eye_pos.x, eye_pos.y, eye_pos.z};
+    for (size_t i = 0; i < scene.top_slots.size(); i++) {
+        SceneObject &obj = scene.objects[scene.top_slots[i]];
+        if (obj.lods.size() < 2 or !use_lods) {
+            obj.lod = 0;
+            continue;
+        }
+        float lo[3], hi[3];
+        scene_object_bounds(obj, lo, hi);
+        float dist2 = 0.0f;
+        for (int k = 0; k < 3; k++) {
+            const float d = std::max(std::max(lo[k] - eye_p[k], eye_p[k] - hi[k]), 0.0f);
+            dist2 += d * d;
+        }
+        const float pixels_per_unit = (float)width / std::max(sqrtf(dist2), 1e-6f);
+
+        unsigned lod = obj.lod;
+        while (lod > 0 and
+               obj.lods[lod].error * pixels_per_unit > kLodMaxErrorPixels) {
+            lod--;
+        }
+        while (lod + 1 < obj.lods.size() and
+               obj.lods[lod + 1].error * pixels_per_unit < kLodMaxErrorPixels * kLodHysteresis) {
+            lod++;
+        }
+        obj.lod = lod;
+    }
+}
+
+// Where frame time goes, -perf: time per phase of every iteration that drew
+// a frame, and where Linux allows it (perf_event_open; needs hardware
+// counters exposed and kernel.perf_event_paranoid <= 2) cycles,
+// instructions, L1D and LLC misses and branch mispredicts per phase too, so
+// a slow phase shows whether it waits on memory or mispredicts. Without the
+// counters only the times are reported.
+enum FramePhase
+{
+    FRAME_PHASE_EVENTS = 0,         // input and scene edits
+    FRAME_PHASE_RAY_GENERATION,
+    FRAME_PHASE_TRAVERSAL,          // LOD selection and tracing
+    FRAME_PHASE_SHADING,
+    FRAME_PHASE_PRESENT,            // capture, blit and window update
+    FRAME_PHASE_COUNT
+};
+
+const char * frame_phase_names[FRAME_PHASE_COUNT] = {
+    "events", "raygen", "traversal", "shading", "present"
+};
+
+struct FramePhaseCost
+{
+    Uint64 ticks;                   // SDL performance counter
+    ca::PerfSample counts;
+};
+
+struct FramePerf
+{
+    bool enabled;
+    bool in_frame;
+    ca::PerfCounters counters;
+    Uint64 last_ticks;
+    ca::PerfSample last_counts;
+    FramePhaseCost pending[FRAME_PHASE_COUNT];  // this iteration, until it draws
+    FramePhaseCost totals[FRAME_PHASE_COUNT];
+    unsigned long long frames;
+};
+
+FramePerf frame_perf;
+
+void frame_perf_start()
+{
+    frame_perf.enabled = true;
+    if (!frame_perf.counters.open()) {
+        debug_print("perf: no hardware counters (%s), timing phases only\n", strerror(errno));
+    }
+}
+
+// Call at the start of a main loop iteration.
+void frame_perf_begin()
+{
+    if (!frame_perf.enabled) {
+        return;
+    }
+    memset(frame_perf.pending, 0, sizeof(frame_perf.pending));
+    frame_perf.in_frame = true;
+    frame_perf.last_ticks = SDL_GetPerformanceCounter();
+    frame_perf.counters.read(&frame_perf.last_counts);
+}
+
+// Charges everything since the last mark (or frame_perf_begin) to `phase`.
+void frame_perf_mark(FramePhase phase)
+{
+    if (!frame_perf.in_frame) {
+        return;
+    }
+    ca::PerfSample now;
+    frame_perf.counters.read(&now);
+    const Uint64 now_ticks = SDL_GetPerformanceCounter();
+    FramePhaseCost &cost = frame_perf.pending[phase];
+    cost.ticks += now_ticks - frame_perf.last_ticks;
+    for (int c = 0; c < ca::PERF_COUNTER_COUNT; c++) {
+        cost.counts.value[c] += now.value[c] - frame_perf.last_counts.value[c];
+    }
+    frame_perf.last_ticks = now_ticks;
+    frame_perf.last_counts = now;
+}
+
+// Call at the end of the iteration; only ones that drew a frame count.
+void frame_perf_end(bool drew)
+{
+    if (!frame_perf.in_frame) {
+        return;
+    }
+    frame_perf.in_frame = false;
+    if (!drew) {
+        return;
+    }
+    for (int p = 0; p < FRAME_PHASE_COUNT; p++) {
+        frame_perf.totals[p].ticks += frame_perf.pending[p].ticks;
+        for (int c = 0; c < ca::PERF_COUNTER_COUNT; c++) {
+            frame_perf.totals[p].counts.value[c] += frame_perf.pending[p].counts.value[c];
+        }
+    }
+    frame_perf.frames++;
+}
+
+void frame_perf_report()
+{
+    if (!frame_perf.enabled or frame_perf.frames == 0) {
+        return;
+    }
+    const double frames = (double)frame_perf.frames;
+    const double ms_per_tick = 1000.0 / (double)SDL_GetPerformanceFrequency();
+    Uint64 total_ticks = 0;
+    for (int p = 0; p < FRAME_PHASE_COUNT; p++) {
+        total_ticks += frame_perf.totals[p].ticks;
+    }
+    const ca::PerfCounters &counters = frame_perf.counters;
+    debug_print("Frame phases over %llu frames%s\n", frame_perf.frames,
+        counters.is_open() ? "" : " (no hardware counters)");
+    debug_print("  %-10s %9s %6s", "phase", "ms/frame", "share");
+    if (counters.is_open()) {
+        debug_print(" %13s %5s %9s %9s %9s", "kcycles/frame", "IPC",
+            "L1D MPKI", "LLC MPKI", "br MPKI");
+    }
+    debug_print("\n");
+    for (int p = 0; p < FRAME_PHASE_COUNT; p++) {
+        const FramePhaseCost &cost = frame_perf.totals[p];
+        debug_print("  %-10s %9.3f %5.1f%%", frame_phase_names[p],
+            (double)cost.ticks * ms_per_tick / frames,
+            total_ticks ? 100.0 * (double)cost.ticks / (double)total_ticks : 0.0);
+        if (counters.is_open()) {
+            const double cycles = (double)cost.counts.value[ca::PERF_CYCLES];
+            const double instructions = (double)cost.counts.value[ca::PERF_INSTRUCTIONS];
+            debug_print(" %13.1f", cycles / frames / 1000.0);
+            if (counters.has(ca::PERF_INSTRUCTIONS) and cycles > 0.0) {
+                debug_print(" %5.2f", instructions / cycles);
+            } else {
+                debug_print(" %5s", "-");
+            }
+            // misses per thousand instructions
+            const ca::PerfCounter misses[3] = {
+                ca::PERF_L1D_MISSES, ca::PERF_LLC_MISSES, ca::PERF_BRANCH_MISSES
+            };
+            for (int m = 0; m < 3; m++) {
+                if (counters.has(misses[m]) and instructions > 0.0) {
+                    debug_print(" %9.2f", 1000.0 * (double)cost.counts.value[misses[m]] / instructions);
+                } else {
+                    debug_print(" %9s", "-");
+                }
+            }
+        }
+        debug_print("\n");
+    }
+}
+
+void render_scene(
+    int width,
+    int height,
+    Scene &scene,
+    SDL_Surface * target)
+{
+    CA_PROFILE_ZONE("render_scene");
+    // Simple camera. change eye pos and direction fit to .obj model.
+    ca::CameraRayGenerator camera;
+    {
+        CA_PROFILE_ZONE("ray generation");
+        camera.setup(look_matrix, eye, width, height);
+        primary_rays.resize(width, height);
+        camera.generate(&primary_rays);
+    }
+    frame_perf_mark(FRAME_PHASE_RAY_GENERATION);
+
+    select_lods(scene, eye, width);
+
+    {
+        CA_PROFILE_ZONE("trace_primary_rays");
+        trace_primary_rays(width, height, camera, scene);
+    }
+    frame_perf_mark(FRAME_PHASE_TRAVERSAL);
+
+    SDL_LockSurface(target);
+    shade_hits(width, height, scene, (unsigned char *)target->pixels);
+    SDL_UnlockSurface(target);
+    frame_perf_mark(FRAME_PHASE_SHADING);
+}
+
+int window_scale = 2;
+int width = 64, height = 64;
+
+// SDL helper stuff
+struct SDLWindowSurfacePair
+{
+    SDL_Window * mainWindow;
+    SDL_Surface * screenSurface;
+};
+
+SDLWindowSurfacePair
+SDL_init_window()
+{
+    SDL_Window * mainWindow;
+    SDL_Surface * screenSurface;
+    // Initialize SDL window
+    {
+
+        //Initialization flag
+        bool success = true;
+
+        //Initialize SDL
+        if( SDL_Init( SDL_INIT_VIDEO ) < 0 )
+        {
+            printf( "SDL could not initialize! SDL Error: %s\n",
+                SDL_GetError());
+            success = false;
+        }
+        else
+        {
+            //Create window
+            mainWindow = SDL_CreateWindow(
+                "SDL Tutorial",
+                SDL_WINDOWPOS_UNDEFINED,
+                SDL_WINDOWPOS_UNDEFINED,
+                window_scale * width,
+                window_scale * height,
+                SDL_WINDOW_SHOWN);
+            if( mainWindow == NULL )
+            {
+                printf("Window could not be created! SDL Error: %s\n",
+                    SDL_GetError());
+                success = false;
+            }
+            else
+            {
+                //Get window surface
+                screenSurface = SDL_GetWindowSurface( mainWindow );
+            }
+        }
+
+    }
+    return {mainWindow, screenSurface};
+}
+
+SDL_Surface *
+SDL_rendered_surface_init()
+{
+    //Main loop flag
+    bool quit = false;
+    // create the render target
+    int rmask;
+    int gmask;
+    int bmask;
+    int amask;
+
+#if SDL_BYTEORDER == SDL_BIG_ENDIAN
+    rmask = 0xff000000;
+    gmask = 0x00ff0000;
+    bmask = 0x0000ff00;
+    amask = 0x000000ff;
+#else
+    rmask = 0x000000ff;
+    gmask = 0x0000ff00;
+    bmask = 0x00ff0000;
+    amask = 0xff000000;
+#endif
+
+
+    return SDL_CreateRGBSurface(0, /* flags */
+            width, height,
+            32, /* bitdepth */
+            rmask, gmask, bmask, amask);
+}
+
+// Scales the rendered frame up onto the window surface. Uses ca::upscale
+// when both are 32-bit with red and blue in the same or swapped places and
+// the window is a whole multiple of the frame, SDL_BlitScaled otherwise.
+// 0 on success like SDL_BlitScaled.
+int present_frame(SDL_Surface * src, SDL_Surface * dst)
+{
+    const SDL_PixelFormat * sf = src->format;
+    const SDL_PixelFormat * df = dst->format;
+    const int scale = dst->w / src->w;
+    const bool whole = scale >= 1 and dst->w == src->w * scale and dst->h == src->h * scale;
+    const bool rgb32 = sf->BytesPerPixel == 4 and df->BytesPerPixel == 4
+        and sf->Gmask == df->Gmask and (df->Amask == 0 or df->Amask == sf->Amask);
+    const bool same = sf->Rmask == df->Rmask and sf->Bmask == df->Bmask;
+    const bool swapped = sf->Rmask == df->Bmask and sf->Bmask == df->Rmask
+        and ((sf->Rmask == 0xff and sf->Bmask == 0xff0000)
+             or (sf->Rmask == 0xff0000 and sf->Bmask == 0xff));
+    if (!whole or !rgb32 or !(same or swapped)) {
+        return SDL_BlitScaled(src, NULL, dst, NULL);
+    }
+    if (SDL_LockSurface(src) != 0) {
+        return -1;
+    }
+    if (SDL_LockSurface(dst) != 0) {
+        SDL_UnlockSurface(src);
+        return -1;
+    }
+    ca::upscale_pixels(src->pixels, src->pitch, src->w, src->h,
+        dst->pixels, dst->pitch, scale, !same);
+    SDL_UnlockSurface(dst);
+    SDL_UnlockSurface(src);
+    return 0;
+}
+
+void drawInvertedCube(
+    RenderObject &cube,
+    const ca::Vec3f& pos,
+    const ca::Mat3f& rot_mat,
+    const float scale = 10.0f)
+{
+    const float extent = scale * 0.5f;
+    const ca::Vec3f cube_verts [8] = {
+        {-extent + pos.x, -extent + pos.y, -extent + pos.z},
+        {-extent + pos.x, -extent + pos.y,  extent + pos.z},
+        {-extent + pos.x,  extent + pos.y, -extent + pos.z},
+        {-extent + pos.x,  extent + pos.y,  extent + pos.z},
+        { extent + pos.x, -extent + pos.y, -extent + pos.z},
+        { extent + pos.x, -extent + pos.y,  extent + pos.z},
+        { extent + pos.x,  extent + pos.y, -extent + pos.z},
+        { extent + pos.x,  extent + pos.y,  extent + pos.z}
+    };
+    ca::Vec3f cube_normals [12];
+    const unsigned length_v = (unsigned)(cube.verts.size());
+    const ca::Vec3u cube_faces [12] = {
+        {length_v + 1, length_v + 7, length_v + 5},
+        {length_v + 7, length_v + 1, length_v + 3},
+        {length_v + 5, length_v + 6, length_v + 4},
+        {length_v + 6, length_v + 5, length_v + 7},
+        {length_v + 3, length_v + 6, length_v + 7},
+        {length_v + 6, length_v + 3, length_v + 2},
+        {length_v + 4, length_v + 1, length_v + 5},
+        {length_v + 1, length_v + 4, length_v + 0},
+        {length_v + 0, length_v + 3, length_v + 1},
+        {length_v + 3, length_v + 0, length_v + 2},
+        {length_v + 6, length_v + 0, length_v + 4},
+        {length_v + 0, length_v + 6, length_v + 2}
+    };
+
+    for (size_t i = 0; i < 12; i++) {
+        const ca::Vec3f& p1 = cube_verts[cube_faces[i].x - length_v];
+        const ca::Vec3f& p2 = cube_verts[cube_faces[i].y - length_v];
+        const ca::Vec3f& p3 = cube_verts[cube_faces[i].z - length_v];
+        ca::Vec3f u = p2 - p1;
+        ca::Vec3f v = p3 - p1;
+
+        ca::Vec3f normal = {
+            u.y * v.z - u.z * v.y,
+            u.z * v.x - u.x * v.z,
+            u.x * v.y - u.y * v.x
+        };
+        normal = rot_mat * normal;
+        ca::normalize_modify(normal);
+        cube_normals[i] = normal;
+    }
+    size_t cube_verts_i = cube.verts.size();
+    cube.verts.insert(cube.verts.end(), cube_verts, cube_verts + 8 );
+    cube.faces.insert(cube.faces.end(), cube_faces, cube_faces + 12);
+    cube.normals.insert(cube.normals.end(), cube_normals, cube_normals + 12);
+
+    // rotate the vertices
+    while (cube_verts_i < cube.verts.size()) {
+        cube.verts[cube_verts_i] = (rot_mat * cube.verts[cube_verts_i]);
+        cube_verts_i++;
+    }
+}
+
+void drawCube(
+    RenderObject &cube,
+    const ca::Vec3f& pos,
+    const ca::Mat3f& rot_mat,
+    const float scale = 1.0f)
+{
+    const float extent = scale * 0.5f;
+    const ca::Vec3f cube_verts [8] = {
+        {-extent + pos.x, -extent + pos.y, -extent + pos.z},
+        {-extent + pos.x, -extent + pos.y,  extent + pos.z},
+        {-extent + pos.x,  extent + pos.y, -extent + pos.z},
+        {-extent + pos.x,  extent + pos.y,  extent + pos.z},
+        { extent + pos.x, -extent + pos.y, -extent + pos.z},
+        { extent + pos.x, -extent + pos.y,  extent + pos.z},
+        { extent + pos.x,  extent + pos.y, -extent + pos.z},
+        { extent + pos.x,  extent + pos.y,  extent + pos.z}
+    };
+    ca::Vec3f cube_normals [12];
+    const unsigned length_v = (unsigned)(cube.verts.size());
+    const ca::Vec3u cube_faces [12] = {
         {length_v + 5, length_v + 7, length_v + 1},
         {length_v + 3, length_v + 1, length_v + 7},
         {length_v + 4, length_v + 6, length_v + 5},
@@ -374,32 +2183,1591 @@ void drawCube(
         {length_v + 2, length_v + 6, length_v + 0}
     };
 
-    for (size_t i = 0; i < 12; i++) {
-        const ca::Vec3f& p1 = cube_verts[cube_faces[i].x - length_v];
-        const ca::Vec3f& p2 = cube_verts[cube_faces[i].y - length_v];
-        const ca::Vec3f& p3 = cube_verts[cube_faces[i].z - length_v];
-        ca::Vec3f u = p2 - p1;
-        ca::Vec3f v = p3 - p1;
+    for (size_t i = 0; i < 12; i++) {
+        const ca::Vec3f& p1 = cube_verts[cube_faces[i].x - length_v];
+        const ca::Vec3f& p2 = cube_verts[cube_faces[i].y - length_v];
+        const ca::Vec3f& p3 = cube_verts[cube_faces[i].z - length_v];
+        ca::Vec3f u = p2 - p1;
+        ca::Vec3f v = p3 - p1;
+
+        ca::Vec3f normal = {
+            u.y * v.z - u.z * v.y,
+            u.z * v.x - u.x * v.z,
+            u.x * v.y - u.y * v.x
+        };
+        normal = rot_mat * normal;
+        ca::normalize_modify(normal);
+        cube_normals[i] = normal;
+    }
+    size_t cube_verts_i = cube.verts.size();
+    cube.verts.insert(cube.verts.end(), cube_verts, cube_verts + 8 );
+    cube.faces.insert(cube.faces.end(), cube_faces, cube_faces + 12);
+    cube.normals.insert(cube.normals.end(), cube_normals, cube_normals + 12);
+
+    // rotate the vertices
+    while (cube_verts_i < cube.verts.size()) {
+        cube.verts[cube_verts_i] = (rot_mat * cube.verts[cube_verts_i]);
+        cube_verts_i++;
+    }
+}
+
+// Synthetic scenes for scaling runs. Objects land at random in a box in
+// front of the camera, sized so they fill about the same share of it
+// whatever their number. Same seed, same scene, on every platform.
+enum SceneKind
+{
+    SCENE_KIND_CUBES = 0,
+    SCENE_KIND_BUNNIES,
+    SCENE_KIND_SOUP,        // unconnected random triangles
+    SCENE_KIND_COUNT
+};
+
+const char * scene_kind_names[SCENE_KIND_COUNT] = {"cubes", "bunnies", "soup"};
+
+const ca::Vec3f kGeneratedSceneMin = {-3.0f, -3.0f, 0.5f};
+const ca::Vec3f kGeneratedSceneMax = { 3.0f,  3.0f, 6.5f};
+const unsigned kGeneratedSceneSeed = 2019;
+
+// Small fixed generator so scenes don't depend on the standard library's
+// distributions.
+struct SceneRandom
+{
+    uint32_t state;
+
+    explicit SceneRandom(uint32_t seed) : state(seed * 2654435761u + 1u) {}
+
+    // [0, 1)
+    float next() {
+        state ^= state << 13;
+        state ^= state >> 17;
+        state ^= state << 5;
+        return (state >> 8) * (1.0f / 16777216.0f);
+    }
+
+    float range(float lo, float hi) { return lo + (hi - lo) * next(); }
+
+    ca::Vec3f in_box(const ca::Vec3f &lo, const ca::Vec3f &hi) {
+        const float x = range(lo.x, hi.x);
+        const float y = range(lo.y, hi.y);
+        return {x, y, range(lo.z, hi.z)};
+    }
+
+    ca::Mat3f rotation() {
+        ca::Vec3f axis = in_box(ca::Vec3f{-1.0f, -1.0f, -1.0f}, ca::Vec3f{1.0f, 1.0f, 1.0f});
+        if (ca::length(axis) < 1e-3f) {
+            axis = {0.0f, 1.0f, 0.0f};
+        }
+        ca::normalize_modify(axis);
+        return ca::RotationMat3f(ca::axis_angle_quat(axis, range(0.0f, 6.2831853f)));
+    }
+};
+
+// dst += src scaled, rotated and moved to `pos`
+void append_transformed(
+    RenderObject &dst,
+    const RenderObject &src,
+    const ca::Mat3f &rotation,
+    float scale,
+    const ca::Vec3f &pos)
+{
+    const unsigned base = (unsigned)dst.verts.size();
+    for (size_t i = 0; i < src.verts.size(); i++) {
+        dst.verts.push_back(rotation * (src.verts[i] * scale) + pos);
+    }
+    for (size_t i = 0; i < src.faces.size(); i++) {
+        const ca::Vec3u &f = src.faces[i];
+        dst.faces.push_back(ca::Vec3u{f.x + base, f.y + base, f.z + base});
+        dst.normals.push_back(rotation * src.normals[i]);
+    }
+}
+
+// One mesh of about `triangles` triangles of the given kind (at least one
+// cube or bunny).
+RenderObject generate_scene(SceneKind kind, size_t triangles, unsigned seed)
+{
+    RenderObject out;
+    SceneRandom random(seed);
+
+    RenderObject prototype;
+    float prototype_size = 1.0f;
+    size_t per_item = 1;
+    if (kind == SCENE_KIND_CUBES) {
+        drawCube(prototype, ca::Vec3f{0.0f, 0.0f, 0.0f}, ca::Mat3f::Identity());
+        per_item = prototype.faces.size();
+    } else if (kind == SCENE_KIND_BUNNIES) {
+        if (bunny.empty()) {
+            return out;
+        }
+        prototype = bunny[0].mesh;
+        float lo[3] = {1e30f, 1e30f, 1e30f}, hi[3] = {-1e30f, -1e30f, -1e30f};
+        for (size_t i = 0; i < prototype.verts.size(); i++) {
+            const float * p = &prototype.verts[i].x;
+            for (int k = 0; k < 3; k++) {
+                lo[k] = std::min(lo[k], p[k]);
+                hi[k] = std::max(hi[k], p[k]);
+            }
+        }
+        // centered, so it turns about itself
+        const ca::Vec3f center = {0.5f * (lo[0] + hi[0]), 0.5f * (lo[1] + hi[1]),
+                                  0.5f * (lo[2] + hi[2])};
+        for (size_t i = 0; i < prototype.verts.size(); i++) {
+            prototype.verts[i] -= center;
+        }
+        prototype_size = std::max(hi[0] - lo[0], std::max(hi[1] - lo[1], hi[2] - lo[2]));
+        per_item = prototype.faces.size();
+    }
+
+    const size_t count = std::max<size_t>(1, triangles / per_item);
+    const ca::Vec3f extent = kGeneratedSceneMax - kGeneratedSceneMin;
+    // edge of the cube each item gets to itself, items take about half of it
+    const float cell = cbrtf(extent.x * extent.y * extent.z / (float)count);
+    const float item_size = 0.5f * cell;
+
+    out.verts.reserve(kind == SCENE_KIND_SOUP ? 3 * count : count * prototype.verts.size());
+    out.faces.reserve(count * per_item);
+    out.normals.reserve(count * per_item);
+    for (size_t i = 0; i < count; i++) {
+        const ca::Vec3f pos = random.in_box(kGeneratedSceneMin, kGeneratedSceneMax);
+        if (kind == SCENE_KIND_SOUP) {
+            const unsigned base = (unsigned)out.verts.size();
+            for (int k = 0; k < 3; k++) {
+                const float r = 0.5f * item_size;
+                out.verts.push_back(pos + random.in_box(ca::Vec3f{-r, -r, -r}, ca::Vec3f{r, r, r}));
+            }
+            out.faces.push_back(ca::Vec3u{base, base + 1, base + 2});
+        } else {
+            append_transformed(out, prototype, random.rotation(),
+                               item_size / prototype_size, pos);
+        }
+    }
+    if (kind == SCENE_KIND_SOUP) {
+        compute_face_normals(out);
+    }
+    return out;
+}
+
+// Memory accounting. Bytes per subsystem count what each vector has
+// allocated, not just what it holds; the part past the sizes is also
+// summed up as unused.
+enum MemorySubsystem {
+    MEMORY_GEOMETRY = 0,        // object space meshes the BVHs are built over
+    MEMORY_BVH_NODES,
+    MEMORY_BVH_INDICES,
+    MEMORY_BVH_PARENTS,
+    MEMORY_TOP_LEVEL,           // top level BVH
+    MEMORY_SCENE_TABLES,        // object slots, free lists, top level slots
+    MEMORY_SUBSYSTEM_COUNT
+};
+
+const char * memory_subsystem_names[MEMORY_SUBSYSTEM_COUNT] = {
+    "geometry",
+    "BVH nodes",
+    "BVH indices",
+    "BVH parents",
+    "top level BVH",
+    "scene tables"
+};
+
+struct MemoryReport
+{
+    size_t bytes[MEMORY_SUBSYSTEM_COUNT];
+    size_t unused_bytes;        // part of `bytes`
+    size_t triangles;           // finest level of each object
+    size_t peak_build_bytes;    // of the biggest single BVH build
+
+    MemoryReport() : unused_bytes(0), triangles(0), peak_build_bytes(0) {
+        for (int i = 0; i < MEMORY_SUBSYSTEM_COUNT; i++) {
+            bytes[i] = 0;
+        }
+    }
+
+    size_t total() const {
+        size_t sum = 0;
+        for (int i = 0; i < MEMORY_SUBSYSTEM_COUNT; i++) {
+            sum += bytes[i];
+        }
+        return sum;
+    }
+};
+
+template <typename V>
+void memory_count_vector(const std::vector<V> &v, MemorySubsystem subsystem,
+                         MemoryReport &report)
+{
+    report.bytes[subsystem] += v.capacity() * sizeof(V);
+    report.unused_bytes += (v.capacity() - v.size()) * sizeof(V);
+}
+
+void memory_count_render_object(const RenderObject &ro, MemorySubsystem subsystem,
+                                MemoryReport &report)
+{
+    memory_count_vector(ro.verts, subsystem, report);
+    memory_count_vector(ro.normals, subsystem, report);
+    memory_count_vector(ro.faces, subsystem, report);
+    memory_count_vector(ro.face_ids, subsystem, report);
+    memory_count_vector(ro.packed_verts, subsystem, report);
+}
+
+void memory_count_object(const SceneObject &obj, MemoryReport &report)
+{
+    if (!obj.lods.empty()) {
+        report.triangles += obj.lods[0].mesh.faces.size();
+    }
+    for (size_t l = 0; l < obj.lods.size(); l++) {
+        const ObjectLod &lod = obj.lods[l];
+        memory_count_render_object(lod.mesh, MEMORY_GEOMETRY, report);
+        if (!lod.bvh.accel) {
+            continue;
+        }
+        const nanort::BVHBuildStatistics stats = lod.bvh.accel->GetStatistics();
+        report.bytes[MEMORY_BVH_NODES] += stats.node_bytes;
+        report.bytes[MEMORY_BVH_INDICES] += stats.index_bytes;
+        report.bytes[MEMORY_BVH_PARENTS] += stats.parent_bytes;
+        report.unused_bytes += stats.unused_bytes;
+        report.peak_build_bytes = std::max(report.peak_build_bytes, stats.peak_build_bytes);
+    }
+}
+
+// Bytes held by an object: its geometry and BVHs.
+size_t scene_object_bytes(const SceneObject &obj)
+{
+    MemoryReport report;
+    memory_count_object(obj, report);
+    return report.total();
+}
+
+MemoryReport scene_memory_report(const Scene &scene)
+{
+    MemoryReport report;
+    for (size_t i = 0; i < scene.objects.size(); i++) {
+        memory_count_object(scene.objects[i], report);
+    }
+    const nanort::BVHBuildStatistics top = scene.top.GetStatistics();
+    report.bytes[MEMORY_TOP_LEVEL] += top.node_bytes + top.index_bytes + top.parent_bytes;
+    report.unused_bytes += top.unused_bytes;
+    report.peak_build_bytes = std::max(report.peak_build_bytes, top.peak_build_bytes);
+    memory_count_vector(scene.objects, MEMORY_SCENE_TABLES, report);
+    memory_count_vector(scene.free_slots, MEMORY_SCENE_TABLES, report);
+    memory_count_vector(scene.dead_slots, MEMORY_SCENE_TABLES, report);
+    memory_count_vector(scene.top_slots, MEMORY_SCENE_TABLES, report);
+    return report;
+}
+
+void print_memory_report(const MemoryReport &report)
+{
+    const double kb = 1.0 / 1024.0;
+    debug_print("Memory: %.1f KB for %zu triangles, %.1f bytes per triangle\n",
+        report.total() * kb, report.triangles,
+        report.triangles ? (double)report.total() / report.triangles : 0.0);
+    for (int i = 0; i < MEMORY_SUBSYSTEM_COUNT; i++) {
+        debug_print("  %-18s %10.1f KB\n", memory_subsystem_names[i], report.bytes[i] * kb);
+    }
+    debug_print("  %-18s %10.1f KB\n", "unused capacity", report.unused_bytes * kb);
+    debug_print("  %-18s %10.1f KB\n", "peak single build", report.peak_build_bytes * kb);
+}
+
+// Headless benchmark, run with -bench: the same camera sweep over a dense
+// field of cubes rendered once per BVH node layout, then over a crowd of
+// bunnies with and without levels of detail.
+const int kBenchFieldSize = 32;     // cubes per side
+const float kBenchSpacing = 0.3f;
+const int kBenchFrames = 120;
+const int kBenchCrowdSize = 14;     // bunnies per row, and rows
+const float kBenchCrowdSpacing = 1.5f;
+
+// Frame times of a pan from `pan` rad left to `pan` rad right of where the
+// game's camera starts.
+ca::LogHistogram bench_pan(Scene &scene, SDL_Surface * surface, float pan)
+{
+    const double ms_per_tick = 1000.0 / (double)SDL_GetPerformanceFrequency();
+    reset_camera();
+    update_look_matrix(0.0f, pan);
+
+    ca::LogHistogram frame_times;
+    for (int f = 0; f < kBenchFrames; f++) {
+        update_look_matrix(0.0f, -2.0f * pan / kBenchFrames);
+        const Uint64 frame_start = SDL_GetPerformanceCounter();
+        render_scene(width, height, scene, surface);
+        frame_times.add(
+            (double)(SDL_GetPerformanceCounter() - frame_start) * ms_per_tick * 1000.0);
+    }
+    return frame_times;
+}
+
+// Bunnies in rows stretching away from the camera, most of them a few
+// pixels big.
+void add_bunny_crowd(Scene &scene)
+{
+    const float offset = -0.5f * kBenchCrowdSpacing * (kBenchCrowdSize - 1);
+    for (int z = 0; z < kBenchCrowdSize; z++) {
+        for (int x = 0; x < kBenchCrowdSize; x++) {
+            ObjectTransform transform = identity_transform();
+            transform.position = {offset + x * kBenchCrowdSpacing, -0.1f,
+                                  z * kBenchCrowdSpacing};
+            scene_add_lod_object(scene, bunny, transform);
+        }
+    }
+}
+
+// Renders the pan over the crowd with every bunny at full detail and with
+// levels of detail, and counts the pixels of the last frame that differ.
+void bench_bunny_crowd(SDL_Surface * surface)
+{
+    if (bunny.empty()) {
+        debug_print("  no bunny.obj, skipping the crowd\n");
+        return;
+    }
+
+    Scene scene;
+    add_bunny_crowd(scene);
+    scene_update(scene);
+
+    const size_t num_pixels = (size_t)width * height;
+    std::vector<unsigned char> full_detail(num_pixels * 4);
+    const bool old_use_lods = use_lods;
+    for (int pass = 0; pass < 2; pass++) {
+        use_lods = pass == 1;
+        const ca::LogHistogram frame_times = bench_pan(scene, surface, 0.3f);
+
+        size_t triangles = 0;
+        for (size_t i = 0; i < scene.objects.size(); i++) {
+            triangles += current_lod(scene.objects[i]).mesh.faces.size();
+        }
+        const unsigned char * pixels = (const unsigned char *)surface->pixels;
+        size_t differing = 0;
+        int max_delta = 0;
+        if (pass == 0) {
+            std::copy(pixels, pixels + num_pixels * 4, full_detail.begin());
+        } else {
+            for (size_t i = 0; i < num_pixels * 4; i += 4) {
+                int delta = 0;
+                for (int c = 0; c < 3; c++) {
+                    delta = std::max(delta, abs((int)pixels[i + c] - (int)full_detail[i + c]));
+                }
+                if (delta > 0) {
+                    differing++;
+                }
+                max_delta = std::max(max_delta, delta);
+            }
+        }
+        debug_print("  %zu bunnies, lods %-3s %7zu triangles  frame mean=%.3fms p50=%.3fms max=%.3fms",
+            scene.objects.size(), use_lods ? "on" : "off", triangles,
+            frame_times.mean() / 1000.0, frame_times.percentile(0.5) / 1000.0,
+            frame_times.max_us / 1000.0);
+        if (pass == 1) {
+            debug_print("  %zu of %zu pixels differ, by up to %d",
+                differing, num_pixels, max_delta);
+        }
+        debug_print("\n");
+    }
+    use_lods = old_use_lods;
+
+    for (size_t i = 0; i < scene.objects.size(); i++) {
+        free_scene_object(scene.objects[i]);
+    }
+}
+
+int run_benchmark()
+{
+    RenderObject field;
+    const float offset = -0.5f * kBenchSpacing * (kBenchFieldSize - 1);
+    for (int z = 0; z < kBenchFieldSize; z++) {
+        for (int y = 0; y < kBenchFieldSize; y++) {
+            for (int x = 0; x < kBenchFieldSize; x++) {
+                const ca::Vec3f pos = {
+                    offset + x * kBenchSpacing,
+                    offset + y * kBenchSpacing,
+                    8.0f + offset + z * kBenchSpacing
+                };
+                drawCube(field, pos, ca::Mat3f::Identity(), 0.5f * kBenchSpacing);
+            }
+        }
+    }
+
+    const double ms_per_tick = 1000.0 / (double)SDL_GetPerformanceFrequency();
+    Scene scene;
+    const ObjectHandle field_handle =
+        scene_add_object(scene, field, identity_transform());
+    const Uint64 build_start = SDL_GetPerformanceCounter();
+    scene_update(scene);
+    nanort::BVHAccel<float> * field_accel = scene.objects[field_handle.slot].lods[0].bvh.accel;
+    debug_print("Benchmark: %zu triangles, %zu nodes, build %.1f ms\n",
+        field.faces.size(), field_accel->GetNodes().size(),
+        (double)(SDL_GetPerformanceCounter() - build_start) * ms_per_tick);
+
+    // an edit should cost what it touches, not the whole scene
+    {
+        RenderObject cube;
+        drawCube(cube, ca::Vec3f{0.0f, 0.0f, 0.0f}, ca::Mat3f::Identity(), 0.5f);
+        ObjectTransform transform = identity_transform();
+        transform.position = {0.0f, 0.0f, 2.0f};
+
+        Uint64 start = SDL_GetPerformanceCounter();
+        const ObjectHandle cube_handle = scene_add_object(scene, cube, transform);
+        scene_update(scene);
+        const double add_ms = (double)(SDL_GetPerformanceCounter() - start) * ms_per_tick;
+
+        const int kMoves = 100;
+        start = SDL_GetPerformanceCounter();
+        for (int i = 0; i < kMoves; i++) {
+            transform.position.x = 0.01f * i;
+            transform.rotation = ca::RotationMat3f(
+                ca::axis_angle_quat({0.0f, 1.0f, 0.0f}, 0.05f * i));
+            scene_set_transform(scene, cube_handle, transform);
+            scene_update(scene);
+        }
+        const double move_ms =
+            (double)(SDL_GetPerformanceCounter() - start) * ms_per_tick / kMoves;
+
+        start = SDL_GetPerformanceCounter();
+        scene_remove_object(scene, cube_handle);
+        scene_update(scene);
+        const double remove_ms = (double)(SDL_GetPerformanceCounter() - start) * ms_per_tick;
+        debug_print("  edits: add cube %.3fms  move cube %.3fms  remove cube %.3fms\n",
+            add_ms, move_ms, remove_ms);
+    }
+
+    SDL_Surface * surface = SDL_rendered_surface_init();
+
+    static const struct {
+        nanort::BVHLayout layout;
+        const char * name;
+    } layouts[] = {
+        {nanort::BVH_LAYOUT_BUILD_ORDER, "build order"},
+        {nanort::BVH_LAYOUT_DEPTH_FIRST, "depth first"},
+        {nanort::BVH_LAYOUT_BREADTH_FIRST_TOP, "bfs top"},
+        {nanort::BVH_LAYOUT_TREELET, "treelet"}
+    };
+
+    for (size_t l = 0; l < sizeof(layouts) / sizeof(layouts[0]); l++) {
+        const Uint64 relayout_start = SDL_GetPerformanceCounter();
+        field_accel->Relayout(layouts[l].layout);
+        const double relayout_ms =
+            (double)(SDL_GetPerformanceCounter() - relayout_start) * ms_per_tick;
+
+        const ca::LogHistogram frame_times = bench_pan(scene, surface, 0.4f);
+        debug_print("  %-12s relayout %7.2fms  frame mean=%.3fms p50=%.3fms max=%.3fms\n",
+            layouts[l].name, relayout_ms, frame_times.mean() / 1000.0,
+            frame_times.percentile(0.5) / 1000.0, frame_times.max_us / 1000.0);
+    }
+
+    // vertex formats, each on a fresh build of the field
+    const bool old_quantize_vertices = quantize_vertices;
+    for (int packed = 0; packed < 2; packed++) {
+        quantize_vertices = packed == 1;
+        Scene format_scene;
+        scene_add_object(format_scene, field, identity_transform());
+        scene_update(format_scene);
+        const ca::LogHistogram frame_times = bench_pan(format_scene, surface, 0.4f);
+        const size_t vertex_bytes = field.verts.size() * (packed ? 6 : 12);
+        debug_print("  %-12s %5.2fMB of vertices  frame mean=%.3fms p50=%.3fms max=%.3fms\n",
+            packed ? "16-bit verts" : "float verts", vertex_bytes / (1024.0 * 1024.0),
+            frame_times.mean() / 1000.0, frame_times.percentile(0.5) / 1000.0,
+            frame_times.max_us / 1000.0);
+        for (size_t i = 0; i < format_scene.objects.size(); i++) {
+            free_scene_object(format_scene.objects[i]);
+        }
+    }
+    quantize_vertices = old_quantize_vertices;
+
+    bench_bunny_crowd(surface);
+
+    reset_camera();
+    SDL_FreeSurface(surface);
+    for (size_t i = 0; i < scene.objects.size(); i++) {
+        free_scene_object(scene.objects[i]);
+    }
+    return 0;
+}
+
+// Scaling run, -scaling [max triangles]: each generated scene kind at 10,
+// 100, 1000, ... triangles up to the max, one row per size, so build and
+// render cost can be read off against scene size.
+const size_t kScalingMaxTriangles = 1000000;
+
+int run_scaling_benchmark(size_t max_triangles)
+{
+    const double ms_per_tick = 1000.0 / (double)SDL_GetPerformanceFrequency();
+    const bool old_print_build_stats = print_build_stats;
+    print_build_stats = false;
+    SDL_Surface * surface = SDL_rendered_surface_init();
+
+    for (int kind = 0; kind < SCENE_KIND_COUNT; kind++) {
+        debug_print("Scaling: %s\n", scene_kind_names[kind]);
+        debug_print("  %10s %9s %10s %6s %9s %8s\n",
+            "triangles", "build ms", "memory MB", "depth", "frame ms", "Mrays/s");
+        size_t last_triangles = 0;
+        for (size_t target = 10; target <= max_triangles; target *= 10) {
+            RenderObject geometry =
+                generate_scene((SceneKind)kind, target, kGeneratedSceneSeed);
+            const size_t triangles = geometry.faces.size();
+            // sizes below one bunny all come out as one bunny
+            if (triangles == 0 or triangles == last_triangles) {
+                continue;
+            }
+            last_triangles = triangles;
+
+            Scene scene;
+            scene_add_object(scene, geometry, identity_transform());
+            geometry = RenderObject();
+            const Uint64 build_start = SDL_GetPerformanceCounter();
+            scene_update(scene);
+            const double build_ms =
+                (double)(SDL_GetPerformanceCounter() - build_start) * ms_per_tick;
+
+            const SceneObject &obj = scene.objects[0];
+            const ca::LogHistogram frame_times = bench_pan(scene, surface, 0.4f);
+            // rays per microsecond is millions per second
+            const double mrays = (double)(width * height) / frame_times.mean();
+            debug_print("  %10zu %9.1f %10.1f %6u %9.3f %8.2f\n",
+                triangles, build_ms, scene_object_bytes(obj) / (1024.0 * 1024.0),
+                obj.lods[0].bvh.accel->GetStatistics().max_tree_depth,
+                frame_times.mean() / 1000.0, mrays);
+            free_scene_object(scene.objects[0]);
+        }
+    }
+
+    reset_camera();
+    SDL_FreeSurface(surface);
+    print_build_stats = old_print_build_stats;
+    return 0;
+}
+
+// Levels. A level lists meshes, the objects placed from them (each with its
+// own BVH build options), the lights and where the camera starts. Levels
+// are written as text (game.scene is the game's) and can be compiled with
+// -compile-scene into a binary file that holds every mesh with its LOD
+// levels and normals already made, as the arrays the loader copies out of.
+// Loading that maps the file and copies, no parsing and no simplifying, so
+// it takes about as long as reading the file.
+//
+// Text: one item per line, # starts a comment.
+//   camera <eye x y z> <look x> <look y>
+//   light <x y z> <radius> <range> <intensity>
+//   mesh <name> file <path> [lods]          bunny format, path relative to
+//                                           the level file
+//   mesh <name> cube <size> [<center x y z>]
+//   mesh <name> inverted_cube <size> [<center x y z>]
+//   object <mesh name> [at <x y z>] [rotate <axis x y z> <radians>]
+//          [leaf_size <n>] [max_depth <n>] [bins <n>] [cost_aabb <t>]
+//          [layout build|depth_first|breadth_first_top|treelet]
+//
+// Binary: a LevelFileHeader, then the arrays it counts, back to back in
+// this order: LevelFileLight, LevelFileMesh, LevelFileLod, LevelFileObject,
+// vertices (3 floats), face normals (3 floats), faces (3 unsigned, indices
+// into their LOD level's vertices). Native byte order.
+struct LevelCamera
+{
+    ca::Vec3f eye;
+    float look_x;
+    float look_y;
+};
+
+struct LevelObject
+{
+    unsigned mesh;                          // into Level::meshes
+    ObjectTransform transform;
+    nanort::BVHBuildOptions<float> options;
+};
+
+struct Level
+{
+    LevelCamera camera;
+    std::vector<SphereLight> lights;
+    std::vector<LodChain> meshes;
+    std::vector<LevelObject> objects;
+};
+
+const char * kDefaultLevelPath = "game.scene";
+const char kLevelFileMagic[4] = {'L', 'R', 'L', 'V'};
+const Uint32 kLevelFileVersion = 1;
+
+const char * layout_names[] = {"build", "depth_first", "breadth_first_top", "treelet"};
+
+// Bounds on the per-object build options a level may ask for. BVHAccel::Build
+// asserts on fewer than two bins, and traversal keeps a fixed 512 entry stack,
+// so a deeper tree than the default 256 is not allowed either.
+const unsigned kLevelMaxBins = 1024;
+const unsigned kLevelMaxLeafSize = 1024;
+const unsigned kLevelMaxTreeDepth = 256;
+
+bool valid_build_options(const nanort::BVHBuildOptions<float> &options)
+{
+    return options.bin_size >= 2 and options.bin_size <= kLevelMaxBins and
+        options.min_leaf_primitives >= 1 and options.min_leaf_primitives <= kLevelMaxLeafSize and
+        options.max_tree_depth >= 1 and options.max_tree_depth <= kLevelMaxTreeDepth and
+        options.cost_t_aabb >= 0.0f and options.cost_t_aabb < 1e6f and
+        options.layout <= nanort::BVH_LAYOUT_TREELET;
+}
+
+struct LevelFileHeader
+{
+    char magic[4];
+    Uint32 version;
+    float camera[5];        // eye, look x, look y
+    Uint32 num_lights;
+    Uint32 num_meshes;
+    Uint32 num_lods;        // of all meshes
+    Uint32 num_objects;
+    Uint32 num_verts;       // of all LOD levels
+    Uint32 num_faces;
+};
+
+struct LevelFileLight
+{
+    float pos[3];
+    float radius;
+    float range;
+    float intensity;
+};
+
+struct LevelFileMesh
+{
+    Uint32 first_lod;
+    Uint32 num_lods;
+};
+
+struct LevelFileLod
+{
+    Uint32 first_vert;
+    Uint32 num_verts;
+    Uint32 first_face;
+    Uint32 num_faces;
+    float error;
+};
+
+struct LevelFileObject
+{
+    Uint32 mesh;
+    float rotation[9];
+    float position[3];
+    float cost_t_aabb;
+    Uint32 min_leaf_primitives;
+    Uint32 max_tree_depth;
+    Uint32 bin_size;
+    Uint32 layout;
+};
+
+// A whole file mapped read only.
+struct MappedFile
+{
+    const unsigned char * data;
+    size_t size;
+};
+
+bool map_file(const char * path, MappedFile &file)
+{
+    file.data = NULL;
+    file.size = 0;
+#if defined(_MSC_VER)
+    HANDLE handle = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL,
+        OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (handle == INVALID_HANDLE_VALUE) {
+        return false;
+    }
+    LARGE_INTEGER size;
+    HANDLE mapping = NULL;
+    if (GetFileSizeEx(handle, &size) and size.QuadPart > 0) {
+        mapping = CreateFileMappingA(handle, NULL, PAGE_READONLY, 0, 0, NULL);
+    }
+    if (mapping) {
+        file.data = (const unsigned char *)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+        file.size = (size_t)size.QuadPart;
+        CloseHandle(mapping);
+    }
+    CloseHandle(handle);
+#else
+    const int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) == 0 and st.st_size > 0) {
+        void * data = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data != MAP_FAILED) {
+            file.data = (const unsigned char *)data;
+            file.size = (size_t)st.st_size;
+        }
+    }
+    close(fd);
+#endif
+    return file.data != NULL;
+}
+
+void unmap_file(MappedFile &file)
+{
+    if (!file.data) {
+        return;
+    }
+#if defined(_MSC_VER)
+    UnmapViewOfFile(file.data);
+#else
+    munmap((void *)file.data, file.size);
+#endif
+    file.data = NULL;
+    file.size = 0;
+}
+
+// Takes a level out of a mapped binary level file. false if it is not one,
+// or is cut short or inconsistent.
+bool load_level_binary(const MappedFile &file, Level &level)
+{
+    LevelFileHeader header;
+    if (file.size < sizeof(header)) {
+        return false;
+    }
+    memcpy(&header, file.data, sizeof(header));
+    if (memcmp(header.magic, kLevelFileMagic, sizeof(kLevelFileMagic)) != 0 or
+        header.version != kLevelFileVersion) {
+        return false;
+    }
+    const Uint64 expected_size = sizeof(header)
+        + (Uint64)header.num_lights * sizeof(LevelFileLight)
+        + (Uint64)header.num_meshes * sizeof(LevelFileMesh)
+        + (Uint64)header.num_lods * sizeof(LevelFileLod)
+        + (Uint64)header.num_objects * sizeof(LevelFileObject)
+        + (Uint64)header.num_verts * sizeof(ca::Vec3f)
+        + (Uint64)header.num_faces * (sizeof(ca::Vec3f) + sizeof(ca::Vec3u));
+    if (expected_size != file.size) {
+        return false;
+    }
+    const unsigned char * p = file.data + sizeof(header);
+    const LevelFileLight * lights = (const LevelFileLight *)p;
+    p += header.num_lights * sizeof(LevelFileLight);
+    const LevelFileMesh * meshes = (const LevelFileMesh *)p;
+    p += header.num_meshes * sizeof(LevelFileMesh);
+    const LevelFileLod * lods = (const LevelFileLod *)p;
+    p += header.num_lods * sizeof(LevelFileLod);
+    const LevelFileObject * objects = (const LevelFileObject *)p;
+    p += header.num_objects * sizeof(LevelFileObject);
+    const ca::Vec3f * verts = (const ca::Vec3f *)p;
+    p += header.num_verts * sizeof(ca::Vec3f);
+    const ca::Vec3f * normals = (const ca::Vec3f *)p;
+    p += header.num_faces * sizeof(ca::Vec3f);
+    const ca::Vec3u * faces = (const ca::Vec3u *)p;
+
+    level = Level();
+    level.camera.eye = {header.camera[0], header.camera[1], header.camera[2]};
+    level.camera.look_x = header.camera[3];
+    level.camera.look_y = header.camera[4];
+    for (Uint32 i = 0; i < header.num_lights; i++) {
+        const LevelFileLight &l = lights[i];
+        level.lights.push_back(SphereLight{
+            ca::Vec3f{l.pos[0], l.pos[1], l.pos[2]}, l.radius, l.range, l.intensity});
+    }
+    level.meshes.resize(header.num_meshes);
+    for (Uint32 m = 0; m < header.num_meshes; m++) {
+        if (meshes[m].first_lod > header.num_lods or
+            meshes[m].num_lods > header.num_lods - meshes[m].first_lod or
+            meshes[m].num_lods == 0) {
+            return false;
+        }
+        LodChain &chain = level.meshes[m];
+        chain.resize(meshes[m].num_lods);
+        for (Uint32 l = 0; l < meshes[m].num_lods; l++) {
+            const LevelFileLod &lod = lods[meshes[m].first_lod + l];
+            if (lod.first_vert > header.num_verts or
+                lod.num_verts > header.num_verts - lod.first_vert or
+                lod.first_face > header.num_faces or
+                lod.num_faces > header.num_faces - lod.first_face) {
+                return false;
+            }
+            RenderObject &ro = chain[l].mesh;
+            ro.verts.assign(verts + lod.first_vert, verts + lod.first_vert + lod.num_verts);
+            ro.normals.assign(normals + lod.first_face, normals + lod.first_face + lod.num_faces);
+            ro.faces.assign(faces + lod.first_face, faces + lod.first_face + lod.num_faces);
+            for (size_t f = 0; f < ro.faces.size(); f++) {
+                if (ro.faces[f].x >= lod.num_verts or ro.faces[f].y >= lod.num_verts or
+                    ro.faces[f].z >= lod.num_verts) {
+                    return false;
+                }
+            }
+            chain[l].error = lod.error;
+        }
+    }
+    level.objects.resize(header.num_objects);
+    for (Uint32 i = 0; i < header.num_objects; i++) {
+        const LevelFileObject &o = objects[i];
+        LevelObject &obj = level.objects[i];
+        if (o.mesh >= header.num_meshes or o.layout > nanort::BVH_LAYOUT_TREELET) {
+            return false;
+        }
+        obj.mesh = o.mesh;
+        memcpy(&obj.transform.rotation, o.rotation, sizeof(o.rotation));
+        obj.transform.position = {o.position[0], o.position[1], o.position[2]};
+        obj.options.cost_t_aabb = o.cost_t_aabb;
+        obj.options.min_leaf_primitives = o.min_leaf_primitives;
+        obj.options.max_tree_depth = o.max_tree_depth;
+        obj.options.bin_size = o.bin_size;
+        obj.options.layout = (nanort::BVHLayout)o.layout;
+        if (!valid_build_options(obj.options)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Reads a text level. Meshes from files are loaded and simplified here.
+// Prints what is wrong and returns false if anything is.
+bool load_level_text(std::istream &text, const std::string &path, Level &level)
+{
+    const size_t slash = path.find_last_of("/\\");
+    const std::string dir = slash == std::string::npos ? "" : path.substr(0, slash + 1);
+    std::map<std::string, unsigned> mesh_ids;
+    level = Level();
+    level.camera.eye = {0.0f, 0.0f, -2.3f};    // where reset_camera() puts it
+    level.camera.look_x = 0.0f;
+    level.camera.look_y = 0.0f;
+
+    std::string line;
+    for (int line_number = 1; std::getline(text, line); line_number++) {
+        const size_t comment = line.find('#');
+        if (comment != std::string::npos) {
+            line.resize(comment);
+        }
+        std::istringstream in(line);
+        std::string item;
+        if (!(in >> item)) {
+            continue;
+        }
+
+        bool ok = true;
+        if (item == "camera") {
+            LevelCamera &c = level.camera;
+            ok = (bool)(in >> c.eye.x >> c.eye.y >> c.eye.z >> c.look_x >> c.look_y);
+        } else if (item == "light") {
+            SphereLight l;
+            ok = (bool)(in >> l.pos.x >> l.pos.y >> l.pos.z >> l.radius >> l.range >> l.intensity);
+            level.lights.push_back(l);
+        } else if (item == "mesh") {
+            std::string name, source;
+            in >> name >> source;
+            RenderObject ro;
+            LodChain chain;
+            if (source == "file") {
+                std::string file, lods;
+                ok = (bool)(in >> file) and load_mesh((file[0] == '/' ? file : dir + file).c_str(), ro);
+                if (ok and in >> lods) {
+                    ok = lods == "lods";
+                    if (ok) {
+                        chain = make_lod_chain(ro);
+                    }
+                }
+            } else if (source == "cube" or source == "inverted_cube") {
+                float size = 0.0f;
+                ca::Vec3f center = {0.0f, 0.0f, 0.0f};
+                ok = (bool)(in >> size);
+                if (ok and in >> center.x) {
+                    ok = (bool)(in >> center.y >> center.z);
+                }
+                if (source == "cube") {
+                    drawCube(ro, center, ca::Mat3f::Identity(), size);
+                } else {
+                    drawInvertedCube(ro, center, ca::Mat3f::Identity(), size);
+                }
+            } else {
+                ok = false;
+            }
+            if (ok and chain.empty()) {
+                chain.resize(1);
+                chain[0].mesh = ro;
+                chain[0].error = 0.0f;
+            }
+            ok = ok and !name.empty() and mesh_ids.count(name) == 0;
+            if (ok) {
+                mesh_ids[name] = (unsigned)level.meshes.size();
+                level.meshes.push_back(chain);
+            }
+        } else if (item == "object") {
+            std::string name, key;
+            in >> name;
+            ok = mesh_ids.count(name) == 1;
+            LevelObject obj;
+            obj.mesh = ok ? mesh_ids[name] : 0;
+            obj.transform = identity_transform();
+            while (ok and in >> key) {
+                if (key == "at") {
+                    ca::Vec3f &at = obj.transform.position;
+                    ok = (bool)(in >> at.x >> at.y >> at.z);
+                } else if (key == "rotate") {
+                    ca::Vec3f axis;
+                    float angle;
+                    ok = (bool)(in >> axis.x >> axis.y >> axis.z >> angle);
+                    obj.transform.rotation = ca::RotationMat3f(ca::axis_angle_quat(axis, angle));
+                } else if (key == "leaf_size") {
+                    ok = (bool)(in >> obj.options.min_leaf_primitives);
+                } else if (key == "max_depth") {
+                    ok = (bool)(in >> obj.options.max_tree_depth);
+                } else if (key == "bins") {
+                    ok = (bool)(in >> obj.options.bin_size);
+                } else if (key == "cost_aabb") {
+                    ok = (bool)(in >> obj.options.cost_t_aabb);
+                } else if (key == "layout") {
+                    std::string layout;
+                    in >> layout;
+                    ok = false;
+                    for (int i = 0; i <= nanort::BVH_LAYOUT_TREELET; i++) {
+                        if (layout == layout_names[i]) {
+                            obj.options.layout = (nanort::BVHLayout)i;
+                            ok = true;
+                        }
+                    }
+                } else {
+                    ok = false;
+                }
+            }
+            ok = ok and valid_build_options(obj.options);
+            level.objects.push_back(obj);
+        } else {
+            ok = false;
+        }
+        if (!ok) {
+            debug_print("%s:%d: can't make sense of \"%s\"\n",
+                path.c_str(), line_number, line.c_str());
+            return false;
+        }
+    }
+    return true;
+}
+
+// Loads a level file of either form.
+bool load_level(const char * path, Level &level)
+{
+    CA_PROFILE_ZONE("load_level");
+    MappedFile file;
+    if (!map_file(path, file)) {
+        debug_print("could not read %s\n", path);
+        return false;
+    }
+    bool ok;
+    if (file.size >= sizeof(kLevelFileMagic) and
+        memcmp(file.data, kLevelFileMagic, sizeof(kLevelFileMagic)) == 0) {
+        ok = load_level_binary(file, level);
+        if (!ok) {
+            debug_print("%s: broken level file\n", path);
+        }
+    } else {
+        std::istringstream text(std::string((const char *)file.data, file.size));
+        ok = load_level_text(text, path, level);
+    }
+    unmap_file(file);
+    return ok;
+}
+
+bool write_level_binary(const char * path, const Level &level)
+{
+    LevelFileHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, kLevelFileMagic, sizeof(kLevelFileMagic));
+    header.version = kLevelFileVersion;
+    header.camera[0] = level.camera.eye.x;
+    header.camera[1] = level.camera.eye.y;
+    header.camera[2] = level.camera.eye.z;
+    header.camera[3] = level.camera.look_x;
+    header.camera[4] = level.camera.look_y;
+    header.num_lights = (Uint32)level.lights.size();
+    header.num_meshes = (Uint32)level.meshes.size();
+    header.num_objects = (Uint32)level.objects.size();
+
+    std::vector<LevelFileLight> lights;
+    for (size_t i = 0; i < level.lights.size(); i++) {
+        const SphereLight &l = level.lights[i];
+        lights.push_back(LevelFileLight{{l.pos.x, l.pos.y, l.pos.z}, l.radius, l.range, l.intensity});
+    }
+    std::vector<LevelFileMesh> meshes;
+    std::vector<LevelFileLod> lods;
+    std::vector<ca::Vec3f> verts;
+    std::vector<ca::Vec3f> normals;
+    std::vector<ca::Vec3u> faces;
+    for (size_t m = 0; m < level.meshes.size(); m++) {
+        const LodChain &chain = level.meshes[m];
+        meshes.push_back(LevelFileMesh{(Uint32)lods.size(), (Uint32)chain.size()});
+        for (size_t l = 0; l < chain.size(); l++) {
+            const RenderObject &ro = chain[l].mesh;
+            lods.push_back(LevelFileLod{(Uint32)verts.size(), (Uint32)ro.verts.size(),
+                (Uint32)faces.size(), (Uint32)ro.faces.size(), chain[l].error});
+            verts.insert(verts.end(), ro.verts.begin(), ro.verts.end());
+            normals.insert(normals.end(), ro.normals.begin(), ro.normals.end());
+            faces.insert(faces.end(), ro.faces.begin(), ro.faces.end());
+        }
+    }
+    header.num_lods = (Uint32)lods.size();
+    header.num_verts = (Uint32)verts.size();
+    header.num_faces = (Uint32)faces.size();
+    std::vector<LevelFileObject> objects;
+    for (size_t i = 0; i < level.objects.size(); i++) {
+        const LevelObject &obj = level.objects[i];
+        LevelFileObject o;
+        o.mesh = obj.mesh;
+        memcpy(o.rotation, &obj.transform.rotation, sizeof(o.rotation));
+        o.position[0] = obj.transform.position.x;
+        o.position[1] = obj.transform.position.y;
+        o.position[2] = obj.transform.position.z;
+        o.cost_t_aabb = obj.options.cost_t_aabb;
+        o.min_leaf_primitives = obj.options.min_leaf_primitives;
+        o.max_tree_depth = obj.options.max_tree_depth;
+        o.bin_size = obj.options.bin_size;
+        o.layout = obj.options.layout;
+        objects.push_back(o);
+    }
+
+    FILE * file = fopen(path, "wb");
+    if (!file) {
+        return false;
+    }
+    fwrite(&header, sizeof(header), 1, file);
+    fwrite(lights.data(), sizeof(LevelFileLight), lights.size(), file);
+    fwrite(meshes.data(), sizeof(LevelFileMesh), meshes.size(), file);
+    fwrite(lods.data(), sizeof(LevelFileLod), lods.size(), file);
+    fwrite(objects.data(), sizeof(LevelFileObject), objects.size(), file);
+    fwrite(verts.data(), sizeof(ca::Vec3f), verts.size(), file);
+    fwrite(normals.data(), sizeof(ca::Vec3f), normals.size(), file);
+    fwrite(faces.data(), sizeof(ca::Vec3u), faces.size(), file);
+    return fclose(file) == 0;
+}
+
+// -compile-scene <level> <out>
+int compile_level(const char * in_path, const char * out_path)
+{
+    Level level;
+    if (!load_level(in_path, level)) {
+        return 1;
+    }
+    if (!write_level_binary(out_path, level)) {
+        debug_print("could not write %s\n", out_path);
+        return 1;
+    }
+    debug_print("%s: %zu meshes, %zu objects, %zu lights\n",
+        out_path, level.meshes.size(), level.objects.size(), level.lights.size());
+    return 0;
+}
+
+// What game.scene holds, for when it can't be loaded: the bunny, the
+// inverted cube around the camera and three cubes in front of it.
+Level builtin_level()
+{
+    Level level;
+    level.camera.eye = {0.0f, 0.0f, -2.3f};
+    level.camera.look_x = 0.0f;
+    level.camera.look_y = 0.0f;
+    level.lights.push_back(SphereLight{ca::Vec3f{0.0f, 0.0f, 0.0f}, 0.0f, 5.0f, 100.0f});
+
+    LevelObject obj;
+    obj.transform = identity_transform();
+    load_bunny();
+    if (!bunny.empty()) {
+        obj.mesh = (unsigned)level.meshes.size();
+        level.meshes.push_back(bunny);
+        level.objects.push_back(obj);
+    }
+
+    LodChain room(1);
+    drawInvertedCube(room[0].mesh, ca::Vec3f{0.f,0.f,0.f}, ca::Mat3f::Identity());
+    room[0].error = 0.0f;
+    obj.mesh = (unsigned)level.meshes.size();
+    level.meshes.push_back(room);
+    level.objects.push_back(obj);
+
+    ca::Quat q_rotate = ca::axis_angle_quat({1.0f,0.0f,0.0f}, -1.0f);
+    obj.transform.rotation = ca::RotationMat3f(q_rotate);
+    const ca::Vec3f cube_positions[3] = {
+        {0.f,0.f,0.f},
+        {-1.5f,0.0f,0.0f},
+        { 1.5f,0.0f,0.0f}
+    };
+    for (int i = 0; i < 3; i++) {
+        // positioned in local space so the rotation also turns the row,
+        // like the cubes always were
+        LodChain cube(1);
+        drawCube(cube[0].mesh, cube_positions[i], ca::Mat3f::Identity());
+        cube[0].error = 0.0f;
+        obj.mesh = (unsigned)level.meshes.size();
+        level.meshes.push_back(cube);
+        level.objects.push_back(obj);
+    }
+    return level;
+}
+
+Scene * make_level_scene(const Level &level)
+{
+    Scene * scene = new Scene;
+    for (size_t i = 0; i < level.objects.size(); i++) {
+        const LevelObject &obj = level.objects[i];
+        scene_add_lod_object(*scene, level.meshes[obj.mesh], obj.transform, &obj.options);
+    }
+    return scene;
+}
 
-        ca::Vec3f normal = {
-            u.y * v.z - u.z * v.y,
-            u.z * v.x - u.x * v.z,
-            u.x * v.y - u.y * v.x
-        };
-        normal = rot_mat * normal;
-        ca::normalize_modify(normal);
-        cube_normals[i] = normal;
+// Puts the camera where the level starts it and lights it.
+void enter_level(const Level &level)
+{
+    reset_camera();
+    eye = level.camera.eye;
+    if (level.camera.look_x != 0.0f or level.camera.look_y != 0.0f) {
+        update_look_matrix(level.camera.look_x, level.camera.look_y);
     }
-    size_t cube_verts_i = cube.verts.size();
-    cube.verts.insert(cube.verts.end(), cube_verts, cube_verts + 8 );
-    cube.faces.insert(cube.faces.end(), cube_faces, cube_faces + 12);
-    cube.normals.insert(cube.normals.end(), cube_normals, cube_normals + 12);
+    scene_lights = level.lights;
+    scene_light_tree.build(scene_lights);
+}
 
-    // rotate the vertices
-    while (cube_verts_i < cube.verts.size()) {
-        cube.verts[cube_verts_i] = (rot_mat * cube.verts[cube_verts_i]);
-        cube_verts_i++;
+// the level R rebuilds and -regress renders as "game"
+Level game_level;
+
+Scene * make_game_scene()
+{
+    return make_level_scene(game_level);
+}
+
+// Regression check, -regress [dir]: renders a fixed set of scenes from fixed
+// camera poses headlessly, compares every image to its reference in `dir`
+// and its fastest frame time (the one the rest of the machine disturbed
+// least) to the baseline recorded with it. Exits with 1
+// if any image or time is off by more than the tolerances below.
+// The reference images are checked in; the time baselines only mean
+// something on one machine, so they live next to them untracked and the
+// first check on a machine records them.
+// -regress-update [dir] (re)records references and baselines with the
+// current build.
+const char * kRegressDefaultDir = "regress";
+const char * kRegressTimingsFile = "timings.txt";
+const size_t kRegressTriangles = 20000;     // per generated scene
+const int kRegressFrames = 30;
+const int kRegressChannelTolerance = 8;     // out of 255
+const float kRegressMaxBadPixels = 0.01f;   // share of covered pixels past that
+const size_t kRegressMinCoveredPixels = 200; // a pose must show this much scene
+const double kRegressMaxSlowdown = 1.25;
+const double kRegressTimeSlackMs = 0.05;    // keeps tiny cases out of the noise
+
+// Camera poses per scene, each framing what the light reaches of it.
+struct RegressPose
+{
+    const char * scene;
+    ca::Vec3f eye;
+    float look_x;
+    float look_y;
+};
+
+const RegressPose regress_poses[] = {
+    {"game",    {0.0f, 0.0f, -2.3f},    0.0f,  0.0f},     // where the game starts
+    {"game",    {0.8f, 0.4f, -1.5f},    0.2f,  0.35f},
+    {"cubes",   {0.0f, 0.0f, -2.3f},    0.0f,  0.0f},
+    {"cubes",   {0.8f, 0.4f, -1.5f},    0.2f,  0.35f},
+    {"bunnies", {0.0f, 0.3f, -1.0f},   -0.3f,  0.0f},
+    {"bunnies", {0.0f, 0.0f, 0.5f},    -0.6f,  0.0f},     // from inside the box
+    {"soup",    {0.0f, 0.0f, -1.0f},    0.0f,  0.0f},
+    {"soup",    {0.0f, 0.0f, 0.5f},     0.6f,  0.0f},
+    {"crowd",   {0.75f, 0.01f, -0.35f}, 0.0f,  0.0f},     // a bunny and its row
+    {"crowd",   {-0.75f, 0.05f, -0.4f}, 0.1f,  0.0f}
+};
+
+// Pixels something was drawn on: misses are black.
+size_t count_covered_pixels(const unsigned char * pixels, size_t num_pixels, int stride)
+{
+    size_t covered = 0;
+    for (size_t i = 0; i < num_pixels; i++) {
+        const unsigned char * p = pixels + stride * i;
+        if (p[0] != 0 or p[1] != 0 or p[2] != 0) {
+            covered++;
+        }
+    }
+    return covered;
+}
+
+bool write_ppm(const std::string &path, const unsigned char * rgba, int w, int h)
+{
+    FILE * file = fopen(path.c_str(), "wb");
+    if (!file) {
+        return false;
+    }
+    fprintf(file, "P6\n%d %d\n255\n", w, h);
+    for (int i = 0; i < w * h; i++) {
+        fwrite(rgba + 4 * i, 1, 3, file);
+    }
+    return fclose(file) == 0;
+}
+
+// Reads what write_ppm writes.
+bool read_ppm(const std::string &path, std::vector<unsigned char> &rgb, int &w, int &h)
+{
+    FILE * file = fopen(path.c_str(), "rb");
+    if (!file) {
+        return false;
+    }
+    int max_value = 0;
+    bool ok = fscanf(file, "P6 %d %d %d", &w, &h, &max_value) == 3 and
+        max_value == 255 and w > 0 and h > 0 and fgetc(file) != EOF;
+    if (ok) {
+        rgb.resize((size_t)w * h * 3);
+        ok = fread(rgb.data(), 1, rgb.size(), file) == rgb.size();
+    }
+    fclose(file);
+    return ok;
+}
+
+std::map<std::string, double> read_regress_timings(const std::string &path)
+{
+    std::map<std::string, double> timings;
+    std::ifstream file(path.c_str());
+    std::string name;
+    double ms;
+    while (file >> name >> ms) {
+        timings[name] = ms;
+    }
+    return timings;
+}
+
+int run_regression(const std::string &dir, bool update)
+{
+    if (update) {
+        make_directory(dir.c_str());
+    }
+    const double ms_per_tick = 1000.0 / (double)SDL_GetPerformanceFrequency();
+    const bool old_print_build_stats = print_build_stats;
+    print_build_stats = false;
+
+    std::vector<std::pair<std::string, Scene *> > scenes;
+    scenes.push_back(std::make_pair(std::string("game"), make_game_scene()));
+    for (int kind = 0; kind < SCENE_KIND_COUNT; kind++) {
+        RenderObject geometry =
+            generate_scene((SceneKind)kind, kRegressTriangles, kGeneratedSceneSeed);
+        if (geometry.faces.empty()) {
+            continue;
+        }
+        Scene * scene = new Scene;
+        scene_add_object(*scene, geometry, identity_transform());
+        scenes.push_back(std::make_pair(std::string(scene_kind_names[kind]), scene));
+    }
+    if (!bunny.empty()) {
+        Scene * scene = new Scene;
+        add_bunny_crowd(*scene);
+        scenes.push_back(std::make_pair(std::string("crowd"), scene));
+    }
+
+    const std::string timings_path = dir + "/" + kRegressTimingsFile;
+    const std::map<std::string, double> baselines = read_regress_timings(timings_path);
+    const bool record_timings = update or baselines.empty();
+    std::map<std::string, double> timings;
+    SDL_Surface * surface = SDL_rendered_surface_init();
+    const size_t num_pixels = (size_t)width * height;
+    int failures = 0;
+
+    for (size_t s = 0; s < scenes.size(); s++) {
+        Scene &scene = *scenes[s].second;
+        scene_update(scene);
+        size_t scene_pose = 0;
+        for (size_t p = 0; p < sizeof(regress_poses) / sizeof(regress_poses[0]); p++) {
+            if (scenes[s].first != regress_poses[p].scene) {
+                continue;
+            }
+            char name[64];
+            snprintf(name, sizeof(name), "%s_%zu", scenes[s].first.c_str(), scene_pose++);
+            const std::string image_path = dir + "/" + name + ".ppm";
+
+            reset_camera();
+            eye = regress_poses[p].eye;
+            update_look_matrix(regress_poses[p].look_x, regress_poses[p].look_y);
+            std::vector<double> frame_ms(kRegressFrames);
+            for (int f = 0; f < kRegressFrames; f++) {
+                const Uint64 frame_start = SDL_GetPerformanceCounter();
+                render_scene(width, height, scene, surface);
+                frame_ms[f] = (double)(SDL_GetPerformanceCounter() - frame_start) * ms_per_tick;
+            }
+            const double best_ms = *std::min_element(frame_ms.begin(), frame_ms.end());
+            timings[name] = best_ms;
+            const unsigned char * pixels = (const unsigned char *)surface->pixels;
+
+            if (update) {
+                // an empty frame would pass no matter what the renderer does
+                const size_t covered = count_covered_pixels(pixels, num_pixels, 4);
+                if (covered < kRegressMinCoveredPixels) {
+                    debug_print("  %-10s shows only %zu pixels of scene, not recorded\n",
+                        name, covered);
+                    failures++;
+                    continue;
+                }
+                if (!write_ppm(image_path, pixels, width, height)) {
+                    debug_print("  %-10s could not write %s\n", name, image_path.c_str());
+                    failures++;
+                    continue;
+                }
+                debug_print("  %-10s recorded, %zu px covered, %.3fms\n", name, covered, best_ms);
+                continue;
+            }
+
+            bool failed = false;
+            std::vector<unsigned char> reference;
+            int ref_w = 0, ref_h = 0;
+            debug_print("  %-10s ", name);
+            if (!read_ppm(image_path, reference, ref_w, ref_h)) {
+                debug_print("no reference image");
+                failed = true;
+            } else if (ref_w != width or ref_h != height) {
+                debug_print("reference is %dx%d", ref_w, ref_h);
+                failed = true;
+            } else if (count_covered_pixels(reference.data(), num_pixels, 3) <
+                       kRegressMinCoveredPixels) {
+                debug_print("reference shows almost nothing, re-record it");
+                failed = true;
+            } else {
+                // The budget is a share of the pixels either image covers,
+                // so sparse scenes aren't judged against empty background.
+                size_t bad = 0;
+                size_t covered = 0;
+                int max_delta = 0;
+                for (size_t i = 0; i < num_pixels; i++) {
+                    const unsigned char * ref = &reference[3 * i];
+                    const unsigned char * out = &pixels[4 * i];
+                    if (ref[0] != 0 or ref[1] != 0 or ref[2] != 0 or
+                        out[0] != 0 or out[1] != 0 or out[2] != 0) {
+                        covered++;
+                    }
+                    int delta = 0;
+                    for (int c = 0; c < 3; c++) {
+                        delta = std::max(delta,
+                            abs((int)pixels[4 * i + c] - (int)reference[3 * i + c]));
+                    }
+                    if (delta > kRegressChannelTolerance) {
+                        bad++;
+                    }
+                    max_delta = std::max(max_delta, delta);
+                }
+                const bool image_ok = bad <= (size_t)(kRegressMaxBadPixels * covered);
+                debug_print("image %s (%zu of %zu px off, max diff %d)",
+                    image_ok ? "ok" : "FAILED", bad, covered, max_delta);
+                failed = failed or !image_ok;
+            }
+
+            std::map<std::string, double>::const_iterator baseline = baselines.find(name);
+            if (baselines.empty()) {
+                debug_print(", %.3fms recorded as baseline\n", best_ms);
+            } else if (baseline == baselines.end()) {
+                debug_print(", no baseline time\n");
+                failed = true;
+            } else {
+                const bool time_ok =
+                    best_ms <= baseline->second * kRegressMaxSlowdown + kRegressTimeSlackMs;
+                debug_print(", %.3fms vs %.3fms %s\n", best_ms, baseline->second,
+                    time_ok ? "ok" : "SLOWER");
+                failed = failed or !time_ok;
+            }
+            if (failed) {
+                failures++;
+            }
+        }
+        destroy_scene(scenes[s].second);
+    }
+
+    if (record_timings) {
+        FILE * file = fopen(timings_path.c_str(), "w");
+        if (file) {
+            for (std::map<std::string, double>::const_iterator it = timings.begin();
+                 it != timings.end(); ++it) {
+                fprintf(file, "%s %.4f\n", it->first.c_str(), it->second);
+            }
+            fclose(file);
+        } else {
+            debug_print("could not write %s\n", timings_path.c_str());
+            failures++;
+        }
+    }
+
+    reset_camera();
+    SDL_FreeSurface(surface);
+    print_build_stats = old_print_build_stats;
+    debug_print("%s: %d of %zu cases failed\n", update ? "Regression update" : "Regression check",
+        failures, timings.size());
+    return failures == 0 ? 0 : 1;
+}
+
+#if defined(USE_LIBPNG)
+// Same input as write_ppm. Fastest compression: frames are written while
+// the game runs.
+bool write_png(const std::string &path, const unsigned char * rgba, int w, int h)
+{
+    FILE * file = fopen(path.c_str(), "wb");
+    if (!file) {
+        return false;
+    }
+    png_structp png = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+    png_infop info = png ? png_create_info_struct(png) : NULL;
+    if (!info or setjmp(png_jmpbuf(png))) {
+        png_destroy_write_struct(&png, &info);
+        fclose(file);
+        return false;
+    }
+    png_init_io(png, file);
+    png_set_IHDR(png, info, w, h, 8, PNG_COLOR_TYPE_RGB, PNG_INTERLACE_NONE,
+        PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
+    png_set_compression_level(png, 1);
+    png_write_info(png, info);
+    // rows come in as RGBA, skip the A
+    png_set_filler(png, 0, PNG_FILLER_AFTER);
+    for (int y = 0; y < h; y++) {
+        png_write_row(png, (png_const_bytep)(rgba + (size_t)y * w * 4));
+    }
+    png_write_end(png, NULL);
+    png_destroy_write_struct(&png, &info);
+    return fclose(file) == 0;
+}
+#endif
+
+// Frame capture, -capture [dir]: every presented frame is copied into one of
+// a few preallocated slots and written out as a numbered image by a
+// background thread. If all slots still wait for the encoder the frame is
+// dropped and counted instead, so capturing never holds up a frame. Frame
+// numbers count the dropped frames too; gaps in the files are the drops.
+// PNG when built with -DUSE_LIBPNG, raw PPM otherwise or with -capture-ppm
+// (bigger files, but much cheaper to write).
+enum CaptureFormat
+{
+    CAPTURE_FORMAT_PPM = 0,
+    CAPTURE_FORMAT_PNG,
+    CAPTURE_FORMAT_COUNT
+};
+
+const char * capture_format_extensions[CAPTURE_FORMAT_COUNT] = {"ppm", "png"};
+
+const char * kCaptureDefaultDir = "capture";
+const int kCaptureSlots = 8;
+
+struct CaptureSlot
+{
+    std::vector<unsigned char> rgba;
+    unsigned long long number;
+};
+
+struct FrameCapture
+{
+    CaptureSlot slots[kCaptureSlots];
+    // One writer (the render loop) and one reader (the encoder), slots
+    // [read, write) modulo kCaptureSlots wait to be encoded.
+    std::atomic<unsigned long long> write;
+    std::atomic<unsigned long long> read;
+    std::atomic<bool> running;
+    std::thread encoder;
+    std::string dir;
+    CaptureFormat format;
+    int w;
+    int h;
+    unsigned long long offered;
+    unsigned long long dropped;
+    unsigned long long failed;      // touched by the encoder only
+};
+
+FrameCapture capture;
+
+void capture_encode_loop()
+{
+    ca::profiler_set_thread_name("capture encoder");
+    char name[64];
+    while (true) {
+        // read `running` first: once it is false every frame is in `write`
+        const bool running = capture.running.load();
+        const unsigned long long read = capture.read.load();
+        if (read == capture.write.load()) {
+            if (!running) {
+                break;
+            }
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            continue;
+        }
+        CA_PROFILE_ZONE("encode frame");
+        const CaptureSlot &slot = capture.slots[read % kCaptureSlots];
+        snprintf(name, sizeof(name), "/frame_%06llu.%s",
+            slot.number, capture_format_extensions[capture.format]);
+        const std::string path = capture.dir + name;
+        bool ok = false;
+#if defined(USE_LIBPNG)
+        if (capture.format == CAPTURE_FORMAT_PNG) {
+            ok = write_png(path, slot.rgba.data(), capture.w, capture.h);
+        } else
+#endif
+        {
+            ok = write_ppm(path, slot.rgba.data(), capture.w, capture.h);
+        }
+        if (!ok) {
+            capture.failed++;
+        }
+        capture.read = read + 1;
+    }
+}
+
+void capture_start(const std::string &dir, CaptureFormat format, int w, int h)
+{
+    make_directory(dir.c_str());
+    capture.dir = dir;
+    capture.format = format;
+    capture.w = w;
+    capture.h = h;
+    for (int i = 0; i < kCaptureSlots; i++) {
+        capture.slots[i].rgba.resize((size_t)w * h * 4);
+    }
+    capture.write = 0;
+    capture.read = 0;
+    capture.offered = 0;
+    capture.dropped = 0;
+    capture.failed = 0;
+    capture.running = true;
+    capture.encoder = std::thread(capture_encode_loop);
+    debug_print("capturing %dx%d frames to %s/*.%s\n",
+        w, h, dir.c_str(), capture_format_extensions[format]);
+}
+
+// Call with each finished frame. Does nothing unless capturing.
+void capture_frame(const SDL_Surface * surface)
+{
+    if (!capture.encoder.joinable()) {
+        return;
+    }
+    CA_PROFILE_ZONE("capture_frame");
+    const unsigned long long number = capture.offered++;
+    const unsigned long long write = capture.write.load();
+    if (write - capture.read.load() == (unsigned long long)kCaptureSlots) {
+        capture.dropped++;
+        return;
+    }
+    CaptureSlot &slot = capture.slots[write % kCaptureSlots];
+    const size_t row_bytes = (size_t)capture.w * 4;
+    for (int y = 0; y < capture.h; y++) {
+        memcpy(slot.rgba.data() + y * row_bytes,
+            (const unsigned char *)surface->pixels + y * surface->pitch, row_bytes);
+    }
+    slot.number = number;
+    capture.write = write + 1;
+}
+
+// Writes out what is still queued, then reports.
+void capture_stop()
+{
+    if (!capture.encoder.joinable()) {
+        return;
+    }
+    capture.running = false;
+    capture.encoder.join();
+    debug_print("Capture: %llu frames written to %s, %llu dropped, %llu failed\n",
+        capture.offered - capture.dropped - capture.failed, capture.dir.c_str(),
+        capture.dropped, capture.failed);
+}
+
+// cubes spawned with E, removed last first with Q
+std::vector<ObjectHandle> spawned_cubes;
+
+// -trace: zones from startup to exit, written out as a Chrome trace
+const char * trace_path = NULL;
+
+int finish_trace(int exit_code)
+{
+    if (!trace_path) {
+        return exit_code;
+    }
+    ca::profiler_stop();
+    const long zones = ca::profiler_write_chrome_trace(trace_path);
+    if (zones < 0) {
+        debug_print("could not write trace %s\n", trace_path);
+    } else {
+        debug_print("trace: %ld zones written to %s\n", zones, trace_path);
     }
+    return exit_code;
 }
 
 #if defined(_MSC_VER)
@@ -409,151 +3777,355 @@ void drawCube(
 #endif
 
 PROG_MAIN {
-    std::string line;
-    std::ifstream myFile ("bunny.obj");
-    unsigned numVerts, numFaces;
-    unsigned num_copies = 1;
-    // if (myFile.is_open()) {
-    //     myFile >> numVerts >> numFaces;
-    //     bunny.verts.resize(numVerts * num_copies);
-    //     bunny.normals.resize(numFaces * num_copies);
-    //     bunny.faces.resize(numFaces * num_copies);
-    //     for (unsigned i = 0; i < numVerts; i++) {
-    //         char v;
-    //         float v1, v2, v3;
-    //         myFile >> v >> v1 >> v2 >> v3;
-    //         {
-    //             ca::Vec3f pos = {v1, v2, v3};
-    //             drawCube(squares,pos);
-    //         }
-    //         for (int j = 0; j < num_copies; j++) {
-    //             ca::Vec3f pos = {v1 + j * 2, v2, v3};
-    //             bunny.verts[i + j * numVerts] = pos;
-    //         }
-    //     }
-    //     for (unsigned i = 0; i < numFaces; i++) {
-    //         char f;
-    //         int f1, f2, f3;
-    //         myFile >> f >> f1 >> f2 >> f3;
-
-    //         // TODO switch to use ca::Vec3f
-    //         ca::Vec3f& p1 = bunny.verts[f1];
-    //         ca::Vec3f& p2 = bunny.verts[f2];
-    //         ca::Vec3f& p3 = bunny.verts[f3];
-    //         ca::Vec3f u = p2 - p1;
-    //         ca::Vec3f v = p3 - p1;
-
-    //         ca::Vec3f normal = {
-    //             u.y * v.z - u.z * v.y,
-    //             u.z * v.x - u.x * v.z,
-    //             u.x * v.y - u.y * v.x
-    //         };
-    //         ca::normalize_modify(normal);
-
-    //         for (int j = 0; j < num_copies; j++) {
-    //             ca::Vec3u face = {
-    //                 f1 + j * numVerts,
-    //                 f2 + j * numVerts,
-    //                 f3 + j * numVerts
-    //             };
-    //             bunny.faces[i + j * numFaces] = face;
-    //             bunny.normals[i + j * numFaces] = normal;
-    //         }
-    //     }
-    // } else {
-    //     // TODO exit
-    // }
+#if defined(_MSC_VER)
+    const int argc = __argc;
+    char ** argv = __argv;
+#endif
+    bool bench = false;
+    bool scaling = false;
+    size_t scaling_max_triangles = kScalingMaxTriangles;
+    bool regress = false;
+    bool regress_update = false;
+    std::string regress_dir = kRegressDefaultDir;
+    bool capture_frames = false;
+    std::string capture_dir = kCaptureDefaultDir;
+#if defined(USE_LIBPNG)
+    CaptureFormat capture_format = CAPTURE_FORMAT_PNG;
+#else
+    CaptureFormat capture_format = CAPTURE_FORMAT_PPM;
+#endif
+    const char * record_path = NULL;
+    const char * replay_path = NULL;
+    bool headless = false;
+    bool perf = false;
+    bool memory_report = false;
+    const char * level_path = NULL;
+    const char * compile_in_path = NULL;
+    const char * compile_out_path = NULL;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-bench") == 0) {
+            bench = true;
+        } else if (strcmp(argv[i], "-regress") == 0 or
+                   strcmp(argv[i], "-regress-update") == 0) {
+            regress = true;
+            regress_update = strcmp(argv[i], "-regress-update") == 0;
+            if (i + 1 < argc and argv[i + 1][0] != '-') {
+                regress_dir = argv[++i];
+            }
+        } else if (strcmp(argv[i], "-capture") == 0) {
+            capture_frames = true;
+            if (i + 1 < argc and argv[i + 1][0] != '-') {
+                capture_dir = argv[++i];
+            }
+        } else if (strcmp(argv[i], "-capture-ppm") == 0) {
+            capture_format = CAPTURE_FORMAT_PPM;
+        } else if (strcmp(argv[i], "-record") == 0 and i + 1 < argc) {
+            record_path = argv[++i];
+        } else if (strcmp(argv[i], "-replay") == 0 and i + 1 < argc) {
+            replay_path = argv[++i];
+        } else if (strcmp(argv[i], "-perf") == 0) {
+            perf = true;
+        } else if (strcmp(argv[i], "-isa") == 0 and i + 1 < argc) {
+            ++i;
+            int level = 0;
+            while (level < ca::CPU_LEVEL_COUNT and
+                   strcmp(argv[i], ca::cpu_level_name((ca::CpuLevel)level)) != 0) {
+                level++;
+            }
+            if (level < ca::CPU_LEVEL_COUNT) {
+                ca::limit_cpu_level((ca::CpuLevel)level);
+            }
+        } else if (strcmp(argv[i], "-memory") == 0) {
+            memory_report = true;
+        } else if (strcmp(argv[i], "-compact") == 0) {
+            compact_memory = true;
+        } else if (strcmp(argv[i], "-trace") == 0 and i + 1 < argc) {
+            trace_path = argv[++i];
+        } else if (strcmp(argv[i], "-headless") == 0) {
+            headless = true;
+        } else if (strcmp(argv[i], "-scene") == 0 and i + 1 < argc) {
+            level_path = argv[++i];
+        } else if (strcmp(argv[i], "-compile-scene") == 0 and i + 2 < argc) {
+            compile_in_path = argv[++i];
+            compile_out_path = argv[++i];
+        } else if (strcmp(argv[i], "-scaling") == 0) {
+            scaling = true;
+            if (i + 1 < argc and atol(argv[i + 1]) > 0) {
+                scaling_max_triangles = (size_t)atol(argv[++i]);
+            }
+        }
+    }
+
+    debug_print("kernels: %s (detected %s)\n", ca::cpu_level_name(ca::cpu_level()),
+        ca::cpu_level_name(ca::detect_cpu_level()));
+
+    if (trace_path) {
+        ca::profiler_set_thread_name("main");
+        ca::profiler_start();
+    }
+
+    if (bench or scaling or regress) {
+        load_bunny();
+    }
+
+    if (compile_in_path) {
+        return compile_level(compile_in_path, compile_out_path);
+    }
+
+    const Uint64 level_start = SDL_GetPerformanceCounter();
+    if (load_level(level_path ? level_path : kDefaultLevelPath, game_level)) {
+        debug_print("%s: %zu objects, loaded in %.1fms\n",
+            level_path ? level_path : kDefaultLevelPath, game_level.objects.size(),
+            (double)(SDL_GetPerformanceCounter() - level_start) * 1000.0
+                / (double)SDL_GetPerformanceFrequency());
+    } else if (level_path) {
+        return 1;
+    } else {
+        debug_print("using the built in level\n");
+        game_level = builtin_level();
+    }
 
     // initialize global values
-    forward = {0.0f, 0.0f, 1.0f};
-    right   = {1.0f, 0.0f, 0.0f};
-    look_matrix = ca::Mat3f::Identity();
-    update_look_matrix(0.f, 0.f);
+    enter_level(game_level);
 
-    ca::Quat q_rotate = ca::axis_angle_quat({1.0f,0.0f,0.0f}, -1.0f);
+    if (bench) {
+        return finish_trace(run_benchmark());
+    }
+    if (scaling) {
+        return finish_trace(run_scaling_benchmark(scaling_max_triangles));
+    }
+    if (regress) {
+        return finish_trace(run_regression(regress_dir, regress_update));
+    }
 
-    drawInvertedCube(squares, ca::Vec3f{0.f,0.f,0.f}, ca::Mat3f::Identity());
+    if (replay_path and !input_log_load(replay_path)) {
+        debug_print("could not read input log %s\n", replay_path);
+        return 1;
+    }
+    if (record_path and !input_log_record_start(record_path)) {
+        debug_print("could not write input log %s\n", record_path);
+        return 1;
+    }
 
-    drawCube(squares, ca::Vec3f{0.f,0.f,0.f}, ca::RotationMat3f(q_rotate));
-    drawCube(squares, ca::Vec3f{-1.5f,0.0f,0.0f}, ca::RotationMat3f(q_rotate));
-    drawCube(squares, ca::Vec3f{ 1.5f,0.0f,0.0f}, ca::RotationMat3f(q_rotate));
+    // The window opens right away and shows an empty scene until the
+    // background build lands.
+    start_scene_build(make_game_scene());
+    Scene * scene = new Scene;
 
-    nanort::BVHBuildOptions<float> options;
-    NanortRenderData bunny_render_data = build_scene(bunny, options);
-    NanortRenderData squares_render_data = build_scene(squares, options);
-    // Initialize SDL
+    // Initialize SDL, unless replaying without a window
 
-    SDLWindowSurfacePair sdl_init_result = SDL_init_window();
-    SDL_Window * mainWindow = sdl_init_result.mainWindow;
-    SDL_Surface * screenSurface = sdl_init_result.screenSurface;
+    SDL_Window * mainWindow = NULL;
+    SDL_Surface * screenSurface = NULL;
+    if (!headless or !input_log.replaying) {
+        SDLWindowSurfacePair sdl_init_result = SDL_init_window();
+        mainWindow = sdl_init_result.mainWindow;
+        screenSurface = sdl_init_result.screenSurface;
+    }
 
     // SDL loop
     {
         SDL_Surface * renderedSurface = SDL_rendered_surface_init();
-        render_scene(width, height, squares_render_data, renderedSurface);
+        if (capture_frames) {
+            capture_start(capture_dir, capture_format, width, height);
+        }
+        render_scene(width, height, *scene, renderedSurface);
+        capture_frame(renderedSurface);
 
-        if (SDL_BlitScaled( renderedSurface, NULL, screenSurface, NULL )) {
-            printf("ERROR>>> %s\n", SDL_GetError());
+        if (mainWindow)
+        {
+            if (present_frame( renderedSurface, screenSurface )) {
+                printf("ERROR>>> %s\n", SDL_GetError());
+            }
+            SDL_SetRelativeMouseMode(SDL_TRUE);
+        }
+
+        if (perf) {
+            frame_perf_start();
         }
 
         SDL_Event e;
         bool quit = false;
+        unsigned long long frame = 0;
+        unsigned long long tick = 0;
+        std::vector<ReplayFrame> replay_frames;
+        const double ms_per_tick = 1000.0 / (double)SDL_GetPerformanceFrequency();
         //While application is running
         while( !quit )
         {
-            if ( SDL_PollEvent( &e ) != 0 )
+            if (input_log.replaying)
+            {
+                if (input_log_done())
+                {
+                    break;
+                }
+                tick = input_log_next_tick();
+                // a replay window only listens for being closed
+                while (mainWindow and SDL_PollEvent( &e ) != 0)
+                {
+                    quit = quit or e.type == SDL_QUIT;
+                }
+            }
+            // idle ticks are dropped, they would crowd everything else out
+            ca::ProfileZone frame_zone("frame");
+            frame_perf_begin();
+            CameraInput camera_input = camera_input_init();
+            bool had_events = false;
+            while ( input_log.replaying ? input_log_take_event(tick, &e)
+                                        : SDL_PollEvent( &e ) != 0 )
             {
-                do
+                had_events = true;
+                input_log_write_event(tick, e);
+                if( e.type == SDL_KEYDOWN )
                 {
-                    if( e.type == SDL_KEYDOWN )
-                    {
-                        //Select surfaces based on key press
-                        switch( e.key.keysym.sym ) {
-                            case SDLK_ESCAPE:
-                                quit = true;
-                                continue;
-                            case SDLK_w:
-                                eye += (forward * walk_speed);
-                                break;
-                            case SDLK_a:
-                                eye -= (right * walk_speed);
-                                break;
-                            case SDLK_s:
-                                eye -= (forward * walk_speed);
-                                break;
-                            case SDLK_d:
-                                eye += (right * walk_speed);
-                                break;
-                            case SDLK_LEFT:
-                                update_look_matrix( 0.0f,  0.1f);
-                                break;
-
-                            case SDLK_RIGHT:
-                                update_look_matrix( 0.0f, -0.1f);
-                                break;
-                            case SDLK_UP:
-                                update_look_matrix(-0.1f,  0.0f);
-                                break;
-
-                            case SDLK_DOWN:
-                                update_look_matrix( 0.1f,  0.0f);
-                                break;
+                    //Select surfaces based on key press
+                    switch( e.key.keysym.sym ) {
+                        case SDLK_ESCAPE:
+                            quit = true;
+                            continue;
+                        case SDLK_w:
+                            camera_input.move += (forward * walk_speed);
+                            break;
+                        case SDLK_a:
+                            camera_input.move -= (right * walk_speed);
+                            break;
+                        case SDLK_s:
+                            camera_input.move -= (forward * walk_speed);
+                            break;
+                        case SDLK_d:
+                            camera_input.move += (right * walk_speed);
+                            break;
+                        case SDLK_LEFT:
+                            camera_input.look_y += 0.1f;
+                            break;
+
+                        case SDLK_RIGHT:
+                            camera_input.look_y -= 0.1f;
+                            break;
+                        case SDLK_UP:
+                            camera_input.look_x -= 0.1f;
+                            break;
+
+                        case SDLK_DOWN:
+                            camera_input.look_x += 0.1f;
+                            break;
+                        case SDLK_r:
+                        {
+                            // rebuild in the background, frames keep going
+                            Scene * rebuilt = make_game_scene();
+                            if (input_log.replaying) {
+                                // the recorded one had its last build done
+                                wait_scene_build();
+                            }
+                            if (start_scene_build(rebuilt)) {
+                                input_log_write(tick, INPUT_RECORD_BUILD_START);
+                            } else {
+                                destroy_scene(rebuilt);
+                            }
+                            continue;
                         }
+                        case SDLK_e:
+                        {
+                            RenderObject cube;
+                            drawCube(cube, ca::Vec3f{0.0f, 0.0f, 0.0f}, ca::Mat3f::Identity(), 0.3f);
+                            ObjectTransform transform = identity_transform();
+                            transform.position = eye + forward * 1.5f;
+                            spawned_cubes.push_back(scene_add_object(*scene, cube, transform));
+                            continue;
+                        }
+                        case SDLK_q:
+                            if (!spawned_cubes.empty()) {
+                                scene_remove_object(*scene, spawned_cubes.back());
+                                spawned_cubes.pop_back();
+                            }
+                            continue;
+                        default:
+                            continue;
                     }
-                    else if( e.type == SDL_QUIT )
-                    {
-                        quit = true;
-                        continue;
-                    }
-                } while ( SDL_PollEvent( &e ) != 0 );
-                render_scene(width, height, squares_render_data, renderedSurface);
-                if (SDL_BlitScaled( renderedSurface, NULL, screenSurface, NULL )) {
+                    camera_input.num_events++;
+                    input_latency_stamp(e, INPUT_KIND_KEY, frame);
+                }
+                else if( e.type == SDL_MOUSEMOTION )
+                {
+                    camera_input.look_y -= e.motion.xrel * mouse_sensitivity;
+                    camera_input.look_x += e.motion.yrel * mouse_sensitivity;
+                    camera_input.num_events++;
+                    input_latency_stamp(e, INPUT_KIND_MOUSE, frame);
+                }
+                else if( e.type == SDL_QUIT )
+                {
+                    quit = true;
+                    continue;
+                }
+            }
+            bool redraw = had_events;
+            InputRecord swap_record;
+            const bool swapped = input_log.replaying
+                ? input_log_take(tick, INPUT_RECORD_SCENE_SWAP, INPUT_RECORD_SCENE_SWAP,
+                                 &swap_record) and wait_and_swap_built_scene(&scene)
+                : swap_built_scene(&scene);
+            if (swapped)
+            {
+                input_log_write(tick, INPUT_RECORD_SCENE_SWAP);
+                // handles into the old scene mean nothing now
+                spawned_cubes.clear();
+                redraw = true;
+                if (memory_report)
+                {
+                    print_memory_report(scene_memory_report(*scene));
+                }
+            }
+            if (scene_update(*scene))
+            {
+                redraw = true;
+            }
+            frame_perf_mark(FRAME_PHASE_EVENTS);
+            if (redraw)
+            {
+                apply_camera_input(camera_input);
+                const Uint64 render_start = SDL_GetPerformanceCounter();
+                render_scene(width, height, *scene, renderedSurface);
+                if (input_log.replaying)
+                {
+                    const ReplayFrame f = {
+                        (double)(SDL_GetPerformanceCounter() - render_start) * ms_per_tick, tick};
+                    replay_frames.push_back(f);
+                }
+                capture_frame(renderedSurface);
+                CA_PROFILE_ZONE("present");
+                if (mainWindow and present_frame( renderedSurface, screenSurface )) {
                     printf("ERROR>>> %s\n", SDL_GetError());
                 }
+                if (mainWindow)
+                {
+                    SDL_UpdateWindowSurface(mainWindow);
+                }
+            }
+            else
+            {
+                frame_zone.discard();
+                if (mainWindow)
+                {
+                    SDL_UpdateWindowSurface(mainWindow);
+                }
             }
-            SDL_UpdateWindowSurface(mainWindow);
+            frame_perf_mark(FRAME_PHASE_PRESENT);
+            frame_perf_end(redraw);
+            if (had_events)
+            {
+                input_latency_present(frame);
+                frame++;
+            }
+            tick++;
         }
+        input_latency_report();
+        input_log_replay_report(replay_frames);
+        frame_perf_report();
+        input_log_record_stop();
+        capture_stop();
     }
 
-    return 0;
+    finish_scene_build();
+    destroy_scene(scene);
+
+    return finish_trace(0);
 }
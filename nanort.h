@@ -41,6 +41,7 @@ THE SOFTWARE.
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
+#include <deque>
 #include <functional>
 #include <limits>
 #include <memory>
@@ -53,21 +54,51 @@ THE SOFTWARE.
 // NANORT_USE_CPP11_FEATURE : Enable C++11 feature
 // NANORT_ENABLE_PARALLEL_BUILD : Enable parallel BVH build.
 // NANORT_ENABLE_SERIALIZATION : Enable serialization feature for built BVH.
+// NANORT_NO_SSE2 : Use scalar code even if SSE2 is available.
+// NANORT_ENABLE_STACKLESS_TRAVERSAL : Traverse() walks parent links instead
+//                                     of keeping a per ray node stack.
+// NANORT_PROFILE_ZONE(name) : Statement opening a profiler zone named `name`
+//                             (a string literal) until the end of the
+//                             enclosing scope. Defined empty unless the
+//                             application provides one.
 //
-// Parallelized BVH build is supported on C++11 thread version.
-// OpenMP version is not fully tested.
+// Parallelized BVH build is supported on C++11 thread version: fork/join
+// tasks on a work stealing pool, with parallel binning and partitioning for
+// the top `shallow_depth` levels.
+// OpenMP version builds the top levels serially and the subtrees below them
+// in parallel. It is not fully tested.
 // thus turn off if you face a problem when building BVH in parallel.
 // #define NANORT_ENABLE_PARALLEL_BUILD
 
 // Some constants
 #define kNANORT_MIN_PRIMITIVES_FOR_PARALLEL_BUILD (1024 * 8)
 #define kNANORT_SHALLOW_DEPTH (4)  // will create 2**N subtrees
+#define kNANORT_MAX_ENTRY_NODES (4)  // max entry nodes for a beam of rays
+#define kNANORT_MIN_PRIMITIVES_FOR_PARALLEL_BINNING (1024 * 64)
+#define kNANORT_MIN_PRIMITIVES_FOR_TASK (512)  // smaller subtrees stay serial
+#define kNANORT_LAYOUT_BFS_DEPTH (6)  // levels BVH_LAYOUT_BREADTH_FIRST_TOP keeps
+#define kNANORT_LAYOUT_TREELET_NODES (8)  // nodes per BVH_LAYOUT_TREELET block
+#define kNANORT_CACHE_LINE_SIZE (64)
+
+#ifndef NANORT_PROFILE_ZONE
+#define NANORT_PROFILE_ZONE(name)
+#endif
+
+// SSE2 kernels for the float BVH build.
+#if !defined(NANORT_NO_SSE2) && \
+    (defined(__SSE2__) || defined(_M_X64) || \
+     (defined(_M_IX86_FP) && (_M_IX86_FP >= 2)))
+#define NANORT_USE_SSE2
+#include <emmintrin.h>
+#endif
 
 #ifdef NANORT_USE_CPP11_FEATURE
 // Assume C++11 compiler has thread support.
 // In some situation(e.g. embedded system, JIT compilation), thread feature
 // may not be available though...
 #include <atomic>
+#include <chrono>
+#include <condition_variable>
 #include <mutex>
 #include <thread>
 
@@ -92,6 +123,23 @@ typedef enum {
   RAY_TYPE_REFRACTION = 0x10
 } RayType;
 
+// Order of BVH nodes in memory. See BVHAccel::Relayout().
+typedef enum {
+  // As the build produced them: depth first for a serial build, sibling
+  // pairs in whatever order the tasks finished for the parallel one.
+  BVH_LAYOUT_BUILD_ORDER = 0,
+  // Pre-order, left child right after its parent.
+  BVH_LAYOUT_DEPTH_FIRST,
+  // The top kNANORT_LAYOUT_BFS_DEPTH levels breadth first(so the nodes every
+  // ray visits share a few pages), depth first below them.
+  BVH_LAYOUT_BREADTH_FIRST_TOP,
+  // Blocks of kNANORT_LAYOUT_TREELET_NODES nodes(whole cache lines), each
+  // filled with treelets: a node and the nodes breadth first below it, as
+  // many as fit in what is left of the block. Treelets are ordered depth
+  // first. One level of van Emde Boas layout.
+  BVH_LAYOUT_TREELET
+} BVHLayout;
+
 #ifdef __clang__
 #pragma clang diagnostic push
 #if __has_warning("-Wzero-as-null-pointer-constant")
@@ -481,8 +529,9 @@ class Ray {
   T dir[3];           // must set
   T min_t;            // minimum ray hit distance.
   T max_t;            // maximum ray hit distance.
-  T inv_dir[3];       // filled internally
-  int dir_sign[3];    // filled internally
+  T inv_dir[3];       // filled internally(or by the caller, see
+                      // BVHTraceOptions::use_ray_inv_dir)
+  int dir_sign[3];    // filled internally(ditto)
   unsigned int type;  // ray type
 
   // TODO(LTE): Align sizeof(Ray)
@@ -491,7 +540,13 @@ class Ray {
 template <typename T = float>
 class BVHNode {
  public:
-  BVHNode() {}
+  // Zeroed so that dummy, branch and leaf nodes pushed before all of their
+  // fields are known never copy indeterminate values.
+  BVHNode() : flag(0), axis(0) {
+    bmin[0] = bmin[1] = bmin[2] = static_cast<T>(0);
+    bmax[0] = bmax[1] = bmax[2] = static_cast<T>(0);
+    data[0] = data[1] = 0;
+  }
   BVHNode(const BVHNode &rhs) {
     bmin[0] = rhs.bmin[0];
     bmin[1] = rhs.bmin[1];
@@ -558,10 +613,22 @@ struct BVHBuildOptions {
   unsigned int shallow_depth;
   unsigned int min_primitives_for_parallel_build;
 
-  // Cache bounding box computation.
-  // Requires more memory, but BVHbuild can be faster.
+  // Most threads the C++11 build uses, counting the calling thread. 0 means
+  // one per hardware thread. Lower it to leave cores to other work, e.g.
+  // when building in the background while rendering.
+  unsigned int max_threads;
+
+  // Unused. Primitive bounds are now always cached during the build(and
+  // freed after it).
   bool cache_bbox;
-  unsigned char pad[3];
+
+  // Shrink the arrays the BVH keeps to their size after the build. See
+  // BVHAccel::Compact().
+  bool compact;
+  unsigned char pad[2];
+
+  // Node order to leave the tree in. See BVHAccel::Relayout().
+  BVHLayout layout;
 
   // Set default value: Taabb = 0.2
   BVHBuildOptions()
@@ -572,7 +639,10 @@ struct BVHBuildOptions {
         shallow_depth(kNANORT_SHALLOW_DEPTH),
         min_primitives_for_parallel_build(
             kNANORT_MIN_PRIMITIVES_FOR_PARALLEL_BUILD),
-        cache_bbox(false) {}
+        max_threads(0),
+        cache_bbox(false),
+        compact(false),
+        layout(BVH_LAYOUT_BUILD_ORDER) {}
 };
 
 /// BVH build statistics.
@@ -581,14 +651,63 @@ class BVHBuildStatistics {
   unsigned int max_tree_depth;
   unsigned int num_leaf_nodes;
   unsigned int num_branch_nodes;
-  float build_secs;
+  float build_secs;  // wall time of Build(), 0 without C++11
+
+  // Memory in bytes, counting allocated capacity. Build(), ReleaseIndices()
+  // and Compact() keep these current.
+  size_t node_bytes;
+  size_t index_bytes;
+  size_t parent_bytes;
+  size_t unused_bytes;  // capacity past the size, of the three arrays above
+  // Most Build() held at once: the arrays above plus its scratch(primitive
+  // bounds, bins, partition buffers, copies made by shrinking or
+  // relayout). Sampled between phases, so a vector reallocating while it
+  // grows is not counted.
+  size_t peak_build_bytes;
 
   // Set default value: Taabb = 0.2
   BVHBuildStatistics()
       : max_tree_depth(0),
         num_leaf_nodes(0),
         num_branch_nodes(0),
-        build_secs(0.0f) {}
+        build_secs(0.0f),
+        node_bytes(0),
+        index_bytes(0),
+        parent_bytes(0),
+        unused_bytes(0),
+        peak_build_bytes(0) {}
+};
+
+/// Nodes a coherent bundle of rays starts traversal from.
+/// Filled by BVHAccel::FindBeamEntryNodes(). Every primitive any ray of the
+/// bundle can hit lies below one of `nodes`, which are sorted near to far
+/// along the bundle's center direction. count = 0 means the bundle misses the
+/// BVH entirely.
+struct BVHEntryNodes {
+  unsigned int nodes[kNANORT_MAX_ENTRY_NODES];
+  unsigned int count;
+
+  BVHEntryNodes() : count(0) {}
+};
+
+/// Traversal work counters, filled when BVHTraceOptions::stats is set.
+/// Counters accumulate over calls, so one instance can sum up a whole frame.
+class BVHTraceStatistics {
+ public:
+  size_t num_rays;
+  size_t num_node_visits;      ///< nodes taken off the stack(or descended to)
+  size_t num_box_tests;        ///< IntersectRayAABB calls
+  size_t num_leaf_visits;
+  size_t num_primitive_tests;  ///< primitives in the visited leaves
+  size_t num_culled_nodes;     ///< stacked nodes skipped, entry t > hit t
+
+  BVHTraceStatistics()
+      : num_rays(0),
+        num_node_visits(0),
+        num_box_tests(0),
+        num_leaf_visits(0),
+        num_primitive_tests(0),
+        num_culled_nodes(0) {}
 };
 
 /// BVH trace option.
@@ -603,7 +722,19 @@ class BVHTraceOptions {
   unsigned int skip_prim_id;
 
   bool cull_back_face;
-  unsigned char pad[3];  ///< Padding(not used)
+
+  // Use `Ray::inv_dir` and `Ray::dir_sign` as given instead of computing them
+  // at the start of traversal. Useful when ray generation already produced
+  // them in bulk.
+  bool use_ray_inv_dir;
+  unsigned char pad[2];  ///< Padding(not used)
+
+  // Start traversal from these nodes instead of the root(NULL = root).
+  // Only valid for rays inside the beam the entry nodes were computed for.
+  const BVHEntryNodes *entry_nodes;
+
+  // Work counters to add to(NULL = don't count).
+  BVHTraceStatistics *stats;
 
   BVHTraceOptions() {
     prim_ids_range[0] = 0;
@@ -611,6 +742,9 @@ class BVHTraceOptions {
 
     skip_prim_id = static_cast<unsigned int>(-1);
     cull_back_face = false;
+    use_ray_inv_dir = false;
+    entry_nodes = NULL;
+    stats = NULL;
   }
 };
 
@@ -663,6 +797,378 @@ class NodeHitComparator {
   }
 };
 
+//
+// BVH build scratch
+//
+struct BinBuffer {
+  explicit BinBuffer(unsigned int size) {
+    bin_size = size;
+    bin.resize(2 * 3 * size);
+    clear();
+  }
+
+  void clear() { memset(&bin[0], 0, sizeof(unsigned int) * 2 * 3 * bin_size); }
+
+  // 32bit counters are enough since indices are 32bit too.
+  std::vector<unsigned int> bin;  // (min, max) * xyz * binsize
+  unsigned int bin_size;
+  unsigned int pad0;
+};
+
+///
+/// Primitive bounds cached for the build in SoA form. Stored by position in
+/// the index array(not by primitive id), so the primitives of a node are one
+/// contiguous range of each array. The builder swaps them along with the
+/// indices when partitioning.
+///
+template <typename T>
+struct BoundsSoA {
+  std::vector<T> bmin[3];
+  std::vector<T> bmax[3];
+
+  void resize(size_t n) {
+    for (int k = 0; k < 3; k++) {
+      bmin[k].resize(n);
+      bmax[k].resize(n);
+    }
+  }
+
+  /// Frees the memory(clear() would keep the capacity).
+  void release() {
+    for (int k = 0; k < 3; k++) {
+      std::vector<T>().swap(bmin[k]);
+      std::vector<T>().swap(bmax[k]);
+    }
+  }
+
+  size_t bytes() const {
+    size_t b = 0;
+    for (int k = 0; k < 3; k++) {
+      b += (bmin[k].capacity() + bmax[k].capacity()) * sizeof(T);
+    }
+    return b;
+  }
+
+  void set(size_t i, const real3<T> &lo, const real3<T> &hi) {
+    for (int k = 0; k < 3; k++) {
+      bmin[k][i] = lo[k];
+      bmax[k][i] = hi[k];
+    }
+  }
+
+  void swap(size_t i, size_t j) {
+    for (int k = 0; k < 3; k++) {
+      std::swap(bmin[k][i], bmin[k][j]);
+      std::swap(bmax[k][i], bmax[k][j]);
+    }
+  }
+};
+
+template <typename T>
+inline T ArrayMin(const T *v, size_t n) {
+  T r = v[0];
+  for (size_t i = 1; i < n; i++) {
+    if (v[i] < r) r = v[i];
+  }
+  return r;
+}
+
+template <typename T>
+inline T ArrayMax(const T *v, size_t n) {
+  T r = v[0];
+  for (size_t i = 1; i < n; i++) {
+    if (v[i] > r) r = v[i];
+  }
+  return r;
+}
+
+///
+/// Quantizes v[0, n) into [0, bin_size) by (v - offset) * scale and counts
+/// them in `counts`.
+///
+template <typename T>
+inline void AccumulateBins(unsigned int *counts, unsigned int bin_size,
+                           const T *v, size_t n, T offset, T scale) {
+  const T last = static_cast<T>(bin_size - 1);
+  for (size_t i = 0; i < n; i++) {
+    T q = (v[i] - offset) * scale;
+    q = (q > static_cast<T>(0.0)) ? q : static_cast<T>(0.0);  // also NaN
+    q = (q < last) ? q : last;
+    counts[static_cast<unsigned int>(q)] += 1;
+  }
+}
+
+#ifdef NANORT_USE_SSE2
+template <>
+inline float ArrayMin<float>(const float *v, size_t n) {
+  size_t i = 0;
+  float r = v[0];
+  if (n >= 4) {
+    __m128 m = _mm_loadu_ps(v);
+    for (i = 4; i + 4 <= n; i += 4) {
+      m = _mm_min_ps(m, _mm_loadu_ps(v + i));
+    }
+    m = _mm_min_ps(m, _mm_shuffle_ps(m, m, _MM_SHUFFLE(1, 0, 3, 2)));
+    m = _mm_min_ps(m, _mm_shuffle_ps(m, m, _MM_SHUFFLE(2, 3, 0, 1)));
+    r = _mm_cvtss_f32(m);
+  }
+  for (; i < n; i++) {
+    if (v[i] < r) r = v[i];
+  }
+  return r;
+}
+
+template <>
+inline float ArrayMax<float>(const float *v, size_t n) {
+  size_t i = 0;
+  float r = v[0];
+  if (n >= 4) {
+    __m128 m = _mm_loadu_ps(v);
+    for (i = 4; i + 4 <= n; i += 4) {
+      m = _mm_max_ps(m, _mm_loadu_ps(v + i));
+    }
+    m = _mm_max_ps(m, _mm_shuffle_ps(m, m, _MM_SHUFFLE(1, 0, 3, 2)));
+    m = _mm_max_ps(m, _mm_shuffle_ps(m, m, _MM_SHUFFLE(2, 3, 0, 1)));
+    r = _mm_cvtss_f32(m);
+  }
+  for (; i < n; i++) {
+    if (v[i] > r) r = v[i];
+  }
+  return r;
+}
+
+template <>
+inline void AccumulateBins<float>(unsigned int *counts, unsigned int bin_size,
+                                  const float *v, size_t n, float offset,
+                                  float scale) {
+  const __m128 offset4 = _mm_set1_ps(offset);
+  const __m128 scale4 = _mm_set1_ps(scale);
+  const __m128 zero4 = _mm_setzero_ps();
+  const __m128 last4 = _mm_set1_ps(static_cast<float>(bin_size - 1));
+
+  // Quantize 4 at a time, the scatter into the counters stays scalar.
+  size_t i = 0;
+  for (; i + 4 <= n; i += 4) {
+    __m128 q = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(v + i), offset4), scale4);
+    q = _mm_min_ps(_mm_max_ps(q, zero4), last4);  // max(NaN, 0) = 0
+
+    int idx[4];
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(idx), _mm_cvttps_epi32(q));
+    counts[idx[0]] += 1;
+    counts[idx[1]] += 1;
+    counts[idx[2]] += 1;
+    counts[idx[3]] += 1;
+  }
+
+  const float last = static_cast<float>(bin_size - 1);
+  for (; i < n; i++) {
+    float q = (v[i] - offset) * scale;
+    q = (q > 0.0f) ? q : 0.0f;
+    q = (q < last) ? q : last;
+    counts[static_cast<unsigned int>(q)] += 1;
+  }
+}
+#endif
+
+/// Bounds of the primitives at [left_index, right_index).
+template <typename T>
+inline void GetBoundingBox(real3<T> *bmin, real3<T> *bmax,
+                           const BoundsSoA<T> &bounds, unsigned int left_index,
+                           unsigned int right_index) {
+  const size_t n = right_index - left_index;
+  for (int k = 0; k < 3; k++) {
+    (*bmin)[k] = ArrayMin(&bounds.bmin[k][left_index], n);
+    (*bmax)[k] = ArrayMax(&bounds.bmax[k][left_index], n);
+  }
+}
+
+///
+/// std::partition of indices[left_idx, right_idx) by `pred` which also moves
+/// the cached bounds. Returns the index of the first primitive not
+/// satisfying `pred`.
+///
+template <typename T, class Pred>
+inline unsigned int PartitionPrimitives(unsigned int *indices,
+                                        BoundsSoA<T> *bounds,
+                                        unsigned int left_idx,
+                                        unsigned int right_idx,
+                                        const Pred &pred) {
+  unsigned int first = left_idx;
+  unsigned int last = right_idx;
+  for (;;) {
+    while (first != last && pred(indices[first])) {
+      first++;
+    }
+    if (first == last) break;
+    last--;
+    while (first != last && !pred(indices[last])) {
+      last--;
+    }
+    if (first == last) break;
+    std::swap(indices[first], indices[last]);
+    bounds->swap(first, last);
+    first++;
+  }
+  return first;
+}
+
+#ifdef NANORT_USE_CPP11_FEATURE
+/// Threads a build runs on: one per hardware thread, at most max_threads if
+/// that is set, and at most kNANORT_MAX_THREADS.
+inline size_t NumBuildThreads(unsigned int max_threads) {
+  size_t num_threads = std::min(
+      size_t(kNANORT_MAX_THREADS),
+      std::max(size_t(1), size_t(std::thread::hardware_concurrency())));
+  if (max_threads > 0 && max_threads < num_threads) {
+    num_threads = max_threads;
+  }
+  return num_threads;
+}
+
+/// Counts the unfinished tasks spawned into it.
+struct TaskGroup {
+  std::atomic<unsigned int> pending;
+
+  TaskGroup() : pending(0) {}
+};
+
+///
+/// Work stealing pool for fork/join style builds. Each thread(thread 0 is the
+/// one which created the pool) owns a deque: it pushes and pops its own tasks
+/// at the back, and idle threads steal the oldest(so usually the biggest)
+/// task of another thread from the front.
+/// Wait() runs tasks on the waiting thread, so tasks may wait on the tasks
+/// they spawned without blocking a worker. Workers with nothing to steal sleep
+/// until the next Spawn() instead of spinning.
+///
+class TaskPool {
+ public:
+  explicit TaskPool(size_t num_threads) : num_queued_(0), stop_(false) {
+    if (num_threads < 1) {
+      num_threads = 1;
+    }
+    for (size_t t = 0; t < num_threads; t++) {
+      queues_.push_back(std::unique_ptr<Queue>(new Queue()));
+    }
+    for (size_t t = 1; t < num_threads; t++) {
+      workers_.emplace_back(std::thread([this, t]() {
+        CurrentPool() = this;
+        CurrentIndex() = t;
+        while (!stop_.load(std::memory_order_acquire)) {
+          if (!RunOne()) {
+            std::unique_lock<std::mutex> lock(wake_mutex_);
+            wake_.wait(lock, [this]() {
+              return num_queued_.load(std::memory_order_acquire) > 0 ||
+                     stop_.load(std::memory_order_acquire);
+            });
+          }
+        }
+        CurrentPool() = NULL;
+      }));
+    }
+  }
+
+  ~TaskPool() {
+    {
+      std::lock_guard<std::mutex> lock(wake_mutex_);
+      stop_.store(true, std::memory_order_release);
+    }
+    wake_.notify_all();
+    for (auto &t : workers_) {
+      t.join();
+    }
+  }
+
+  size_t NumThreads() const { return queues_.size(); }
+
+  /// Index of the calling thread in [0, NumThreads()), for per-thread
+  /// scratch. Threads outside the pool count as thread 0.
+  size_t ThreadIndex() const {
+    return (CurrentPool() == this) ? CurrentIndex() : 0;
+  }
+
+  void Spawn(TaskGroup *group, std::function<void()> task) {
+    group->pending.fetch_add(1, std::memory_order_relaxed);
+    {
+      Queue &q = *queues_[ThreadIndex()];
+      std::lock_guard<std::mutex> lock(q.mutex);
+      q.tasks.push_back([group, task]() {
+        task();
+        group->pending.fetch_sub(1, std::memory_order_release);
+      });
+      num_queued_.fetch_add(1, std::memory_order_release);
+    }
+    // Taking the lock orders this against a worker between its check and its
+    // wait, so the wakeup can't be lost.
+    { std::lock_guard<std::mutex> lock(wake_mutex_); }
+    wake_.notify_one();
+  }
+
+  void Wait(TaskGroup *group) {
+    while (group->pending.load(std::memory_order_acquire) > 0) {
+      if (!RunOne()) {
+        std::this_thread::yield();
+      }
+    }
+  }
+
+ private:
+  struct Queue {
+    std::mutex mutex;
+    std::deque<std::function<void()> > tasks;
+  };
+
+  static TaskPool *&CurrentPool() {
+    static thread_local TaskPool *pool = NULL;
+    return pool;
+  }
+
+  static size_t &CurrentIndex() {
+    static thread_local size_t index = 0;
+    return index;
+  }
+
+  bool RunOne() {
+    const size_t self = ThreadIndex();
+    std::function<void()> task;
+    {
+      Queue &q = *queues_[self];
+      std::lock_guard<std::mutex> lock(q.mutex);
+      if (!q.tasks.empty()) {
+        task = std::move(q.tasks.back());
+        q.tasks.pop_back();
+        num_queued_.fetch_sub(1, std::memory_order_relaxed);
+      }
+    }
+    for (size_t k = 1; !task && k < queues_.size(); k++) {
+      Queue &q = *queues_[(self + k) % queues_.size()];
+      std::lock_guard<std::mutex> lock(q.mutex);
+      if (!q.tasks.empty()) {
+        task = std::move(q.tasks.front());
+        q.tasks.pop_front();
+        num_queued_.fetch_sub(1, std::memory_order_relaxed);
+      }
+    }
+    if (!task) {
+      return false;
+    }
+    task();
+    return true;
+  }
+
+  std::vector<std::unique_ptr<Queue> > queues_;
+  std::vector<std::thread> workers_;
+  std::atomic<size_t> num_queued_;  // tasks in all queues
+  std::mutex wake_mutex_;
+  std::condition_variable wake_;
+  std::atomic<bool> stop_;
+};
+
+#endif
+
+template <typename T>
+class RayAABBTester;
+
 template <typename T>
 class BVHAccel {
  public:
@@ -681,6 +1187,25 @@ class BVHAccel {
   ///
   BVHBuildStatistics GetStatistics() const { return stats_; }
 
+  ///
+  /// Reorders nodes in memory(child indices and parents follow), e.g. to cut
+  /// cache and TLB misses during traversal of big trees. Traversal results
+  /// don't change. BVH_LAYOUT_TREELET blocks are aligned for the storage
+  /// Relayout() allocates; a copy of the BVHAccel keeps the order, not
+  /// necessarily the alignment.
+  ///
+  void Relayout(BVHLayout layout);
+
+  ///
+  /// Recomputes every node's bounds from the current bounds of its
+  /// primitives(`p` as given to Build()), keeping the tree as it is. For
+  /// primitives that moved without being added or removed, e.g. a rigid
+  /// transform. O(n), but the tree is not rebalanced: after big deformations
+  /// a rebuild traces faster.
+  ///
+  template <class P>
+  void Refit(const P &p);
+
 #if defined(NANORT_ENABLE_SERIALIZATION)
   ///
   /// Dump built BVH to the file.
@@ -705,6 +1230,27 @@ class BVHAccel {
   bool Traverse(const Ray<T> &ray, const I &intersector, H *isect,
                 const BVHTraceOptions &options = BVHTraceOptions()) const;
 
+  ///
+  /// Same result as Traverse(), but tests both child boxes of a branch before
+  /// descending: only hit children are visited, nearest entry first, and the
+  /// far child is dropped when popped if a closer hit was found meanwhile.
+  /// Fewer box tests for closest hit queries(slightly more work per branch).
+  ///
+  template <class I, class H>
+  bool TraverseOrdered(const Ray<T> &ray, const I &intersector, H *isect,
+                       const BVHTraceOptions &options = BVHTraceOptions()) const;
+
+  ///
+  /// Same result as Traverse(), without a node stack: walks down to the near
+  /// child and back up through parent links(Hapala et al. 2011), so the whole
+  /// per ray state is the current node and where it was entered from.
+  /// Traverse() uses this when NANORT_ENABLE_STACKLESS_TRAVERSAL is defined.
+  ///
+  template <class I, class H>
+  bool TraverseStackless(
+      const Ray<T> &ray, const I &intersector, H *isect,
+      const BVHTraceOptions &options = BVHTraceOptions()) const;
+
 #if 0
   /// Multi-hit ray traversal
   /// Returns `max_intersections` frontmost intersections
@@ -716,6 +1262,18 @@ class BVHAccel {
                         const BVHTraceOptions &options = BVHTraceOptions()) const;
 #endif
 
+  ///
+  /// Beam culling for coherent rays sharing origin `org` whose directions are
+  /// convex combinations of the four `corner_dirs`(given in order around the
+  /// beam, e.g. the corner pixels of a screen tile). Walks down from the root
+  /// while the beam overlaps only one child(or while there is room in
+  /// `entry_nodes` to split), so rays of the beam can skip the upper levels.
+  ///
+  void FindBeamEntryNodes(const T org[3], const T corner_dirs[4][3],
+                          BVHEntryNodes *entry_nodes,
+                          unsigned int max_entry_nodes =
+                              kNANORT_MAX_ENTRY_NODES) const;
+
   ///
   /// List up nodes which intersects along the ray.
   /// This function is useful for two-level BVH traversal.
@@ -728,6 +1286,27 @@ class BVHAccel {
   const std::vector<BVHNode<T> > &GetNodes() const { return nodes_; }
   const std::vector<unsigned int> &GetIndices() const { return indices_; }
 
+  ///
+  /// Frees the primitive index array. Call it once the primitives have been
+  /// permuted into leaf order: primitive i is the one GetIndices()[i] was
+  /// before the call. Leaves then address their primitives directly(as one
+  /// contiguous range) and GetIndices() is empty.
+  ///
+  void ReleaseIndices() {
+    std::vector<unsigned int>().swap(indices_);
+    CountMemory();
+  }
+
+  ///
+  /// Frees what only the build needed and shrinks the node, index and
+  /// parent arrays to their size. Build() calls it when
+  /// BVHBuildOptions::compact is set.
+  ///
+  void Compact();
+
+  /// Parent of each node(the root is its own parent).
+  const std::vector<unsigned int> &GetParents() const { return parents_; }
+
   ///
   /// Returns bounding box of built BVH.
   ///
@@ -759,20 +1338,86 @@ class BVHAccel {
   std::vector<ShallowNodeInfo> shallow_node_infos_;
 
   /// Builds shallow BVH tree recursively.
-  template <class P, class Pred>
+  template <class Pred>
   unsigned int BuildShallowTree(std::vector<BVHNode<T> > *out_nodes,
-                                unsigned int left_idx, unsigned int right_idx,
-                                unsigned int depth,
-                                unsigned int max_shallow_depth, const P &p,
+                                BinBuffer *bins, unsigned int left_idx,
+                                unsigned int right_idx, unsigned int depth,
+                                unsigned int max_shallow_depth,
                                 const Pred &pred);
 #endif
 
-  /// Builds BVH tree recursively.
-  template <class P, class Pred>
+#if defined(NANORT_USE_CPP11_FEATURE) && defined(NANORT_ENABLE_PARALLEL_BUILD)
+  /// Shared state of the task parallel build. Node slots are handed out with
+  /// an atomic counter, two at a time so siblings are always adjacent.
+  struct TaskBuildState {
+    TaskPool *pool;
+    TaskGroup subtrees;
+    std::vector<BinBuffer> bins;  // one per pool thread
+
+    // Output of the parallel partition at the top levels.
+    std::vector<unsigned int> scratch_indices;
+    BoundsSoA<T> scratch_bounds;
+
+    std::atomic<unsigned int> num_nodes;
+    std::atomic<unsigned int> max_tree_depth;
+    std::atomic<unsigned int> num_leaf_nodes;
+    std::atomic<unsigned int> num_branch_nodes;
+
+    explicit TaskBuildState(TaskPool *task_pool)
+        : pool(task_pool),
+          num_nodes(0),
+          max_tree_depth(0),
+          num_leaf_nodes(0),
+          num_branch_nodes(0) {}
+  };
+
+  /// Builds the subtree of [left_idx, right_idx) into nodes_[node_index].
+  /// Bins and partitions in parallel above `shallow_depth`, and forks big
+  /// subtrees into tasks.
+  template <class Pred>
+  void BuildTreeTasks(TaskBuildState *state, unsigned int node_index,
+                      unsigned int left_idx, unsigned int right_idx,
+                      unsigned int depth, const Pred &pred);
+#endif
+
+  /// Fills parents_ from nodes_.
+  void BuildParents();
+
+  /// Bytes of the arrays the BVH keeps plus the build's bounds cache.
+  size_t HeldBytes() const {
+    return nodes_.capacity() * sizeof(BVHNode<T>) +
+           indices_.capacity() * sizeof(unsigned int) +
+           parents_.capacity() * sizeof(unsigned int) + bounds_.bytes();
+  }
+
+  /// Fills the memory fields of stats_ but peak_build_bytes.
+  void CountMemory();
+
+  /// Appends the subtree below `root` to `order` in pre-order.
+  void LayoutDepthFirst(unsigned int root,
+                        std::vector<unsigned int> *order) const;
+
+  /// Treelet order for blocks starting at indices equal to `phase` modulo
+  /// kNANORT_LAYOUT_TREELET_NODES.
+  void LayoutTreelets(size_t phase, std::vector<unsigned int> *order) const;
+
+  /// Writes the nodes to `out` in `order`, with child indices remapped.
+  void ApplyNodeOrder(const std::vector<unsigned int> &order,
+                      std::vector<BVHNode<T> > *out) const;
+
+  template <class I>
+  void TraverseSubtreeStackless(unsigned int root, const Ray<T> &ray,
+                                const I &intersector, T *hit_t,
+                                const RayAABBTester<T> &box_test,
+                                const int dir_sign[3],
+                                BVHTraceStatistics *stats) const;
+
+  /// Builds BVH tree recursively. `bins` is scratch reused by every node.
+  template <class Pred>
   unsigned int BuildTree(BVHBuildStatistics *out_stat,
-                         std::vector<BVHNode<T> > *out_nodes,
+                         std::vector<BVHNode<T> > *out_nodes, BinBuffer *bins,
                          unsigned int left_idx, unsigned int right_idx,
-                         unsigned int depth, const P &p, const Pred &pred);
+                         unsigned int depth, const Pred &pred);
 
   template <class I>
   bool TestLeafNode(const BVHNode<T> &node, const Ray<T> &ray,
@@ -794,15 +1439,122 @@ class BVHAccel {
 #endif
 
   std::vector<BVHNode<T> > nodes_;
-  std::vector<unsigned int> indices_;  // max 4G triangles.
-  std::vector<BBox<T> > bboxes_;
+  std::vector<unsigned int> indices_;  // max 4G triangles. Empty = identity.
+  std::vector<unsigned int> parents_;
+  BoundsSoA<T> bounds_;  // Used only during BVH construction
   BVHBuildOptions<T> options_;
   BVHBuildStatistics stats_;
   unsigned int pad0_;
 };
 
-// Predefined SAH predicator for triangle.
+/// Vertex positions as T[3], one every `stride_bytes` bytes. What
+/// TriangleSAHPred, TriangleMesh and TriangleIntersector read unless given
+/// another vertex source.
+template <typename T = float>
+class StridedVertices {
+ public:
+  StridedVertices(const T *vertices, size_t stride_bytes)
+      : vertices_(vertices), stride_bytes_(stride_bytes) {}
+
+  real3<T> operator[](unsigned int i) const {
+    return real3<T>(get_vertex_addr<T>(vertices_, i, stride_bytes_));
+  }
+
+ private:
+  const T *vertices_;
+  size_t stride_bytes_;
+};
+
+/// Vertex positions as three 16-bit coordinates on a grid over the mesh
+/// bounds: position = origin + q * step, half the size of float positions.
+/// Quantize() picks power of two steps and an origin on the grid, so the
+/// dequantization is exact. Every reader(the build, refits, the
+/// intersector) then gets the very same T for a vertex, triangles sharing
+/// an edge still meet exactly(the intersector stays watertight) and bounds
+/// computed from the vertices hold for the intersector.
 template <typename T = float>
+class QuantizedVertices {
+ public:
+  QuantizedVertices() : data_(NULL) {
+    origin_[0] = origin_[1] = origin_[2] = static_cast<T>(0.0);
+    step_[0] = step_[1] = step_[2] = static_cast<T>(1.0);
+  }
+
+  real3<T> operator[](unsigned int i) const {
+    const unsigned short *q = data_ + 3 * i;
+    return real3<T>(origin_[0] + static_cast<T>(q[0]) * step_[0],
+                    origin_[1] + static_cast<T>(q[1]) * step_[1],
+                    origin_[2] + static_cast<T>(q[2]) * step_[2]);
+  }
+
+  /// Quantizes `num_vertices` positions(T[3] every `stride_bytes` bytes) to
+  /// `out`, 3 values per vertex. Each position moves by at most half a step.
+  /// The result points into `out`, which must outlive it and not be resized.
+  static QuantizedVertices Quantize(const T *vertices, size_t num_vertices,
+                                    size_t stride_bytes,
+                                    std::vector<unsigned short> *out) {
+    QuantizedVertices q;
+    out->resize(3 * num_vertices);
+    if (num_vertices == 0) {
+      return q;
+    }
+
+    T bmin[3], bmax[3];
+    for (int k = 0; k < 3; k++) {
+      bmin[k] = bmax[k] = vertices[k];
+    }
+    for (size_t i = 1; i < num_vertices; i++) {
+      const T *p = get_vertex_addr<T>(vertices, i, stride_bytes);
+      for (int k = 0; k < 3; k++) {
+        bmin[k] = std::min(bmin[k], p[k]);
+        bmax[k] = std::max(bmax[k], p[k]);
+      }
+    }
+
+    // origin / step + q has to stay an integer T holds exactly
+    const T max_exact = static_cast<T>(
+        (1ull << std::numeric_limits<T>::digits) - 65536);
+    for (int k = 0; k < 3; k++) {
+      const T extent = bmax[k] - bmin[k];
+      T step = static_cast<T>(1.0);
+      // smallest power of two that spans the extent in 65535 steps
+      while (step * static_cast<T>(65535.0) > extent &&
+             step > std::numeric_limits<T>::min()) {
+        step *= static_cast<T>(0.5);
+      }
+      for (;;) {
+        const T cells = std::floor(bmin[k] / step);
+        if (cells * step + step * static_cast<T>(65535.0) >= bmax[k] &&
+            std::fabs(cells) < max_exact) {
+          q.origin_[k] = cells * step;
+          break;
+        }
+        step *= static_cast<T>(2.0);
+      }
+      q.step_[k] = step;
+    }
+
+    for (size_t i = 0; i < num_vertices; i++) {
+      const T *p = get_vertex_addr<T>(vertices, i, stride_bytes);
+      for (int k = 0; k < 3; k++) {
+        T c = std::floor((p[k] - q.origin_[k]) / q.step_[k] +
+                         static_cast<T>(0.5));
+        c = std::max(static_cast<T>(0.0), std::min(static_cast<T>(65535.0), c));
+        (*out)[3 * i + k] = static_cast<unsigned short>(c);
+      }
+    }
+    q.data_ = out->data();
+    return q;
+  }
+
+ private:
+  const unsigned short *data_;
+  T origin_[3];
+  T step_[3];
+};
+
+// Predefined SAH predicator for triangle.
+template <typename T = float, class VertexSource = StridedVertices<T> >
 class TriangleSAHPred {
  public:
   TriangleSAHPred(
@@ -810,26 +1562,14 @@ class TriangleSAHPred {
       size_t vertex_stride_bytes)  // e.g. 12 for sizeof(float) * XYZ
       : axis_(0),
         pos_(static_cast<T>(0.0)),
-        vertices_(vertices),
-        faces_(faces),
-        vertex_stride_bytes_(vertex_stride_bytes) {}
-
-  TriangleSAHPred(const TriangleSAHPred<T> &rhs)
-      : axis_(rhs.axis_),
-        pos_(rhs.pos_),
-        vertices_(rhs.vertices_),
-        faces_(rhs.faces_),
-        vertex_stride_bytes_(rhs.vertex_stride_bytes_) {}
-
-  TriangleSAHPred<T> &operator=(const TriangleSAHPred<T> &rhs) {
-    axis_ = rhs.axis_;
-    pos_ = rhs.pos_;
-    vertices_ = rhs.vertices_;
-    faces_ = rhs.faces_;
-    vertex_stride_bytes_ = rhs.vertex_stride_bytes_;
+        vertices_(vertices, vertex_stride_bytes),
+        faces_(faces) {}
 
-    return (*this);
-  }
+  TriangleSAHPred(const VertexSource &vertices, const unsigned int *faces)
+      : axis_(0),
+        pos_(static_cast<T>(0.0)),
+        vertices_(vertices),
+        faces_(faces) {}
 
   void Set(int axis, T pos) const {
     axis_ = axis;
@@ -844,9 +1584,9 @@ class TriangleSAHPred {
     unsigned int i1 = faces_[3 * i + 1];
     unsigned int i2 = faces_[3 * i + 2];
 
-    real3<T> p0(get_vertex_addr<T>(vertices_, i0, vertex_stride_bytes_));
-    real3<T> p1(get_vertex_addr<T>(vertices_, i1, vertex_stride_bytes_));
-    real3<T> p2(get_vertex_addr<T>(vertices_, i2, vertex_stride_bytes_));
+    const real3<T> p0 = vertices_[i0];
+    const real3<T> p1 = vertices_[i1];
+    const real3<T> p2 = vertices_[i2];
 
     T center = p0[axis] + p1[axis] + p2[axis];
 
@@ -856,60 +1596,45 @@ class TriangleSAHPred {
  private:
   mutable int axis_;
   mutable T pos_;
-  const T *vertices_;
+  VertexSource vertices_;
   const unsigned int *faces_;
-  const size_t vertex_stride_bytes_;
 };
 
 // Predefined Triangle mesh geometry.
-template <typename T = float>
+template <typename T = float, class VertexSource = StridedVertices<T> >
 class TriangleMesh {
  public:
   TriangleMesh(
       const T *vertices, const unsigned int *faces,
       const size_t vertex_stride_bytes)  // e.g. 12 for sizeof(float) * XYZ
-      : vertices_(vertices),
-        faces_(faces),
-        vertex_stride_bytes_(vertex_stride_bytes) {}
+      : vertices_(vertices, vertex_stride_bytes),
+        faces_(faces) {}
+
+  TriangleMesh(const VertexSource &vertices, const unsigned int *faces)
+      : vertices_(vertices), faces_(faces) {}
 
   /// Compute bounding box for `prim_index`th triangle.
   /// This function is called for each primitive in BVH build.
   void BoundingBox(real3<T> *bmin, real3<T> *bmax,
                    unsigned int prim_index) const {
-    (*bmin)[0] = get_vertex_addr(vertices_, faces_[3 * prim_index + 0],
-                                 vertex_stride_bytes_)[0];
-    (*bmin)[1] = get_vertex_addr(vertices_, faces_[3 * prim_index + 0],
-                                 vertex_stride_bytes_)[1];
-    (*bmin)[2] = get_vertex_addr(vertices_, faces_[3 * prim_index + 0],
-                                 vertex_stride_bytes_)[2];
-    (*bmax)[0] = get_vertex_addr(vertices_, faces_[3 * prim_index + 0],
-                                 vertex_stride_bytes_)[0];
-    (*bmax)[1] = get_vertex_addr(vertices_, faces_[3 * prim_index + 0],
-                                 vertex_stride_bytes_)[1];
-    (*bmax)[2] = get_vertex_addr(vertices_, faces_[3 * prim_index + 0],
-                                 vertex_stride_bytes_)[2];
+    (*bmin) = vertices_[faces_[3 * prim_index + 0]];
+    (*bmax) = (*bmin);
 
     for (unsigned int i = 1; i < 3; i++) {
-      for (unsigned int k = 0; k < 3; k++) {
-        if ((*bmin)[static_cast<int>(k)] >
-            get_vertex_addr<T>(vertices_, faces_[3 * prim_index + i],
-                               vertex_stride_bytes_)[k]) {
-          (*bmin)[static_cast<int>(k)] = get_vertex_addr<T>(
-              vertices_, faces_[3 * prim_index + i], vertex_stride_bytes_)[k];
+      const real3<T> p = vertices_[faces_[3 * prim_index + i]];
+      for (int k = 0; k < 3; k++) {
+        if ((*bmin)[k] > p[k]) {
+          (*bmin)[k] = p[k];
         }
-        if ((*bmax)[static_cast<int>(k)] <
-            get_vertex_addr<T>(vertices_, faces_[3 * prim_index + i],
-                               vertex_stride_bytes_)[k]) {
-          (*bmax)[static_cast<int>(k)] = get_vertex_addr<T>(
-              vertices_, faces_[3 * prim_index + i], vertex_stride_bytes_)[k];
+        if ((*bmax)[k] < p[k]) {
+          (*bmax)[k] = p[k];
         }
       }
     }
   }
 
-  const T *vertices_;
+  VertexSource vertices_;
   const unsigned int *faces_;
-  const size_t vertex_stride_bytes_;
 };
 
 template <typename T = float>
@@ -923,7 +1648,10 @@ class TriangleIntersection {
   unsigned int prim_id;
 };
 
-template <typename T = float, class H = TriangleIntersection<T> >
+/// Watertight ray/triangle test. Vertices come from `VertexSource`
+/// (StridedVertices or QuantizedVertices), the test is the same for either.
+template <typename T = float, class H = TriangleIntersection<T>,
+          class VertexSource = StridedVertices<T> >
 class TriangleIntersector {
  public:
   TriangleIntersector(const T *vertices, const unsigned int *faces,
@@ -931,9 +1659,11 @@ class TriangleIntersector {
                                                          // vertex_stride_bytes
                                                          // = 12 = sizeof(float)
                                                          // * 3
-      : vertices_(vertices),
-        faces_(faces),
-        vertex_stride_bytes_(vertex_stride_bytes) {}
+      : vertices_(vertices, vertex_stride_bytes),
+        faces_(faces) {}
+
+  TriangleIntersector(const VertexSource &vertices, const unsigned int *faces)
+      : vertices_(vertices), faces_(faces) {}
 
   // For Watertight Ray/Triangle Intersection.
   typedef struct {
@@ -964,9 +1694,9 @@ class TriangleIntersector {
     const unsigned int f1 = faces_[3 * prim_index + 1];
     const unsigned int f2 = faces_[3 * prim_index + 2];
 
-    const real3<T> p0(get_vertex_addr(vertices_, f0 + 0, vertex_stride_bytes_));
-    const real3<T> p1(get_vertex_addr(vertices_, f1 + 0, vertex_stride_bytes_));
-    const real3<T> p2(get_vertex_addr(vertices_, f2 + 0, vertex_stride_bytes_));
+    const real3<T> p0 = vertices_[f0];
+    const real3<T> p1 = vertices_[f1];
+    const real3<T> p2 = vertices_[f2];
 
     const real3<T> A = p0 - ray_org_;
     const real3<T> B = p1 - ray_org_;
@@ -1115,9 +1845,8 @@ class TriangleIntersector {
   }
 
  private:
-  const T *vertices_;
+  VertexSource vertices_;
   const unsigned int *faces_;
-  const size_t vertex_stride_bytes_;
 
   mutable real3<T> ray_org_;
   mutable RayCoeff ray_coeff_;
@@ -1147,20 +1876,6 @@ const T &safemax(const T &a, const T &b) {
 //
 // SAH functions
 //
-struct BinBuffer {
-  explicit BinBuffer(unsigned int size) {
-    bin_size = size;
-    bin.resize(2 * 3 * size);
-    clear();
-  }
-
-  void clear() { memset(&bin[0], 0, sizeof(size_t) * 2 * 3 * bin_size); }
-
-  std::vector<size_t> bin;  // (min, max) * xyz * binsize
-  unsigned int bin_size;
-  unsigned int pad0;
-};
-
 template <typename T>
 inline T CalculateSurfaceArea(const real3<T> &min, const real3<T> &max) {
   real3<T> box = max - min;
@@ -1197,12 +1912,12 @@ inline void GetBoundingBoxOfTriangle(real3<T> *bmin, real3<T> *bmax,
   }
 }
 
-template <typename T, class P>
+template <typename T>
 inline void ContributeBinBuffer(BinBuffer *bins,  // [out]
                                 const real3<T> &scene_min,
                                 const real3<T> &scene_max,
-                                unsigned int *indices, unsigned int left_idx,
-                                unsigned int right_idx, const P &p) {
+                                const BoundsSoA<T> &bounds,
+                                unsigned int left_idx, unsigned int right_idx) {
   T bin_size = static_cast<T>(bins->bin_size);
 
   // Calculate extent
@@ -1219,51 +1934,23 @@ inline void ContributeBinBuffer(BinBuffer *bins,  // [out]
   }
 
   // Clear bin data
-  std::fill(bins->bin.begin(), bins->bin.end(), 0);
-  // memset(&bins->bin[0], 0, sizeof(2 * 3 * bins->bin_size));
-
-  size_t idx_bmin[3];
-  size_t idx_bmax[3];
-
-  for (size_t i = left_idx; i < right_idx; i++) {
-    //
-    // Quantize the position into [0, BIN_SIZE)
-    //
-    // q[i] = (int)(p[i] - scene_bmin) / scene_size
-    //
-    real3<T> bmin;
-    real3<T> bmax;
-
-    p.BoundingBox(&bmin, &bmax, indices[i]);
-    // GetBoundingBoxOfTriangle(&bmin, &bmax, vertices, faces, indices[i]);
-
-    real3<T> quantized_bmin = (bmin - scene_min) * scene_inv_size;
-    real3<T> quantized_bmax = (bmax - scene_min) * scene_inv_size;
+  bins->clear();
 
-    // idx is now in [0, BIN_SIZE)
-    for (int j = 0; j < 3; ++j) {
-      int q0 = static_cast<int>(quantized_bmin[j]);
-      if (q0 < 0) q0 = 0;
-      int q1 = static_cast<int>(quantized_bmax[j]);
-      if (q1 < 0) q1 = 0;
-
-      idx_bmin[j] = static_cast<unsigned int>(q0);
-      idx_bmax[j] = static_cast<unsigned int>(q1);
-
-      if (idx_bmin[j] >= bin_size)
-        idx_bmin[j] = static_cast<unsigned int>(bin_size) - 1;
-      if (idx_bmax[j] >= bin_size)
-        idx_bmax[j] = static_cast<unsigned int>(bin_size) - 1;
-
-      assert(idx_bmin[j] < bin_size);
-      assert(idx_bmax[j] < bin_size);
-
-      // Increment bin counter
-      bins->bin[0 * (bins->bin_size * 3) +
-                static_cast<size_t>(j) * bins->bin_size + idx_bmin[j]] += 1;
-      bins->bin[1 * (bins->bin_size * 3) +
-                static_cast<size_t>(j) * bins->bin_size + idx_bmax[j]] += 1;
-    }
+  //
+  // Quantize the position into [0, BIN_SIZE)
+  //
+  // q[i] = (int)(p[i] - scene_bmin) / scene_size
+  //
+  const size_t n = right_idx - left_idx;
+  for (int j = 0; j < 3; ++j) {
+    AccumulateBins(&bins->bin[0 * (bins->bin_size * 3) +
+                              static_cast<size_t>(j) * bins->bin_size],
+                   bins->bin_size, &bounds.bmin[j][left_idx], n, scene_min[j],
+                   scene_inv_size[j]);
+    AccumulateBins(&bins->bin[1 * (bins->bin_size * 3) +
+                              static_cast<size_t>(j) * bins->bin_size],
+                   bins->bin_size, &bounds.bmax[j][left_idx], n, scene_min[j],
+                   scene_inv_size[j]);
   }
 }
 
@@ -1383,187 +2070,177 @@ inline bool FindCutFromBinBuffer(T *cut_pos,        // [out] xyz
   return true;
 }
 
-#ifdef _OPENMP
-template <typename T, class P>
-void ComputeBoundingBoxOMP(real3<T> *bmin, real3<T> *bmax,
-                           const unsigned int *indices, unsigned int left_index,
-                           unsigned int right_index, const P &p) {
-  { p.BoundingBox(bmin, bmax, indices[left_index]); }
-
-  T local_bmin[3] = {(*bmin)[0], (*bmin)[1], (*bmin)[2]};
-  T local_bmax[3] = {(*bmax)[0], (*bmax)[1], (*bmax)[2]};
-
-  unsigned int n = right_index - left_index;
-
-#pragma omp parallel firstprivate(local_bmin, local_bmax) if (n > (1024 * 128))
-  {
-#pragma omp parallel for
-    for (int i = int(left_index); i < int(right_index);
-         i++) {  // for each faces
-      unsigned int idx = indices[i];
-
-      real3<T> bbox_min, bbox_max;
-      p.BoundingBox(&bbox_min, &bbox_max, idx);
-      for (int k = 0; k < 3; k++) {  // xyz
-        if ((*bmin)[k] > bbox_min[k]) (*bmin)[k] = bbox_min[k];
-        if ((*bmax)[k] < bbox_max[k]) (*bmax)[k] = bbox_max[k];
-      }
-    }
-
-#pragma omp critical
-    {
-      for (int k = 0; k < 3; k++) {
-        if (local_bmin[k] < (*bmin)[k]) {
-          {
-            if (local_bmin[k] < (*bmin)[k]) (*bmin)[k] = local_bmin[k];
-          }
-        }
-
-        if (local_bmax[k] > (*bmax)[k]) {
-          {
-            if (local_bmax[k] > (*bmax)[k]) (*bmax)[k] = local_bmax[k];
-          }
-        }
-      }
-    }
-  }
-}
-#endif
-
 #ifdef NANORT_USE_CPP11_FEATURE
-template <typename T, class P>
-inline void ComputeBoundingBoxThreaded(real3<T> *bmin, real3<T> *bmax,
-                                       const unsigned int *indices,
-                                       unsigned int left_index,
-                                       unsigned int right_index, const P &p) {
-  unsigned int n = right_index - left_index;
-
-  size_t num_threads = std::min(
-      size_t(kNANORT_MAX_THREADS),
-      std::max(size_t(1), size_t(std::thread::hardware_concurrency())));
-  if (n < num_threads) {
-    num_threads = n;
-  }
-
-  std::vector<std::thread> workers;
-
-  size_t ndiv = n / num_threads;
-
-  std::vector<T> local_bmins(3 * num_threads);  // 3 = xyz
-  std::vector<T> local_bmaxs(3 * num_threads);  // 3 = xyz
-
-  for (size_t t = 0; t < num_threads; t++) {
-    workers.emplace_back(std::thread([&, t]() {
-      size_t si = left_index + t * ndiv;
-      size_t ei = std::min(left_index + (t + 1) * ndiv, size_t(right_index));
-
-      local_bmins[3 * t + 0] = std::numeric_limits<T>::infinity();
-      local_bmins[3 * t + 1] = std::numeric_limits<T>::infinity();
-      local_bmins[3 * t + 2] = std::numeric_limits<T>::infinity();
-      local_bmaxs[3 * t + 0] = -std::numeric_limits<T>::infinity();
-      local_bmaxs[3 * t + 1] = -std::numeric_limits<T>::infinity();
-      local_bmaxs[3 * t + 2] = -std::numeric_limits<T>::infinity();
-
-      for (size_t i = si; i < ei; i++) {  // for each faces
-        unsigned int idx = indices[i];
-
-        real3<T> bbox_min, bbox_max;
-        p.BoundingBox(&bbox_min, &bbox_max, idx);
-        for (size_t k = 0; k < 3; k++) {  // xyz
-          if (local_bmins[3 * t + k] > bbox_min[int(k)])
-            local_bmins[3 * t + k] = bbox_min[int(k)];
-          if (local_bmaxs[3 * t + k] < bbox_max[int(k)])
-            local_bmaxs[3 * t + k] = bbox_max[int(k)];
-        }
-      }
-    }));
+/// Splits [left_index, right_index) into a few chunks per thread.
+inline unsigned int NumTaskChunks(const TaskPool *pool,
+                                  unsigned int left_index,
+                                  unsigned int right_index) {
+  const size_t n = right_index - left_index;
+  size_t num_chunks = 2 * pool->NumThreads();
+  if (num_chunks > n) {
+    num_chunks = n;
   }
+  return static_cast<unsigned int>(std::max(size_t(1), num_chunks));
+}
 
-  for (auto &t : workers) {
-    t.join();
-  }
+inline unsigned int TaskChunkBegin(unsigned int chunk, unsigned int num_chunks,
+                                   unsigned int left_index,
+                                   unsigned int right_index) {
+  const size_t n = right_index - left_index;
+  return left_index + static_cast<unsigned int>(n * chunk / num_chunks);
+}
 
-  // merge bbox
-  for (size_t k = 0; k < 3; k++) {
-    (*bmin)[int(k)] = local_bmins[k];
-    (*bmax)[int(k)] = local_bmaxs[k];
+template <typename T>
+inline void GetBoundingBoxTasks(TaskPool *pool, real3<T> *bmin,
+                                real3<T> *bmax, const BoundsSoA<T> &bounds,
+                                unsigned int left_index,
+                                unsigned int right_index) {
+  const unsigned int num_chunks =
+      NumTaskChunks(pool, left_index, right_index);
+  std::vector<real3<T> > local_bmins(num_chunks);
+  std::vector<real3<T> > local_bmaxs(num_chunks);
+
+  TaskGroup group;
+  for (unsigned int c = 0; c < num_chunks; c++) {
+    pool->Spawn(&group, [&, c]() {
+      GetBoundingBox(
+          &local_bmins[c], &local_bmaxs[c], bounds,
+          TaskChunkBegin(c, num_chunks, left_index, right_index),
+          TaskChunkBegin(c + 1, num_chunks, left_index, right_index));
+    });
   }
+  pool->Wait(&group);
 
-  for (size_t t = 1; t < num_threads; t++) {
-    for (size_t k = 0; k < 3; k++) {
-      if (local_bmins[3 * t + k] < (*bmin)[int(k)]) {
-        (*bmin)[int(k)] = local_bmins[3 * t + k];
-      }
-
-      if (local_bmaxs[3 * t + k] > (*bmax)[int(k)]) {
-        (*bmax)[int(k)] = local_bmaxs[3 * t + k];
-      }
+  (*bmin) = local_bmins[0];
+  (*bmax) = local_bmaxs[0];
+  for (unsigned int c = 1; c < num_chunks; c++) {
+    for (int k = 0; k < 3; k++) {
+      if (local_bmins[c][k] < (*bmin)[k]) (*bmin)[k] = local_bmins[c][k];
+      if (local_bmaxs[c][k] > (*bmax)[k]) (*bmax)[k] = local_bmaxs[c][k];
     }
   }
 }
-#endif
 
-template <typename T, class P>
-inline void ComputeBoundingBox(real3<T> *bmin, real3<T> *bmax,
-                               const unsigned int *indices,
-                               unsigned int left_index,
-                               unsigned int right_index, const P &p) {
-  {
-    unsigned int idx = indices[left_index];
-    p.BoundingBox(bmin, bmax, idx);
+/// Bins each chunk into its own BinBuffer, then sums them.
+template <typename T>
+inline void ContributeBinBufferTasks(TaskPool *pool, BinBuffer *bins,  // [out]
+                                     const real3<T> &scene_min,
+                                     const real3<T> &scene_max,
+                                     const BoundsSoA<T> &bounds,
+                                     unsigned int left_idx,
+                                     unsigned int right_idx) {
+  const unsigned int num_chunks = NumTaskChunks(pool, left_idx, right_idx);
+  std::vector<BinBuffer> local_bins(num_chunks, BinBuffer(bins->bin_size));
+
+  TaskGroup group;
+  for (unsigned int c = 0; c < num_chunks; c++) {
+    pool->Spawn(&group, [&, c]() {
+      ContributeBinBuffer(
+          &local_bins[c], scene_min, scene_max, bounds,
+          TaskChunkBegin(c, num_chunks, left_idx, right_idx),
+          TaskChunkBegin(c + 1, num_chunks, left_idx, right_idx));
+    });
   }
+  pool->Wait(&group);
 
-  {
-    for (unsigned int i = left_index + 1; i < right_index;
-         i++) {  // for each primitives
-      unsigned int idx = indices[i];
-      real3<T> bbox_min, bbox_max;
-      p.BoundingBox(&bbox_min, &bbox_max, idx);
-      for (int k = 0; k < 3; k++) {  // xyz
-        if ((*bmin)[k] > bbox_min[k]) (*bmin)[k] = bbox_min[k];
-        if ((*bmax)[k] < bbox_max[k]) (*bmax)[k] = bbox_max[k];
-      }
+  bins->clear();
+  for (unsigned int c = 0; c < num_chunks; c++) {
+    for (size_t i = 0; i < bins->bin.size(); i++) {
+      bins->bin[i] += local_bins[c].bin[i];
     }
   }
 }
 
-template <typename T>
-inline void GetBoundingBox(real3<T> *bmin, real3<T> *bmax,
-                           const std::vector<BBox<T> > &bboxes,
-                           unsigned int *indices, unsigned int left_index,
-                           unsigned int right_index) {
-  {
-    unsigned int i = left_index;
-    unsigned int idx = indices[i];
-    (*bmin)[0] = bboxes[idx].bmin[0];
-    (*bmin)[1] = bboxes[idx].bmin[1];
-    (*bmin)[2] = bboxes[idx].bmin[2];
-    (*bmax)[0] = bboxes[idx].bmax[0];
-    (*bmax)[1] = bboxes[idx].bmax[1];
-    (*bmax)[2] = bboxes[idx].bmax[2];
+///
+/// Parallel(and stable) PartitionPrimitives. Each chunk counts its primitives
+/// on the `pred` side, a prefix sum over the counts gives every chunk its
+/// output ranges, then chunks scatter into `scratch_indices`/`scratch_bounds`
+/// (same positions as the input range) and copy back.
+/// Returns the index of the first primitive not satisfying `pred`.
+///
+template <typename T, class Pred>
+inline unsigned int PartitionTasks(TaskPool *pool, unsigned int *indices,
+                                   BoundsSoA<T> *bounds,
+                                   unsigned int *scratch_indices,
+                                   BoundsSoA<T> *scratch_bounds,
+                                   unsigned int left_idx,
+                                   unsigned int right_idx, const Pred &pred) {
+  const unsigned int num_chunks = NumTaskChunks(pool, left_idx, right_idx);
+  std::vector<unsigned int> num_left(num_chunks);
+
+  TaskGroup count_group;
+  for (unsigned int c = 0; c < num_chunks; c++) {
+    pool->Spawn(&count_group, [&, c]() {
+      // Pred has mutable state, so every task works on its own copy.
+      const Pred local_pred = pred;
+      const unsigned int si = TaskChunkBegin(c, num_chunks, left_idx, right_idx);
+      const unsigned int ei =
+          TaskChunkBegin(c + 1, num_chunks, left_idx, right_idx);
+      unsigned int count = 0;
+      for (unsigned int i = si; i < ei; i++) {
+        if (local_pred(indices[i])) count++;
+      }
+      num_left[c] = count;
+    });
+  }
+  pool->Wait(&count_group);
+
+  std::vector<unsigned int> left_offset(num_chunks);
+  std::vector<unsigned int> right_offset(num_chunks);
+  unsigned int total_left = 0;
+  for (unsigned int c = 0; c < num_chunks; c++) {
+    left_offset[c] = left_idx + total_left;
+    total_left += num_left[c];
+  }
+  for (unsigned int c = 0; c < num_chunks; c++) {
+    const unsigned int si = TaskChunkBegin(c, num_chunks, left_idx, right_idx);
+    // primitives before this chunk which go right
+    right_offset[c] = si + total_left - (left_offset[c] - left_idx);
   }
 
-  T local_bmin[3] = {(*bmin)[0], (*bmin)[1], (*bmin)[2]};
-  T local_bmax[3] = {(*bmax)[0], (*bmax)[1], (*bmax)[2]};
-
-  {
-    for (unsigned int i = left_index; i < right_index; i++) {  // for each faces
-      unsigned int idx = indices[i];
-
-      for (int k = 0; k < 3; k++) {  // xyz
-        T minval = bboxes[idx].bmin[k];
-        T maxval = bboxes[idx].bmax[k];
-        if (local_bmin[k] > minval) local_bmin[k] = minval;
-        if (local_bmax[k] < maxval) local_bmax[k] = maxval;
+  TaskGroup scatter_group;
+  for (unsigned int c = 0; c < num_chunks; c++) {
+    pool->Spawn(&scatter_group, [&, c]() {
+      const Pred local_pred = pred;
+      const unsigned int si = TaskChunkBegin(c, num_chunks, left_idx, right_idx);
+      const unsigned int ei =
+          TaskChunkBegin(c + 1, num_chunks, left_idx, right_idx);
+      unsigned int l = left_offset[c];
+      unsigned int r = right_offset[c];
+      for (unsigned int i = si; i < ei; i++) {
+        const unsigned int dst = local_pred(indices[i]) ? l++ : r++;
+        scratch_indices[dst] = indices[i];
+        for (int k = 0; k < 3; k++) {
+          scratch_bounds->bmin[k][dst] = bounds->bmin[k][i];
+          scratch_bounds->bmax[k][dst] = bounds->bmax[k][i];
+        }
       }
-    }
-
-    for (int k = 0; k < 3; k++) {
-      (*bmin)[k] = local_bmin[k];
-      (*bmax)[k] = local_bmax[k];
-    }
+    });
+  }
+  pool->Wait(&scatter_group);
+
+  TaskGroup copy_group;
+  for (unsigned int c = 0; c < num_chunks; c++) {
+    pool->Spawn(&copy_group, [&, c]() {
+      const unsigned int si = TaskChunkBegin(c, num_chunks, left_idx, right_idx);
+      const unsigned int ei =
+          TaskChunkBegin(c + 1, num_chunks, left_idx, right_idx);
+      std::copy(scratch_indices + si, scratch_indices + ei, indices + si);
+      for (int k = 0; k < 3; k++) {
+        std::copy(scratch_bounds->bmin[k].begin() + si,
+                  scratch_bounds->bmin[k].begin() + ei,
+                  bounds->bmin[k].begin() + si);
+        std::copy(scratch_bounds->bmax[k].begin() + si,
+                  scratch_bounds->bmax[k].begin() + ei,
+                  bounds->bmax[k].begin() + si);
+      }
+    });
   }
+  pool->Wait(&copy_group);
+
+  return left_idx + total_left;
 }
+#endif
 
 //
 // --
@@ -1571,13 +2248,14 @@ inline void GetBoundingBox(real3<T> *bmin, real3<T> *bmax,
 
 #if defined(NANORT_ENABLE_PARALLEL_BUILD)
 template <typename T>
-template <class P, class Pred>
+template <class Pred>
 unsigned int BVHAccel<T>::BuildShallowTree(std::vector<BVHNode<T> > *out_nodes,
+                                           BinBuffer *bins,
                                            unsigned int left_idx,
                                            unsigned int right_idx,
                                            unsigned int depth,
                                            unsigned int max_shallow_depth,
-                                           const P &p, const Pred &pred) {
+                                           const Pred &pred) {
   assert(left_idx <= right_idx);
 
   unsigned int offset = static_cast<unsigned int>(out_nodes->size());
@@ -1587,12 +2265,7 @@ unsigned int BVHAccel<T>::BuildShallowTree(std::vector<BVHNode<T> > *out_nodes,
   }
 
   real3<T> bmin, bmax;
-#if defined(NANORT_USE_CPP11_FEATURE) && defined(NANORT_ENABLE_PARALLEL_BUILD)
-  ComputeBoundingBoxThreaded(&bmin, &bmax, &indices_.at(0), left_idx, right_idx,
-                             p);
-#else
-  ComputeBoundingBox(&bmin, &bmax, &indices_.at(0), left_idx, right_idx, p);
-#endif
+  GetBoundingBox(&bmin, &bmax, bounds_, left_idx, right_idx);
 
   unsigned int n = right_idx - left_idx;
   if ((n <= options_.min_leaf_primitives) ||
@@ -1611,6 +2284,7 @@ unsigned int BVHAccel<T>::BuildShallowTree(std::vector<BVHNode<T> > *out_nodes,
     assert(left_idx < std::numeric_limits<unsigned int>::max());
 
     leaf.flag = 1;  // leaf
+    leaf.axis = 0;
     leaf.data[0] = n;
     leaf.data[1] = left_idx;
 
@@ -1652,34 +2326,24 @@ unsigned int BVHAccel<T>::BuildShallowTree(std::vector<BVHNode<T> > *out_nodes,
     int min_cut_axis = 0;
     T cut_pos[3] = {0.0, 0.0, 0.0};
 
-    BinBuffer bins(options_.bin_size);
-    ContributeBinBuffer(&bins, bmin, bmax, &indices_.at(0), left_idx, right_idx,
-                        p);
-    FindCutFromBinBuffer(cut_pos, &min_cut_axis, &bins, bmin, bmax, n,
+    ContributeBinBuffer(bins, bmin, bmax, bounds_, left_idx, right_idx);
+    FindCutFromBinBuffer(cut_pos, &min_cut_axis, bins, bmin, bmax, n,
                          options_.cost_t_aabb);
 
     // Try all 3 axis until good cut position avaiable.
     unsigned int mid_idx = left_idx;
     int cut_axis = min_cut_axis;
     for (int axis_try = 0; axis_try < 3; axis_try++) {
-      unsigned int *begin = &indices_[left_idx];
-      unsigned int *end =
-          &indices_[right_idx - 1] + 1;  // mimics end() iterator.
-      unsigned int *mid = 0;
-
       // try min_cut_axis first.
       cut_axis = (min_cut_axis + axis_try) % 3;
 
-      // @fixme { We want something like: std::partition(begin, end,
-      // pred(cut_axis, cut_pos[cut_axis])); }
       pred.Set(cut_axis, cut_pos[cut_axis]);
       //
       // Split at (cut_axis, cut_pos)
-      // indices_ will be modified.
+      // indices_ and bounds_ will be modified.
       //
-      mid = std::partition(begin, end, pred);
-
-      mid_idx = left_idx + static_cast<unsigned int>((mid - begin));
+      mid_idx = PartitionPrimitives(&indices_.at(0), &bounds_, left_idx,
+                                    right_idx, pred);
       if ((mid_idx == left_idx) || (mid_idx == right_idx)) {
         // Can't split well.
         // Switch to object median(which may create unoptimized tree, but
@@ -1703,11 +2367,11 @@ unsigned int BVHAccel<T>::BuildShallowTree(std::vector<BVHNode<T> > *out_nodes,
     unsigned int left_child_index = 0;
     unsigned int right_child_index = 0;
 
-    left_child_index = BuildShallowTree(out_nodes, left_idx, mid_idx, depth + 1,
-                                        max_shallow_depth, p, pred);
+    left_child_index = BuildShallowTree(out_nodes, bins, left_idx, mid_idx,
+                                        depth + 1, max_shallow_depth, pred);
 
-    right_child_index = BuildShallowTree(out_nodes, mid_idx, right_idx,
-                                         depth + 1, max_shallow_depth, p, pred);
+    right_child_index = BuildShallowTree(out_nodes, bins, mid_idx, right_idx,
+                                         depth + 1, max_shallow_depth, pred);
 
     (*out_nodes)[offset].data[0] = left_child_index;
     (*out_nodes)[offset].data[1] = right_child_index;
@@ -1728,12 +2392,12 @@ unsigned int BVHAccel<T>::BuildShallowTree(std::vector<BVHNode<T> > *out_nodes,
 #endif
 
 template <typename T>
-template <class P, class Pred>
+template <class Pred>
 unsigned int BVHAccel<T>::BuildTree(BVHBuildStatistics *out_stat,
                                     std::vector<BVHNode<T> > *out_nodes,
-                                    unsigned int left_idx,
+                                    BinBuffer *bins, unsigned int left_idx,
                                     unsigned int right_idx, unsigned int depth,
-                                    const P &p, const Pred &pred) {
+                                    const Pred &pred) {
   assert(left_idx <= right_idx);
 
   unsigned int offset = static_cast<unsigned int>(out_nodes->size());
@@ -1743,11 +2407,7 @@ unsigned int BVHAccel<T>::BuildTree(BVHBuildStatistics *out_stat,
   }
 
   real3<T> bmin, bmax;
-  if (!bboxes_.empty()) {
-    GetBoundingBox(&bmin, &bmax, bboxes_, &indices_.at(0), left_idx, right_idx);
-  } else {
-    ComputeBoundingBox(&bmin, &bmax, &indices_.at(0), left_idx, right_idx, p);
-  }
+  GetBoundingBox(&bmin, &bmax, bounds_, left_idx, right_idx);
 
   unsigned int n = right_idx - left_idx;
   if ((n <= options_.min_leaf_primitives) ||
@@ -1766,6 +2426,7 @@ unsigned int BVHAccel<T>::BuildTree(BVHBuildStatistics *out_stat,
     assert(left_idx < std::numeric_limits<unsigned int>::max());
 
     leaf.flag = 1;  // leaf
+    leaf.axis = 0;
     leaf.data[0] = n;
     leaf.data[1] = left_idx;
 
@@ -1786,20 +2447,14 @@ unsigned int BVHAccel<T>::BuildTree(BVHBuildStatistics *out_stat,
   int min_cut_axis = 0;
   T cut_pos[3] = {0.0, 0.0, 0.0};
 
-  BinBuffer bins(options_.bin_size);
-  ContributeBinBuffer(&bins, bmin, bmax, &indices_.at(0), left_idx, right_idx,
-                      p);
-  FindCutFromBinBuffer(cut_pos, &min_cut_axis, &bins, bmin, bmax, n,
+  ContributeBinBuffer(bins, bmin, bmax, bounds_, left_idx, right_idx);
+  FindCutFromBinBuffer(cut_pos, &min_cut_axis, bins, bmin, bmax, n,
                        options_.cost_t_aabb);
 
   // Try all 3 axis until good cut position avaiable.
   unsigned int mid_idx = left_idx;
   int cut_axis = min_cut_axis;
   for (int axis_try = 0; axis_try < 3; axis_try++) {
-    unsigned int *begin = &indices_[left_idx];
-    unsigned int *end = &indices_[right_idx - 1] + 1;  // mimics end() iterator.
-    unsigned int *mid = 0;
-
     // try min_cut_axis first.
     cut_axis = (min_cut_axis + axis_try) % 3;
 
@@ -1807,11 +2462,10 @@ unsigned int BVHAccel<T>::BuildTree(BVHBuildStatistics *out_stat,
 
     //
     // Split at (cut_axis, cut_pos)
-    // indices_ will be modified.
+    // indices_ and bounds_ will be modified.
     //
-    mid = std::partition(begin, end, pred);
-
-    mid_idx = left_idx + static_cast<unsigned int>((mid - begin));
+    mid_idx = PartitionPrimitives(&indices_.at(0), &bounds_, left_idx,
+                                  right_idx, pred);
     if ((mid_idx == left_idx) || (mid_idx == right_idx)) {
       // Can't split well.
       // Switch to object median(which may create unoptimized tree, but
@@ -1835,11 +2489,11 @@ unsigned int BVHAccel<T>::BuildTree(BVHBuildStatistics *out_stat,
   unsigned int left_child_index = 0;
   unsigned int right_child_index = 0;
 
-  left_child_index =
-      BuildTree(out_stat, out_nodes, left_idx, mid_idx, depth + 1, p, pred);
+  left_child_index = BuildTree(out_stat, out_nodes, bins, left_idx, mid_idx,
+                               depth + 1, pred);
 
-  right_child_index =
-      BuildTree(out_stat, out_nodes, mid_idx, right_idx, depth + 1, p, pred);
+  right_child_index = BuildTree(out_stat, out_nodes, bins, mid_idx, right_idx,
+                                depth + 1, pred);
 
   {
     (*out_nodes)[offset].data[0] = left_child_index;
@@ -1859,15 +2513,149 @@ unsigned int BVHAccel<T>::BuildTree(BVHBuildStatistics *out_stat,
   return offset;
 }
 
+#if defined(NANORT_USE_CPP11_FEATURE) && defined(NANORT_ENABLE_PARALLEL_BUILD)
+template <typename T>
+template <class Pred>
+void BVHAccel<T>::BuildTreeTasks(TaskBuildState *state,
+                                 unsigned int node_index,
+                                 unsigned int left_idx, unsigned int right_idx,
+                                 unsigned int depth, const Pred &pred) {
+  assert(left_idx < right_idx);
+
+  unsigned int max_depth = state->max_tree_depth.load();
+  while (max_depth < depth &&
+         !state->max_tree_depth.compare_exchange_weak(max_depth, depth)) {
+  }
+
+  unsigned int n = right_idx - left_idx;
+
+  // Top levels have fewer subtrees than threads, so split the work on the
+  // primitive range itself there.
+  const bool wide = (depth < options_.shallow_depth) &&
+                    (n >= kNANORT_MIN_PRIMITIVES_FOR_PARALLEL_BINNING) &&
+                    (state->pool->NumThreads() > 1);
+
+  real3<T> bmin, bmax;
+  if (wide) {
+    GetBoundingBoxTasks(state->pool, &bmin, &bmax, bounds_, left_idx,
+                        right_idx);
+  } else {
+    GetBoundingBox(&bmin, &bmax, bounds_, left_idx, right_idx);
+  }
+
+  // Slots are preallocated, so this stays valid while other tasks add nodes.
+  BVHNode<T> &node = nodes_[node_index];
+  for (int k = 0; k < 3; k++) {
+    node.bmin[k] = bmin[k];
+    node.bmax[k] = bmax[k];
+  }
+
+  if ((n <= options_.min_leaf_primitives) ||
+      (depth >= options_.max_tree_depth)) {
+    node.flag = 1;  // leaf
+    node.axis = 0;
+    node.data[0] = n;
+    node.data[1] = left_idx;
+
+    state->num_leaf_nodes++;
+    return;
+  }
+
+  //
+  // Compute SAH and find best split axis and position
+  //
+  int min_cut_axis = 0;
+  T cut_pos[3] = {0.0, 0.0, 0.0};
+
+  // The thread's scratch bins are free again before this task can wait(and
+  // so run other tasks on this thread). Wide nodes wait while binning, so
+  // they get their own.
+  if (wide) {
+    BinBuffer bins(options_.bin_size);
+    ContributeBinBufferTasks(state->pool, &bins, bmin, bmax, bounds_,
+                             left_idx, right_idx);
+    FindCutFromBinBuffer(cut_pos, &min_cut_axis, &bins, bmin, bmax, n,
+                         options_.cost_t_aabb);
+  } else {
+    BinBuffer *bins = &state->bins[state->pool->ThreadIndex()];
+    ContributeBinBuffer(bins, bmin, bmax, bounds_, left_idx, right_idx);
+    FindCutFromBinBuffer(cut_pos, &min_cut_axis, bins, bmin, bmax, n,
+                         options_.cost_t_aabb);
+  }
+
+  // Try all 3 axis until good cut position avaiable.
+  unsigned int mid_idx = left_idx;
+  int cut_axis = min_cut_axis;
+  for (int axis_try = 0; axis_try < 3; axis_try++) {
+    // try min_cut_axis first.
+    cut_axis = (min_cut_axis + axis_try) % 3;
+
+    pred.Set(cut_axis, cut_pos[cut_axis]);
+
+    if (wide) {
+      mid_idx = PartitionTasks(state->pool, &indices_.at(0), &bounds_,
+                               &state->scratch_indices.at(0),
+                               &state->scratch_bounds, left_idx, right_idx,
+                               pred);
+    } else {
+      mid_idx = PartitionPrimitives(&indices_.at(0), &bounds_, left_idx,
+                                    right_idx, pred);
+    }
+
+    if ((mid_idx == left_idx) || (mid_idx == right_idx)) {
+      // Can't split well.
+      // Switch to object median(which may create unoptimized tree, but
+      // stable)
+      mid_idx = left_idx + (n >> 1);
+
+      // Try another axis to find better cut.
+
+    } else {
+      // Found good cut. exit loop.
+      break;
+    }
+  }
+
+  const unsigned int child_index = state->num_nodes.fetch_add(2);
+
+  node.axis = cut_axis;
+  node.flag = 0;  // 0 = branch
+  node.data[0] = child_index;
+  node.data[1] = child_index + 1;
+
+  state->num_branch_nodes++;
+
+  if (mid_idx - left_idx >= kNANORT_MIN_PRIMITIVES_FOR_TASK &&
+      right_idx - mid_idx >= kNANORT_MIN_PRIMITIVES_FOR_TASK) {
+    // Fork the left subtree, keep going with the right one on this thread.
+    // The task gets its own copy of Pred since Set() modifies it.
+    const Pred left_pred = pred;
+    state->pool->Spawn(&state->subtrees, [=]() {
+      NANORT_PROFILE_ZONE("nanort::BuildTreeTasks");
+      BuildTreeTasks(state, child_index, left_idx, mid_idx, depth + 1,
+                     left_pred);
+    });
+  } else {
+    BuildTreeTasks(state, child_index, left_idx, mid_idx, depth + 1, pred);
+  }
+  BuildTreeTasks(state, child_index + 1, mid_idx, right_idx, depth + 1, pred);
+}
+#endif
+
 template <typename T>
 template <class P, class Pred>
 bool BVHAccel<T>::Build(unsigned int num_primitives, const P &p,
                         const Pred &pred, const BVHBuildOptions<T> &options) {
+  NANORT_PROFILE_ZONE("nanort::Build");
+#if defined(NANORT_USE_CPP11_FEATURE)
+  const std::chrono::steady_clock::time_point build_start =
+      std::chrono::steady_clock::now();
+#endif
   options_ = options;
   stats_ = BVHBuildStatistics();
 
   nodes_.clear();
-  bboxes_.clear();
+  parents_.clear();
 
   assert(options_.bin_size > 1);
 
@@ -1876,17 +2664,19 @@ bool BVHAccel<T>::Build(unsigned int num_primitives, const P &p,
   }
 
   unsigned int n = num_primitives;
+  size_t peak_bytes = 0;
 
   //
-  // 1. Create triangle indices(this will be permutated in BuildTree)
+  // 1. Create triangle indices(this will be permutated in BuildTree) and
+  //    cache the bounds of each primitive(permutated along with them).
   //
   indices_.resize(n);
+  bounds_.resize(n);
 
 #if defined(NANORT_USE_CPP11_FEATURE)
   {
-    size_t num_threads = std::min(
-        size_t(kNANORT_MAX_THREADS),
-        std::max(size_t(1), size_t(std::thread::hardware_concurrency())));
+    NANORT_PROFILE_ZONE("nanort::Bounds");
+    size_t num_threads = NumBuildThreads(options.max_threads);
     if (n < num_threads) {
       num_threads = n;
     }
@@ -1897,11 +2687,16 @@ bool BVHAccel<T>::Build(unsigned int num_primitives, const P &p,
 
     for (size_t t = 0; t < num_threads; t++) {
       workers.emplace_back(std::thread([&, t]() {
+        NANORT_PROFILE_ZONE("nanort::Bounds worker");
         size_t si = t * ndiv;
-        size_t ei = std::min((t + 1) * ndiv, size_t(n));
+        size_t ei = (t + 1 == num_threads) ? size_t(n) : (t + 1) * ndiv;
 
         for (size_t k = si; k < ei; k++) {
           indices_[k] = static_cast<unsigned int>(k);
+
+          real3<T> bbox_min, bbox_max;
+          p.BoundingBox(&bbox_min, &bbox_max, static_cast<unsigned int>(k));
+          bounds_.set(k, bbox_min, bbox_max);
         }
       }));
     }
@@ -1918,133 +2713,73 @@ bool BVHAccel<T>::Build(unsigned int num_primitives, const P &p,
 #endif
   for (int i = 0; i < static_cast<int>(n); i++) {
     indices_[static_cast<size_t>(i)] = static_cast<unsigned int>(i);
-  }
-#endif  // !NANORT_USE_CPP11_FEATURE
-
-  //
-  // 2. Compute bounding box(optional).
-  //
-  real3<T> bmin, bmax;
-  if (options.cache_bbox) {
-    bmin[0] = bmin[1] = bmin[2] = std::numeric_limits<T>::max();
-    bmax[0] = bmax[1] = bmax[2] = -std::numeric_limits<T>::max();
 
-    bboxes_.resize(n);
-    for (size_t i = 0; i < n; i++) {  // for each primitived
-      unsigned int idx = indices_[i];
-
-      BBox<T> bbox;
-      p.BoundingBox(&(bbox.bmin), &(bbox.bmax), static_cast<unsigned int>(i));
-      bboxes_[idx] = bbox;
-
-      for (int k = 0; k < 3; k++) {  // xyz
-        if (bmin[k] > bbox.bmin[k]) {
-          bmin[k] = bbox.bmin[k];
-        }
-        if (bmax[k] < bbox.bmax[k]) {
-          bmax[k] = bbox.bmax[k];
-        }
-      }
-    }
-
-  } else {
-#if defined(NANORT_USE_CPP11_FEATURE)
-    ComputeBoundingBoxThreaded(&bmin, &bmax, &indices_.at(0), 0, n, p);
-#elif defined(_OPENMP)
-    ComputeBoundingBoxOMP(&bmin, &bmax, &indices_.at(0), 0, n, p);
-#else
-    ComputeBoundingBox(&bmin, &bmax, &indices_.at(0), 0, n, p);
-#endif
+    real3<T> bbox_min, bbox_max;
+    p.BoundingBox(&bbox_min, &bbox_max, static_cast<unsigned int>(i));
+    bounds_.set(static_cast<size_t>(i), bbox_min, bbox_max);
   }
+#endif  // !NANORT_USE_CPP11_FEATURE
 
 //
-// 3. Build tree
+// 2. Build tree
 //
+  {
+  NANORT_PROFILE_ZONE("nanort::BuildTree");
 #if defined(NANORT_ENABLE_PARALLEL_BUILD)
 #if defined(NANORT_USE_CPP11_FEATURE)
 
   // Do parallel build for enoughly large dataset.
   if (n > options.min_primitives_for_parallel_build) {
-    BuildShallowTree(&nodes_, 0, n, /* root depth */ 0, options.shallow_depth,
-                     p, pred);  // [0, n)
-
-    assert(shallow_node_infos_.size() > 0);
-
-    // Build deeper tree in parallel
-    std::vector<std::vector<BVHNode<T> > > local_nodes(
-        shallow_node_infos_.size());
-    std::vector<BVHBuildStatistics> local_stats(shallow_node_infos_.size());
-
-    size_t num_threads = std::min(
-        size_t(kNANORT_MAX_THREADS),
-        std::max(size_t(1), size_t(std::thread::hardware_concurrency())));
-    if (shallow_node_infos_.size() < num_threads) {
-      num_threads = shallow_node_infos_.size();
+    TaskPool pool(NumBuildThreads(options.max_threads));
+    TaskBuildState state(&pool);
+    state.bins.assign(pool.NumThreads(), BinBuffer(options.bin_size));
+    if (pool.NumThreads() > 1 &&
+        n >= kNANORT_MIN_PRIMITIVES_FOR_PARALLEL_BINNING) {
+      state.scratch_indices.resize(n);
+      state.scratch_bounds.resize(n);
     }
 
-    std::vector<std::thread> workers;
-    std::atomic<uint32_t> i(0);
+    // Every leaf holds at least one primitive, so 2n - 1 nodes is enough.
+    nodes_.resize(2 * size_t(n) - 1);
+    state.num_nodes = 1;  // root
 
-    for (size_t t = 0; t < num_threads; t++) {
-      workers.emplace_back(std::thread([&]() {
-        uint32_t idx = 0;
-        while ((idx = (i++)) < shallow_node_infos_.size()) {
-          // Create thread-local copy of Pred since some mutable variables are
-          // modified during SAH computation.
-          const Pred local_pred = pred;
-          unsigned int left_idx = shallow_node_infos_[size_t(idx)].left_idx;
-          unsigned int right_idx = shallow_node_infos_[size_t(idx)].right_idx;
-          BuildTree(&(local_stats[size_t(idx)]), &(local_nodes[size_t(idx)]),
-                    left_idx, right_idx, options.shallow_depth, p, local_pred);
-        }
-      }));
-    }
+    BuildTreeTasks(&state, 0, 0, n, /* root depth */ 0, pred);  // [0, n)
+    pool.Wait(&state.subtrees);
 
-    for (auto &t : workers) {
-      t.join();
+    // scratch, and the copy the shrink below makes
+    size_t scratch_bytes =
+        state.scratch_indices.capacity() * sizeof(unsigned int) +
+        state.scratch_bounds.bytes() +
+        size_t(state.num_nodes.load()) * sizeof(BVHNode<T>);
+    for (size_t i = 0; i < state.bins.size(); i++) {
+      scratch_bytes += state.bins[i].bin.capacity() * sizeof(unsigned int);
     }
+    peak_bytes = std::max(peak_bytes, HeldBytes() + scratch_bytes);
 
-    // Join local nodes
-    for (size_t ii = 0; ii < local_nodes.size(); ii++) {
-      assert(!local_nodes[ii].empty());
-      size_t offset = nodes_.size();
-
-      // Add offset to child index(for branch node).
-      for (size_t j = 0; j < local_nodes[ii].size(); j++) {
-        if (local_nodes[ii][j].flag == 0) {  // branch
-          local_nodes[ii][j].data[0] += offset - 1;
-          local_nodes[ii][j].data[1] += offset - 1;
-        }
-      }
-
-      // replace
-      nodes_[shallow_node_infos_[ii].offset] = local_nodes[ii][0];
-
-      // Skip root element of the local node.
-      nodes_.insert(nodes_.end(), local_nodes[ii].begin() + 1,
-                    local_nodes[ii].end());
-    }
+    nodes_.resize(state.num_nodes.load());
+    std::vector<BVHNode<T> >(nodes_).swap(nodes_);  // shrink
 
-    // Join statistics
-    for (size_t ii = 0; ii < local_nodes.size(); ii++) {
-      stats_.max_tree_depth =
-          std::max(stats_.max_tree_depth, local_stats[ii].max_tree_depth);
-      stats_.num_leaf_nodes += local_stats[ii].num_leaf_nodes;
-      stats_.num_branch_nodes += local_stats[ii].num_branch_nodes;
-    }
+    stats_.max_tree_depth = state.max_tree_depth.load();
+    stats_.num_leaf_nodes = state.num_leaf_nodes.load();
+    stats_.num_branch_nodes = state.num_branch_nodes.load();
 
   } else {
     // Single thread.
-    BuildTree(&stats_, &nodes_, 0, n,
-              /* root depth */ 0, p, pred);  // [0, n)
+    BinBuffer bins(options.bin_size);
+    BuildTree(&stats_, &nodes_, &bins, 0, n,
+              /* root depth */ 0, pred);  // [0, n)
+    peak_bytes = std::max(
+        peak_bytes, HeldBytes() + bins.bin.capacity() * sizeof(unsigned int));
   }
 
 #elif defined(_OPENMP)
 
   // Do parallel build for enoughly large dataset.
   if (n > options.min_primitives_for_parallel_build) {
-    BuildShallowTree(&nodes_, 0, n, /* root depth */ 0, options.shallow_depth,
-                     p, pred);  // [0, n)
+    BinBuffer bins(options.bin_size);
+    shallow_node_infos_.clear();
+    BuildShallowTree(&nodes_, &bins, 0, n, /* root depth */ 0,
+                     options.shallow_depth, pred);  // [0, n)
 
     assert(shallow_node_infos_.size() > 0);
 
@@ -2058,8 +2793,10 @@ bool BVHAccel<T>::Build(unsigned int num_primitives, const P &p,
       unsigned int left_idx = shallow_node_infos_[size_t(i)].left_idx;
       unsigned int right_idx = shallow_node_infos_[size_t(i)].right_idx;
       const Pred local_pred = pred;
-      BuildTree(&(local_stats[size_t(i)]), &(local_nodes[size_t(i)]), left_idx,
-                right_idx, options.shallow_depth, p, local_pred);
+      BinBuffer local_bins(options.bin_size);
+      BuildTree(&(local_stats[size_t(i)]), &(local_nodes[size_t(i)]),
+                &local_bins, left_idx, right_idx, options.shallow_depth,
+                local_pred);
     }
 
     // Join local nodes
@@ -2093,38 +2830,296 @@ bool BVHAccel<T>::Build(unsigned int num_primitives, const P &p,
 
   } else {
     // Single thread
-    BuildTree(&stats_, &nodes_, 0, n,
-              /* root depth */ 0, p, pred);  // [0, n)
+    BinBuffer bins(options.bin_size);
+    BuildTree(&stats_, &nodes_, &bins, 0, n,
+              /* root depth */ 0, pred);  // [0, n)
+    peak_bytes = std::max(
+        peak_bytes, HeldBytes() + bins.bin.capacity() * sizeof(unsigned int));
   }
 
 #else  // !NANORT_ENABLE_PARALLEL_BUILD
   {
-    BuildTree(&stats_, &nodes_, 0, n,
-              /* root depth */ 0, p, pred);  // [0, n)
+    BinBuffer bins(options.bin_size);
+    BuildTree(&stats_, &nodes_, &bins, 0, n,
+              /* root depth */ 0, pred);  // [0, n)
+    peak_bytes = std::max(
+        peak_bytes, HeldBytes() + bins.bin.capacity() * sizeof(unsigned int));
   }
 #endif
 #else  // !_OPENMP
 
   // Single thread BVH build
   {
-    BuildTree(&stats_, &nodes_, 0, n,
-              /* root depth */ 0, p, pred);  // [0, n)
+    BinBuffer bins(options.bin_size);
+    BuildTree(&stats_, &nodes_, &bins, 0, n,
+              /* root depth */ 0, pred);  // [0, n)
+    peak_bytes = std::max(
+        peak_bytes, HeldBytes() + bins.bin.capacity() * sizeof(unsigned int));
+  }
+#endif
+  }
+
+  peak_bytes = std::max(peak_bytes, HeldBytes());
+  bounds_.release();
+
+  {
+    NANORT_PROFILE_ZONE("nanort::Relayout");
+    BuildParents();
+    if (options.layout != BVH_LAYOUT_BUILD_ORDER) {
+      // the new node array and the order
+      peak_bytes = std::max(
+          peak_bytes, HeldBytes() + nodes_.size() * (sizeof(BVHNode<T>) +
+                                                     sizeof(unsigned int)));
+    }
+    Relayout(options.layout);
+  }
+
+  if (options.compact) {
+    Compact();
+  } else {
+    CountMemory();
   }
+  stats_.peak_build_bytes = peak_bytes;
+
+#if defined(NANORT_USE_CPP11_FEATURE)
+  stats_.build_secs = std::chrono::duration<float>(
+                          std::chrono::steady_clock::now() - build_start)
+                          .count();
 #endif
 
   return true;
 }
 
 template <typename T>
-void BVHAccel<T>::Debug() {
-  for (size_t i = 0; i < indices_.size(); i++) {
-    printf("index[%d] = %d\n", int(i), int(indices_[i]));
+void BVHAccel<T>::Compact() {
+  bounds_.release();
+#if defined(NANORT_ENABLE_PARALLEL_BUILD)
+  std::vector<ShallowNodeInfo>().swap(shallow_node_infos_);
+#endif
+  if (nodes_.capacity() > nodes_.size()) {
+    std::vector<BVHNode<T> >(nodes_).swap(nodes_);
   }
+  if (indices_.capacity() > indices_.size()) {
+    std::vector<unsigned int>(indices_).swap(indices_);
+  }
+  if (parents_.capacity() > parents_.size()) {
+    std::vector<unsigned int>(parents_).swap(parents_);
+  }
+  CountMemory();
+}
+
+template <typename T>
+void BVHAccel<T>::CountMemory() {
+  stats_.node_bytes = nodes_.capacity() * sizeof(BVHNode<T>);
+  stats_.index_bytes = indices_.capacity() * sizeof(unsigned int);
+  stats_.parent_bytes = parents_.capacity() * sizeof(unsigned int);
+  stats_.unused_bytes =
+      (nodes_.capacity() - nodes_.size()) * sizeof(BVHNode<T>) +
+      (indices_.capacity() - indices_.size()) * sizeof(unsigned int) +
+      (parents_.capacity() - parents_.size()) * sizeof(unsigned int);
+}
 
+template <typename T>
+void BVHAccel<T>::BuildParents() {
+  parents_.resize(nodes_.size());
+  if (nodes_.empty()) {
+    return;
+  }
+  parents_[0] = 0;
   for (size_t i = 0; i < nodes_.size(); i++) {
-    printf("node[%d] : bmin %f, %f, %f, bmax %f, %f, %f\n", int(i),
-           nodes_[i].bmin[0], nodes_[i].bmin[1], nodes_[i].bmin[1],
-           nodes_[i].bmax[0], nodes_[i].bmax[1], nodes_[i].bmax[1]);
+    if (nodes_[i].flag == 0) {  // branch
+      parents_[nodes_[i].data[0]] = static_cast<unsigned int>(i);
+      parents_[nodes_[i].data[1]] = static_cast<unsigned int>(i);
+    }
+  }
+}
+
+template <typename T>
+void BVHAccel<T>::Relayout(BVHLayout layout) {
+  if (nodes_.empty() || (layout == BVH_LAYOUT_BUILD_ORDER)) {
+    return;
+  }
+
+  std::vector<unsigned int> order;  // order[new index] = old index
+  order.reserve(nodes_.size());
+  std::vector<BVHNode<T> > out(nodes_.size());
+
+  if (layout == BVH_LAYOUT_DEPTH_FIRST) {
+    LayoutDepthFirst(0, &order);
+
+  } else if (layout == BVH_LAYOUT_BREADTH_FIRST_TOP) {
+    // Breadth first down to kNANORT_LAYOUT_BFS_DEPTH, the nodes below that
+    // depth are the roots of the depth first part.
+    std::vector<unsigned int> level(1, 0);
+    std::vector<unsigned int> next;
+    for (int depth = 0; depth < kNANORT_LAYOUT_BFS_DEPTH && !level.empty();
+         depth++) {
+      next.clear();
+      for (size_t i = 0; i < level.size(); i++) {
+        const BVHNode<T> &node = nodes_[level[i]];
+        order.push_back(level[i]);
+        if (node.flag == 0) {  // branch
+          next.push_back(node.data[0]);
+          next.push_back(node.data[1]);
+        }
+      }
+      level.swap(next);
+    }
+    for (size_t i = 0; i < level.size(); i++) {
+      LayoutDepthFirst(level[i], &order);
+    }
+
+  } else if (layout == BVH_LAYOUT_TREELET) {
+    // A block is kNANORT_LAYOUT_TREELET_NODES * sizeof(BVHNode<T>) bytes,
+    // whole cache lines for both float(40 byte) and double(64 byte) nodes.
+    // Find the first node of `out` that starts a cache line.
+    size_t phase = 0;
+    const size_t base = reinterpret_cast<size_t>(&out.at(0));
+    for (size_t i = 0; i < kNANORT_LAYOUT_TREELET_NODES; i++) {
+      if ((base + i * sizeof(BVHNode<T>)) % kNANORT_CACHE_LINE_SIZE == 0) {
+        phase = i;
+        break;
+      }
+    }
+    LayoutTreelets(phase, &order);
+
+  } else {
+    return;  // unknown layout
+  }
+
+  assert(order.size() == nodes_.size());
+
+  ApplyNodeOrder(order, &out);
+  nodes_.swap(out);
+
+  BuildParents();
+}
+
+template <typename T>
+template <class P>
+void BVHAccel<T>::Refit(const P &p) {
+  if (nodes_.empty()) {
+    return;
+  }
+
+  // Reverse pre-order visits children before their parent.
+  std::vector<unsigned int> order;
+  order.reserve(nodes_.size());
+  LayoutDepthFirst(0, &order);
+
+  const unsigned int *indices = indices_.empty() ? NULL : &indices_[0];
+
+  for (size_t k = order.size(); k-- > 0;) {
+    BVHNode<T> &node = nodes_[order[k]];
+
+    real3<T> bmin, bmax;
+    if (node.flag == 0) {  // branch
+      const BVHNode<T> &child0 = nodes_[node.data[0]];
+      const BVHNode<T> &child1 = nodes_[node.data[1]];
+      for (int j = 0; j < 3; j++) {
+        bmin[j] = std::min(child0.bmin[j], child1.bmin[j]);
+        bmax[j] = std::max(child0.bmax[j], child1.bmax[j]);
+      }
+    } else {  // leaf
+      bmin[0] = bmin[1] = bmin[2] = std::numeric_limits<T>::max();
+      bmax[0] = bmax[1] = bmax[2] = -std::numeric_limits<T>::max();
+      for (unsigned int i = 0; i < node.data[0]; i++) {
+        const unsigned int offset = node.data[1] + i;
+        real3<T> prim_min, prim_max;
+        p.BoundingBox(&prim_min, &prim_max,
+                      indices ? indices[offset] : offset);
+        for (int j = 0; j < 3; j++) {
+          bmin[j] = std::min(bmin[j], prim_min[j]);
+          bmax[j] = std::max(bmax[j], prim_max[j]);
+        }
+      }
+    }
+
+    for (int j = 0; j < 3; j++) {
+      node.bmin[j] = bmin[j];
+      node.bmax[j] = bmax[j];
+    }
+  }
+}
+
+template <typename T>
+void BVHAccel<T>::LayoutDepthFirst(unsigned int root,
+                                   std::vector<unsigned int> *order) const {
+  std::vector<unsigned int> stack(1, root);
+  while (!stack.empty()) {
+    const unsigned int index = stack.back();
+    stack.pop_back();
+    order->push_back(index);
+
+    const BVHNode<T> &node = nodes_[index];
+    if (node.flag == 0) {  // branch
+      stack.push_back(node.data[1]);
+      stack.push_back(node.data[0]);  // left comes out first
+    }
+  }
+}
+
+template <typename T>
+void BVHAccel<T>::LayoutTreelets(size_t phase,
+                                 std::vector<unsigned int> *order) const {
+  const size_t block = kNANORT_LAYOUT_TREELET_NODES;
+
+  std::vector<unsigned int> roots(1, 0);  // treelets still to lay out
+  std::deque<unsigned int> queue;
+  while (!roots.empty()) {
+    const unsigned int root = roots.back();
+    roots.pop_back();
+
+    // Room left in the block the next node lands in.
+    const size_t room = block - (order->size() + block - phase) % block;
+
+    size_t size = 0;
+    queue.assign(1, root);
+    while (!queue.empty() && size < room) {
+      const BVHNode<T> &node = nodes_[queue.front()];
+      order->push_back(queue.front());
+      queue.pop_front();
+      size++;
+      if (node.flag == 0) {  // branch
+        queue.push_back(node.data[0]);
+        queue.push_back(node.data[1]);
+      }
+    }
+
+    // Whatever did not fit starts a treelet of its own, left to right.
+    roots.insert(roots.end(), queue.rbegin(), queue.rend());
+  }
+}
+
+template <typename T>
+void BVHAccel<T>::ApplyNodeOrder(const std::vector<unsigned int> &order,
+                                 std::vector<BVHNode<T> > *out) const {
+  std::vector<unsigned int> remap(nodes_.size());  // old index -> new
+  for (size_t i = 0; i < order.size(); i++) {
+    remap[order[i]] = static_cast<unsigned int>(i);
+  }
+
+  out->resize(order.size());
+  for (size_t i = 0; i < order.size(); i++) {
+    BVHNode<T> &node = (*out)[i];
+    node = nodes_[order[i]];
+    if (node.flag == 0) {  // branch
+      node.data[0] = remap[node.data[0]];
+      node.data[1] = remap[node.data[1]];
+    }
+  }
+}
+
+template <typename T>
+void BVHAccel<T>::Debug() {
+  for (size_t i = 0; i < indices_.size(); i++) {
+    printf("index[%d] = %d\n", int(i), int(indices_[i]));
+  }
+
+  for (size_t i = 0; i < nodes_.size(); i++) {
+    printf("node[%d] : bmin %f, %f, %f, bmax %f, %f, %f\n", int(i),
+           nodes_[i].bmin[0], nodes_[i].bmin[1], nodes_[i].bmin[1],
+           nodes_[i].bmax[0], nodes_[i].bmax[1], nodes_[i].bmax[1]);
   }
 }
 
@@ -2152,8 +3147,10 @@ bool BVHAccel<T>::Dump(const char *filename) const {
   r = fwrite(&numIndices, sizeof(size_t), 1, fp);
   assert(r == 1);
 
-  r = fwrite(&indices_.at(0), sizeof(unsigned int), numIndices, fp);
-  assert(r == numIndices);
+  if (numIndices > 0) {  // none after ReleaseIndices()
+    r = fwrite(&indices_.at(0), sizeof(unsigned int), numIndices, fp);
+    assert(r == numIndices);
+  }
 
   fclose(fp);
 
@@ -2177,8 +3174,10 @@ bool BVHAccel<T>::Dump(FILE *fp) const {
   r = fwrite(&numIndices, sizeof(size_t), 1, fp);
   assert(r == 1);
 
-  r = fwrite(&indices_.at(0), sizeof(unsigned int), numIndices, fp);
-  assert(r == numIndices);
+  if (numIndices > 0) {  // none after ReleaseIndices()
+    r = fwrite(&indices_.at(0), sizeof(unsigned int), numIndices, fp);
+    assert(r == numIndices);
+  }
 
   return true;
 }
@@ -2208,8 +3207,13 @@ bool BVHAccel<T>::Load(const char *filename) {
 
   indices_.resize(numIndices);
 
-  r = fread(&indices_.at(0), sizeof(unsigned int), numIndices, fp);
-  assert(r == numIndices);
+  if (numIndices > 0) {
+    r = fread(&indices_.at(0), sizeof(unsigned int), numIndices, fp);
+    assert(r == numIndices);
+  }
+
+  BuildParents();
+  CountMemory();
 
   fclose(fp);
 
@@ -2235,13 +3239,166 @@ bool BVHAccel<T>::Load(FILE *fp) {
 
   indices_.resize(numIndices);
 
-  r = fread(&indices_.at(0), sizeof(unsigned int), numIndices, fp);
-  assert(r == numIndices);
+  if (numIndices > 0) {
+    r = fread(&indices_.at(0), sizeof(unsigned int), numIndices, fp);
+    assert(r == numIndices);
+  }
+
+  BuildParents();
+  CountMemory();
 
   return true;
 }
 #endif
 
+//
+// Beam(frustum) vs AABB. The beam is the pyramid with apex `org` bounded by
+// the planes through neighbouring corner directions. Conservative: may report
+// an overlap that is not there, never the other way round.
+//
+template <typename T>
+class BeamPlanes {
+ public:
+  BeamPlanes(const T org[3], const T corner_dirs[4][3]) {
+    org_ = real3<T>(org);
+    real3<T> center(static_cast<T>(0.0));
+    for (int i = 0; i < 4; i++) {
+      center += real3<T>(corner_dirs[i]);
+    }
+    center_ = center;
+    for (int i = 0; i < 4; i++) {
+      real3<T> n = vcross(real3<T>(corner_dirs[i]),
+                          real3<T>(corner_dirs[(i + 1) & 3]));
+      // Face the plane towards the inside of the beam.
+      if (vdot(n, center) < static_cast<T>(0.0)) {
+        n = vneg(n);
+      }
+      normals_[i] = n;
+    }
+  }
+
+  bool Overlaps(const T bmin[3], const T bmax[3]) const {
+    for (int i = 0; i < 4; i++) {
+      const real3<T> &n = normals_[i];
+      // Box corner furthest along the plane normal.
+      T d = static_cast<T>(0.0);
+      T mag = static_cast<T>(0.0);
+      for (int k = 0; k < 3; k++) {
+        const T p = (n[k] >= static_cast<T>(0.0)) ? bmax[k] : bmin[k];
+        d += n[k] * (p - org_[k]);
+        mag += std::fabs(n[k] * (p - org_[k]));
+      }
+      // Leave some slack for rounding in the per-ray directions.
+      if (d < -mag * static_cast<T>(1.0e-5)) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  /// Where the box starts along the beam's center direction(unnormalized),
+  /// for ordering boxes near to far.
+  T EntryDistance(const T bmin[3], const T bmax[3]) const {
+    T d = static_cast<T>(0.0);
+    for (int k = 0; k < 3; k++) {
+      d += std::min(center_[k] * (bmin[k] - org_[k]),
+                    center_[k] * (bmax[k] - org_[k]));
+    }
+    return d;
+  }
+
+ private:
+  real3<T> org_;
+  real3<T> center_;  // sum of the corner directions
+  real3<T> normals_[4];
+};
+
+template <typename T>
+void BVHAccel<T>::FindBeamEntryNodes(const T org[3], const T corner_dirs[4][3],
+                                     BVHEntryNodes *entry_nodes,
+                                     unsigned int max_entry_nodes) const {
+  entry_nodes->count = 0;
+  if (nodes_.empty()) {
+    return;
+  }
+
+  if (max_entry_nodes > kNANORT_MAX_ENTRY_NODES) {
+    max_entry_nodes = kNANORT_MAX_ENTRY_NODES;
+  }
+  if (max_entry_nodes < 1) {
+    max_entry_nodes = 1;
+  }
+
+  const BeamPlanes<T> beam(org, corner_dirs);
+  if (!beam.Overlaps(nodes_[0].bmin, nodes_[0].bmax)) {
+    return;
+  }
+
+  entry_nodes->nodes[0] = 0;
+  entry_nodes->count = 1;
+
+  bool progress = true;
+  while (progress) {
+    progress = false;
+    for (unsigned int i = 0; i < entry_nodes->count; i++) {
+      const BVHNode<T> &node = nodes_[entry_nodes->nodes[i]];
+      if (node.flag != 0) {  // leaf
+        continue;
+      }
+
+      unsigned int children[2];
+      unsigned int num_children = 0;
+      for (int c = 0; c < 2; c++) {
+        const BVHNode<T> &child = nodes_[node.data[c]];
+        if (beam.Overlaps(child.bmin, child.bmax)) {
+          children[num_children++] = node.data[c];
+        }
+      }
+
+      if (num_children == 0) {
+        // Beam passes between the children. Drop this entry.
+        for (unsigned int j = i + 1; j < entry_nodes->count; j++) {
+          entry_nodes->nodes[j - 1] = entry_nodes->nodes[j];
+        }
+        entry_nodes->count--;
+        i--;
+        progress = true;
+      } else if (num_children == 1) {
+        entry_nodes->nodes[i] = children[0];
+        progress = true;
+      } else if (entry_nodes->count < max_entry_nodes) {
+        // Split in place; the set is sorted once it stops changing.
+        for (unsigned int j = entry_nodes->count; j > i + 1; j--) {
+          entry_nodes->nodes[j] = entry_nodes->nodes[j - 1];
+        }
+        entry_nodes->nodes[i] = children[0];
+        entry_nodes->nodes[i + 1] = children[1];
+        entry_nodes->count++;
+        i++;
+        progress = true;
+      }
+    }
+  }
+
+  // Near to far, so traversal reaches likely closest hits first.
+  T dist[kNANORT_MAX_ENTRY_NODES];
+  for (unsigned int i = 0; i < entry_nodes->count; i++) {
+    const BVHNode<T> &node = nodes_[entry_nodes->nodes[i]];
+    dist[i] = beam.EntryDistance(node.bmin, node.bmax);
+  }
+  for (unsigned int i = 1; i < entry_nodes->count; i++) {
+    const unsigned int index = entry_nodes->nodes[i];
+    const T d = dist[i];
+    unsigned int j = i;
+    for (; j > 0 && dist[j - 1] > d; j--) {
+      entry_nodes->nodes[j] = entry_nodes->nodes[j - 1];
+      dist[j] = dist[j - 1];
+    }
+    entry_nodes->nodes[j] = index;
+    dist[j] = d;
+  }
+}
+
 template <typename T>
 inline bool IntersectRayAABB(T *tminOut,  // [out]
                              T *tmaxOut,  // [out]
@@ -2336,6 +3493,136 @@ inline bool IntersectRayAABB<double>(double *tminOut,  // [out]
   return false;  // no hit
 }
 
+///
+/// Ray vs AABB slab test with the per ray part(origin, inverse direction and
+/// which plane of each slab is the near one) set up once per traversal.
+/// Same results as IntersectRayAABB().
+///
+template <typename T>
+class RayAABBTester {
+ public:
+  RayAABBTester(const real3<T> &ray_org, const real3<T> &ray_inv_dir,
+                const int dir_sign[3])
+      : ray_org_(ray_org), ray_inv_dir_(ray_inv_dir) {
+    dir_sign_[0] = dir_sign[0];
+    dir_sign_[1] = dir_sign[1];
+    dir_sign_[2] = dir_sign[2];
+  }
+
+  bool Intersect(T *tmin_out, T *tmax_out, T min_t, T max_t,
+                 const BVHNode<T> &node) const {
+    int dir_sign[3] = {dir_sign_[0], dir_sign_[1], dir_sign_[2]};
+    return IntersectRayAABB(tmin_out, tmax_out, min_t, max_t, node.bmin,
+                            node.bmax, ray_org_, ray_inv_dir_, dir_sign);
+  }
+
+ private:
+  real3<T> ray_org_;
+  real3<T> ray_inv_dir_;
+  int dir_sign_[3];
+};
+
+#ifdef NANORT_USE_SSE2
+///
+/// All three slabs in one SSE register. The lanes are xyz plus a pad lane
+/// whose inverse direction is NaN: max/min below return their second operand
+/// for NaN(like safemax/safemin), so the pad lane never wins, and neither
+/// does an axis where 0 * inf gave NaN.
+///
+template <>
+class RayAABBTester<float> {
+ public:
+  RayAABBTester(const real3<float> &ray_org, const real3<float> &ray_inv_dir,
+                const int dir_sign[3]) {
+    ray_org_ = _mm_set_ps(0.0f, ray_org[2], ray_org[1], ray_org[0]);
+    ray_inv_dir_ =
+        _mm_set_ps(std::numeric_limits<float>::quiet_NaN(), ray_inv_dir[2],
+                   ray_inv_dir[1], ray_inv_dir[0]);
+    sign_mask_ = _mm_castsi128_ps(
+        _mm_set_epi32(0, dir_sign[2] ? -1 : 0, dir_sign[1] ? -1 : 0,
+                      dir_sign[0] ? -1 : 0));
+  }
+
+  bool Intersect(float *tmin_out, float *tmax_out, float min_t, float max_t,
+                 const BVHNode<float> &node) const {
+    // bmin[3] and bmax[3] are adjacent in BVHNode, so both loads stay inside
+    // the node and every lane holds a real coordinate.
+    const float *bounds = node.bmin;
+    const __m128 lo = _mm_loadu_ps(bounds);             // bmin xyz, bmax x
+    const __m128 shifted = _mm_loadu_ps(bounds + 2);    // bmin z, bmax xyz
+    const __m128 hi = _mm_shuffle_ps(shifted, shifted,  // bmax xyz, bmin z
+                                     _MM_SHUFFLE(0, 3, 2, 1));
+
+    const __m128 near_plane =
+        _mm_or_ps(_mm_and_ps(sign_mask_, hi), _mm_andnot_ps(sign_mask_, lo));
+    const __m128 far_plane =
+        _mm_or_ps(_mm_and_ps(sign_mask_, lo), _mm_andnot_ps(sign_mask_, hi));
+
+    const __m128 t_near =
+        _mm_mul_ps(_mm_sub_ps(near_plane, ray_org_), ray_inv_dir_);
+    // MaxMult robust BVH traversal(up to 4 ulp).
+    const __m128 t_far =
+        _mm_mul_ps(_mm_mul_ps(_mm_sub_ps(far_plane, ray_org_), ray_inv_dir_),
+                   _mm_set1_ps(1.00000024f));
+
+    __m128 tmin = _mm_max_ps(t_near, _mm_set1_ps(min_t));
+    __m128 tmax = _mm_min_ps(t_far, _mm_set1_ps(max_t));
+    tmin = _mm_max_ps(tmin, _mm_shuffle_ps(tmin, tmin, _MM_SHUFFLE(1, 0, 3, 2)));
+    tmax = _mm_min_ps(tmax, _mm_shuffle_ps(tmax, tmax, _MM_SHUFFLE(1, 0, 3, 2)));
+    tmin = _mm_max_ps(tmin, _mm_shuffle_ps(tmin, tmin, _MM_SHUFFLE(2, 3, 0, 1)));
+    tmax = _mm_min_ps(tmax, _mm_shuffle_ps(tmax, tmax, _MM_SHUFFLE(2, 3, 0, 1)));
+
+    const float tmin_s = _mm_cvtss_f32(tmin);
+    const float tmax_s = _mm_cvtss_f32(tmax);
+    if (tmin_s <= tmax_s) {
+      (*tmin_out) = tmin_s;
+      (*tmax_out) = tmax_s;
+
+      return true;
+    }
+    return false;  // no hit
+  }
+
+ private:
+  __m128 ray_org_;
+  __m128 ray_inv_dir_;
+  __m128 sign_mask_;
+};
+#endif
+
+///
+/// Per ray part of every Traverse*(): the origin, the inverse direction and
+/// which plane of each slab is the near one, taken from the ray when
+/// BVHTraceOptions::use_ray_inv_dir is set and computed otherwise.
+///
+template <typename T>
+inline void SetupRayTraversal(const Ray<T> &ray, const BVHTraceOptions &options,
+                              int dir_sign[3], real3<T> *ray_org,
+                              real3<T> *ray_inv_dir) {
+  if (options.use_ray_inv_dir) {
+    dir_sign[0] = ray.dir_sign[0];
+    dir_sign[1] = ray.dir_sign[1];
+    dir_sign[2] = ray.dir_sign[2];
+
+    (*ray_inv_dir) = real3<T>(ray.inv_dir);
+  } else {
+    dir_sign[0] = ray.dir[0] < static_cast<T>(0.0) ? 1 : 0;
+    dir_sign[1] = ray.dir[1] < static_cast<T>(0.0) ? 1 : 0;
+    dir_sign[2] = ray.dir[2] < static_cast<T>(0.0) ? 1 : 0;
+
+    real3<T> ray_dir;
+    ray_dir[0] = ray.dir[0];
+    ray_dir[1] = ray.dir[1];
+    ray_dir[2] = ray.dir[2];
+
+    (*ray_inv_dir) = vsafe_inverse(ray_dir);
+  }
+
+  (*ray_org)[0] = ray.org[0];
+  (*ray_org)[1] = ray.org[1];
+  (*ray_org)[2] = ray.org[2];
+}
+
 template <typename T>
 template <class I>
 inline bool BVHAccel<T>::TestLeafNode(const BVHNode<T> &node, const Ray<T> &ray,
@@ -2357,8 +3644,11 @@ inline bool BVHAccel<T>::TestLeafNode(const BVHNode<T> &node, const Ray<T> &ray,
   ray_dir[1] = ray.dir[1];
   ray_dir[2] = ray.dir[2];
 
+  // NULL after ReleaseIndices(): primitives are stored in leaf order.
+  const unsigned int *indices = indices_.empty() ? NULL : &indices_[0];
+
   for (unsigned int i = 0; i < num_primitives; i++) {
-    unsigned int prim_idx = indices_[i + offset];
+    unsigned int prim_idx = indices ? indices[i + offset] : i + offset;
 
     T local_t = t;
     if (intersector.Intersect(&local_t, prim_idx)) {
@@ -2451,6 +3741,9 @@ template <typename T>
 template <class I, class H>
 bool BVHAccel<T>::Traverse(const Ray<T> &ray, const I &intersector, H *isect,
                            const BVHTraceOptions &options) const {
+#if defined(NANORT_ENABLE_STACKLESS_TRAVERSAL)
+  return TraverseStackless(ray, intersector, isect, options);
+#else
   const int kMaxStackDepth = 512;
   (void)kMaxStackDepth;
 
@@ -2460,40 +3753,39 @@ bool BVHAccel<T>::Traverse(const Ray<T> &ray, const I &intersector, H *isect,
   unsigned int node_stack[512];
   node_stack[0] = 0;
 
+  if (options.entry_nodes) {
+    // Beam entry points, nearest on top.
+    node_stack_index = -1;
+    for (unsigned int i = options.entry_nodes->count; i > 0; i--) {
+      node_stack[++node_stack_index] = options.entry_nodes->nodes[i - 1];
+    }
+  }
+
   // Init isect info as no hit
   intersector.Update(hit_t, static_cast<unsigned int>(-1));
 
   intersector.PrepareTraversal(ray, options);
 
   int dir_sign[3];
-  dir_sign[0] = ray.dir[0] < static_cast<T>(0.0) ? 1 : 0;
-  dir_sign[1] = ray.dir[1] < static_cast<T>(0.0) ? 1 : 0;
-  dir_sign[2] = ray.dir[2] < static_cast<T>(0.0) ? 1 : 0;
-
-  real3<T> ray_inv_dir;
-  real3<T> ray_dir;
-  ray_dir[0] = ray.dir[0];
-  ray_dir[1] = ray.dir[1];
-  ray_dir[2] = ray.dir[2];
-
-  ray_inv_dir = vsafe_inverse(ray_dir);
-
-  real3<T> ray_org;
-  ray_org[0] = ray.org[0];
-  ray_org[1] = ray.org[1];
-  ray_org[2] = ray.org[2];
+  real3<T> ray_org, ray_inv_dir;
+  SetupRayTraversal(ray, options, dir_sign, &ray_org, &ray_inv_dir);
+  const RayAABBTester<T> box_test(ray_org, ray_inv_dir, dir_sign);
 
   T min_t = std::numeric_limits<T>::max();
   T max_t = -std::numeric_limits<T>::max();
 
+  size_t num_node_visits = 0;
+  size_t num_leaf_visits = 0;
+  size_t num_primitive_tests = 0;
+
   while (node_stack_index >= 0) {
     unsigned int index = node_stack[node_stack_index];
     const BVHNode<T> &node = nodes_[index];
 
     node_stack_index--;
+    num_node_visits++;
 
-    bool hit = IntersectRayAABB(&min_t, &max_t, ray.min_t, hit_t, node.bmin,
-                                node.bmax, ray_org, ray_inv_dir, dir_sign);
+    bool hit = box_test.Intersect(&min_t, &max_t, ray.min_t, hit_t, node);
 
     if (node.flag == 0) {  // branch node
       if (hit) {
@@ -2506,6 +3798,8 @@ bool BVHAccel<T>::Traverse(const Ray<T> &ray, const I &intersector, H *isect,
       }
     } else {  // leaf node
       if (hit) {
+        num_leaf_visits++;
+        num_primitive_tests += node.data[0];
         if (TestLeafNode(node, ray, intersector)) {
           hit_t = intersector.GetT();
         }
@@ -2515,6 +3809,282 @@ bool BVHAccel<T>::Traverse(const Ray<T> &ray, const I &intersector, H *isect,
 
   assert(node_stack_index < kMaxStackDepth);
 
+  if (options.stats) {
+    options.stats->num_rays++;
+    options.stats->num_node_visits += num_node_visits;
+    options.stats->num_box_tests += num_node_visits;  // one per visit
+    options.stats->num_leaf_visits += num_leaf_visits;
+    options.stats->num_primitive_tests += num_primitive_tests;
+  }
+
+  bool hit = (intersector.GetT() < ray.max_t);
+  intersector.PostTraversal(ray, hit, isect);
+
+  return hit;
+#endif  // NANORT_ENABLE_STACKLESS_TRAVERSAL
+}
+
+template <typename T>
+template <class I, class H>
+bool BVHAccel<T>::TraverseOrdered(const Ray<T> &ray, const I &intersector,
+                                  H *isect,
+                                  const BVHTraceOptions &options) const {
+  const int kMaxStackDepth = 512;
+  (void)kMaxStackDepth;
+
+  T hit_t = ray.max_t;
+
+  // Nodes whose box is already known to be hit, with the entry t of that hit.
+  int node_stack_index = -1;
+  unsigned int node_stack[512];
+  T node_stack_t[512];
+
+  // Init isect info as no hit
+  intersector.Update(hit_t, static_cast<unsigned int>(-1));
+
+  intersector.PrepareTraversal(ray, options);
+
+  int dir_sign[3];
+  real3<T> ray_org, ray_inv_dir;
+  SetupRayTraversal(ray, options, dir_sign, &ray_org, &ray_inv_dir);
+  const RayAABBTester<T> box_test(ray_org, ray_inv_dir, dir_sign);
+
+  T min_t = std::numeric_limits<T>::max();
+  T max_t = -std::numeric_limits<T>::max();
+
+  size_t num_node_visits = 0;
+  size_t num_box_tests = 0;
+  size_t num_leaf_visits = 0;
+  size_t num_primitive_tests = 0;
+  size_t num_culled_nodes = 0;
+
+  if (options.entry_nodes) {
+    // Beam entry points, nearest on top.
+    for (unsigned int i = options.entry_nodes->count; i > 0; i--) {
+      const unsigned int index = options.entry_nodes->nodes[i - 1];
+      num_box_tests++;
+      if (box_test.Intersect(&min_t, &max_t, ray.min_t, hit_t,
+                             nodes_[index])) {
+        node_stack_index++;
+        node_stack[node_stack_index] = index;
+        node_stack_t[node_stack_index] = min_t;
+      }
+    }
+  } else if (!nodes_.empty()) {
+    num_box_tests++;
+    if (box_test.Intersect(&min_t, &max_t, ray.min_t, hit_t, nodes_[0])) {
+      node_stack_index++;
+      node_stack[node_stack_index] = 0;
+      node_stack_t[node_stack_index] = min_t;
+    }
+  }
+
+  while (node_stack_index >= 0) {
+    unsigned int index = node_stack[node_stack_index];
+    const T entry_t = node_stack_t[node_stack_index];
+
+    node_stack_index--;
+
+    if (entry_t > hit_t) {
+      // A closer hit was found since the node was pushed.
+      num_culled_nodes++;
+      continue;
+    }
+
+    // Walk down the nearer hit child, stacking the farther one.
+    for (;;) {
+      const BVHNode<T> &node = nodes_[index];
+      num_node_visits++;
+
+      if (node.flag != 0) {  // leaf node
+        num_leaf_visits++;
+        num_primitive_tests += node.data[0];
+        if (TestLeafNode(node, ray, intersector)) {
+          hit_t = intersector.GetT();
+        }
+        break;
+      }
+
+      const unsigned int child0 = node.data[0];
+      const unsigned int child1 = node.data[1];
+
+      T t0_min, t0_max, t1_min, t1_max;
+      const bool hit0 = box_test.Intersect(&t0_min, &t0_max, ray.min_t, hit_t,
+                                           nodes_[child0]);
+      const bool hit1 = box_test.Intersect(&t1_min, &t1_max, ray.min_t, hit_t,
+                                           nodes_[child1]);
+      num_box_tests += 2;
+
+      if (hit0 && hit1) {
+        // Ties(e.g. origin inside both boxes) fall back to the split axis
+        // order Traverse() uses.
+        const bool child1_first =
+            (t1_min < t0_min) ||
+            ((t1_min == t0_min) && (dir_sign[node.axis] != 0));
+        node_stack_index++;
+        if (child1_first) {
+          node_stack[node_stack_index] = child0;
+          node_stack_t[node_stack_index] = t0_min;
+          index = child1;
+        } else {
+          node_stack[node_stack_index] = child1;
+          node_stack_t[node_stack_index] = t1_min;
+          index = child0;
+        }
+      } else if (hit0) {
+        index = child0;
+      } else if (hit1) {
+        index = child1;
+      } else {
+        break;
+      }
+    }
+  }
+
+  assert(node_stack_index < kMaxStackDepth);
+
+  if (options.stats) {
+    options.stats->num_rays++;
+    options.stats->num_node_visits += num_node_visits;
+    options.stats->num_box_tests += num_box_tests;
+    options.stats->num_leaf_visits += num_leaf_visits;
+    options.stats->num_primitive_tests += num_primitive_tests;
+    options.stats->num_culled_nodes += num_culled_nodes;
+  }
+
+  bool hit = (intersector.GetT() < ray.max_t);
+  intersector.PostTraversal(ray, hit, isect);
+
+  return hit;
+}
+
+template <typename T>
+template <class I>
+void BVHAccel<T>::TraverseSubtreeStackless(
+    unsigned int root, const Ray<T> &ray, const I &intersector, T *hit_t,
+    const RayAABBTester<T> &box_test, const int dir_sign[3],
+    BVHTraceStatistics *stats) const {
+  enum { FROM_PARENT, FROM_SIBLING, FROM_CHILD };
+
+  T min_t = std::numeric_limits<T>::max();
+  T max_t = -std::numeric_limits<T>::max();
+
+  size_t num_node_visits = 1;
+  size_t num_leaf_visits = 0;
+  size_t num_primitive_tests = 0;
+
+  unsigned int current = root;
+  int state = FROM_CHILD;  // nothing to do unless the root box is hit
+
+  if (box_test.Intersect(&min_t, &max_t, ray.min_t, *hit_t, nodes_[root])) {
+    const BVHNode<T> &node = nodes_[root];
+    if (node.flag == 0) {
+      current = node.data[dir_sign[node.axis]];  // near child
+      state = FROM_PARENT;
+    } else {
+      num_leaf_visits++;
+      num_primitive_tests += node.data[0];
+      if (TestLeafNode(node, ray, intersector)) {
+        *hit_t = intersector.GetT();
+      }
+    }
+  }
+
+  //
+  // FROM_PARENT : `current` is the near child, entered from above.
+  // FROM_SIBLING: `current` is the far child, its near sibling is done.
+  // FROM_CHILD  : the subtree below `current` is done.
+  //
+  for (;;) {
+    if (state == FROM_CHILD) {
+      if (current == root) {
+        break;
+      }
+      const unsigned int parent = parents_[current];
+      const BVHNode<T> &parent_node = nodes_[parent];
+      const unsigned int near_child = parent_node.data[dir_sign[parent_node.axis]];
+      if (current == near_child) {
+        current = parent_node.data[1 - dir_sign[parent_node.axis]];
+        state = FROM_SIBLING;
+      } else {
+        current = parent;
+      }
+      continue;
+    }
+
+    const BVHNode<T> &node = nodes_[current];
+    num_node_visits++;
+
+    const bool hit =
+        box_test.Intersect(&min_t, &max_t, ray.min_t, *hit_t, node);
+
+    if (hit && node.flag == 0) {
+      current = node.data[dir_sign[node.axis]];  // near child
+      state = FROM_PARENT;
+      continue;
+    }
+
+    if (hit) {  // leaf node
+      num_leaf_visits++;
+      num_primitive_tests += node.data[0];
+      if (TestLeafNode(node, ray, intersector)) {
+        *hit_t = intersector.GetT();
+      }
+    }
+
+    const unsigned int parent = parents_[current];
+    if (state == FROM_PARENT) {
+      // Near child done, go to the far one.
+      const BVHNode<T> &parent_node = nodes_[parent];
+      current = parent_node.data[1 - dir_sign[parent_node.axis]];
+      state = FROM_SIBLING;
+    } else {
+      // Far child done, so is the parent.
+      current = parent;
+      state = FROM_CHILD;
+    }
+  }
+
+  if (stats) {
+    stats->num_node_visits += num_node_visits;
+    stats->num_box_tests += num_node_visits;  // one per visit
+    stats->num_leaf_visits += num_leaf_visits;
+    stats->num_primitive_tests += num_primitive_tests;
+  }
+}
+
+template <typename T>
+template <class I, class H>
+bool BVHAccel<T>::TraverseStackless(const Ray<T> &ray, const I &intersector,
+                                    H *isect,
+                                    const BVHTraceOptions &options) const {
+  T hit_t = ray.max_t;
+
+  // Init isect info as no hit
+  intersector.Update(hit_t, static_cast<unsigned int>(-1));
+
+  intersector.PrepareTraversal(ray, options);
+
+  int dir_sign[3];
+  real3<T> ray_org, ray_inv_dir;
+  SetupRayTraversal(ray, options, dir_sign, &ray_org, &ray_inv_dir);
+  const RayAABBTester<T> box_test(ray_org, ray_inv_dir, dir_sign);
+
+  if (options.stats) {
+    options.stats->num_rays++;
+  }
+
+  if (options.entry_nodes) {
+    // Beam entry points, near to far.
+    for (unsigned int i = 0; i < options.entry_nodes->count; i++) {
+      TraverseSubtreeStackless(options.entry_nodes->nodes[i], ray, intersector,
+                               &hit_t, box_test, dir_sign, options.stats);
+    }
+  } else if (!nodes_.empty()) {
+    TraverseSubtreeStackless(0, ray, intersector, &hit_t, box_test, dir_sign,
+                             options.stats);
+  }
+
   bool hit = (intersector.GetT() < ray.max_t);
   intersector.PostTraversal(ray, hit, isect);
 
@@ -2545,8 +4115,11 @@ inline bool BVHAccel<T>::TestLeafNodeIntersections(
 
   intersector.PrepareTraversal(ray);
 
+  // NULL after ReleaseIndices(): primitives are stored in leaf order.
+  const unsigned int *indices = indices_.empty() ? NULL : &indices_[0];
+
   for (unsigned int i = 0; i < num_primitives; i++) {
-    unsigned int prim_idx = indices_[i + offset];
+    unsigned int prim_idx = indices ? indices[i + offset] : i + offset;
 
     T min_t, max_t;
     if (intersector.Intersect(&min_t, &max_t, prim_idx)) {
@@ -2612,6 +4185,8 @@ bool BVHAccel<T>::ListNodeIntersections(
   ray_org[1] = ray.org[1];
   ray_org[2] = ray.org[2];
 
+  const RayAABBTester<T> box_test(ray_org, ray_inv_dir, dir_sign);
+
   T min_t, max_t;
   while (node_stack_index >= 0) {
     unsigned int index = node_stack[node_stack_index];
@@ -2619,8 +4194,7 @@ bool BVHAccel<T>::ListNodeIntersections(
 
     node_stack_index--;
 
-    bool hit = IntersectRayAABB(&min_t, &max_t, ray.min_t, hit_t, node.bmin,
-                                node.bmax, ray_org, ray_inv_dir, dir_sign);
+    bool hit = box_test.Intersect(&min_t, &max_t, ray.min_t, hit_t, node);
 
     if (node.flag == 0) {  // branch node
       if (hit) {